@@ -1,7 +1,13 @@
+#include <poll.h>
 #include "admin.h"
 
+static SlabPool argsSlab = SLAB_POOL("admin args",
+        sizeof(AdminClientThreadArgs));
+static SlabPool sessionSlab = SLAB_POOL("admin sessions",
+        sizeof(AdminSession));
+
 // thanks to http://beej.us/guide/bgipc/output/html/multipage/unixsock.html
-int make_control_socket(char *path) {
+int bind_unix_socket(char *path, const char *what) {
     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock == -1) {
         perror("Creating socket");
@@ -19,39 +25,332 @@ int make_control_socket(char *path) {
     size_t len = sizeof(main.sun_family) + sizeof(main.sun_path);
 
     if (bind(sock, (struct sockaddr*) &main, len)) {
-        perror("Error binding to control socket");
+        fprintf(stderr, "Error binding to %s: %s\n", what, strerror(errno));
         exit(1);
     }
 
     // we have a file descriptor!
-    printf("Bound to control socket at %s\n", path);
+    printf("Bound to %s at %s\n", what, path);
 
     return sock;
 }
 
-/* handles a single connected admin client
+int make_control_socket(char *path) {
+    return bind_unix_socket(path, "control socket");
+}
+
+/* the program-wide numbers, as for "stats" */
+void admin_report_stats(FILE* out, ProgStats* progStats) {
+    StatsSnapshot snap;
+    stats_snapshot(progStats, &snap);
+    fprintf(out, "users: %ld\n", snap.currentUsers);
+    fprintf(out, "peak users: %ld\n", snap.peakUsers);
+    fprintf(out, "accepted: %ld\n", snap.accepted);
+    fprintf(out, "bytes in: %ld\n", snap.bytesIn);
+    fprintf(out, "bytes out: %ld\n", snap.bytesOut);
+    fprintf(out, "read errors: %ld\n", snap.readErrors);
+    fprintf(out, "write errors: %ld\n", snap.writeErrors);
+    fprintf(out, "timeouts: idle %ld, read %ld, lifetime %ld\n",
+            snap.timeoutIdle, snap.timeoutRead, snap.timeoutLifetime);
+    fprintf(out, "backpressure pauses: %ld\n", snap.outputPauses);
+    if (lines_enabled()) {
+        fprintf(out, "lines: %ld, %ld too long\n", snap.lines, snap.longLines);
+    }
+    fprintf(out, "throttled: conn bytes %ld, conn msgs %ld, ip bytes %ld,"
+            " ip msgs %ld\n", snap.throttleConnBytes, snap.throttleConnMsgs,
+            snap.throttleIpBytes, snap.throttleIpMsgs);
+    if (snap.fairYields) {
+        fprintf(out, "fair-share yields: %ld\n", snap.fairYields);
+    }
+    fprintf(out, "turned away: max_users %ld, accept_rate %ld, latency %ld,"
+            " queue %ld; accepting paused %ld times\n", snap.rejectUsers,
+            snap.rejectRate, snap.rejectLatency, snap.rejectQueue,
+            snap.acceptPauses);
+    if (udp_socket_count()) {
+        fprintf(out, "datagrams: %ld in, %ld out, %ld dropped, %ld/s\n",
+                snap.datagramsIn, snap.datagramsOut, snap.datagramDrops,
+                udp_rate());
+    }
+    if (snap.localUsers || snap.ringUsers) {
+        fprintf(out, "local: %ld users over unix sockets, %ld over rings"
+                " (%d now, %ld wakeups)\n", snap.localUsers, snap.ringUsers,
+                shmring_clients(), snap.ringWakeups);
+    }
+    fprintf(out, "log drops: %ld\n", log_drops());
+    user_report_shards(out);
+    udp_report(out);
+    shmring_report(out);
+    user_report_pool(out, 0);
+}
+
+/* hands out the next line the admin sent, without its newline
+ * returns 1 with *line set, 0 on EOF (or error), or -1 if timeoutMs
+ * (unless negative) passes first
+ * over-long lines are thrown away */
+static int admin_read_line(AdminSession* session, char** line,
+        int timeoutMs) {
+    // the line handed out last time is finished with now
+    session->inLen -= session->lineLen;
+    memmove(session->in, session->in + session->lineLen, session->inLen);
+    session->lineLen = 0;
+    while (1) {
+        char *newline = memchr(session->in, '\n', session->inLen);
+        if (newline != NULL) {
+            *newline = '\0';
+            session->lineLen = newline - session->in + 1;
+            *line = session->in;
+            return 1;
+        }
+        if (session->inLen == ADMIN_LINE_MAX) {
+            session->inLen = 0;
+        }
+        if (timeoutMs >= 0) {
+            struct pollfd pfd = { session->fd, POLLIN, 0 };
+            int ready = poll(&pfd, 1, timeoutMs);
+            if (ready == 0) {
+                return -1;
+            }
+            if (ready < 0 && errno != EINTR) {
+                return 0;
+            }
+        }
+        ssize_t n = read(session->fd, session->in + session->inLen,
+                ADMIN_LINE_MAX - session->inLen);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            return 0;
+        }
+        if (n > 0) {
+            session->inLen += n;
+        }
+    }
+}
+
+/* puts the line last handed out back, to be read again */
+static void admin_unread_line(AdminSession* session) {
+    session->in[session->lineLen - 1] = '\n';
+    session->lineLen = 0;
+}
+
+static int cmd_help(AdminSession*, int, char**);
+
+static int cmd_stats(AdminSession* session, int argc, char** argv) {
+    admin_report_stats(session->out, session->args->progStats);
+    return 1;
+}
+
+static int cmd_pool(AdminSession* session, int argc, char** argv) {
+    user_report_pool(session->out, 1);
+    return 1;
+}
+
+static int cmd_peers(AdminSession* session, int argc, char** argv) {
+    station_report(session->out);
+    return 1;
+}
+
+static int cmd_slabs(AdminSession* session, int argc, char** argv) {
+    slab_report(session->out);
+    return 1;
+}
+
+static int cmd_placement(AdminSession* session, int argc, char** argv) {
+    placement_report(session->out);
+    return 1;
+}
+
+/* only returns if the handover couldn't happen */
+static int cmd_handover(AdminSession* session, int argc, char** argv) {
+    fflush(session->out);
+    const char *error = handover_give(session->fd,
+            session->args->progStats);
+    fprintf(session->out, "error: %s\n", error);
+    return 1;
+}
+
+static int cmd_conns(AdminSession* session, int argc, char** argv) {
+    int limit = argc > 1 ? atoi(argv[1]) : ADMIN_CONNS_DEFAULT;
+    conn_report(session->out, limit > 0 ? limit : ADMIN_CONNS_DEFAULT);
+    return 1;
+}
+
+static int cmd_histo(AdminSession* session, int argc, char** argv) {
+    histo_report(session->out);
+    if (argc > 1 && !strcmp(argv[1], "reset")) {
+        histo_reset();
+        fprintf(session->out, "histograms reset\n");
+    }
+    return 1;
+}
+
+static int cmd_set(AdminSession* session, int argc, char** argv) {
+    if (argc == 1) {
+        tunable_report(session->out);
+        return 1;
+    }
+    char *end;
+    long value = argc == 3 ? strtol(argv[2], &end, 10) : 0;
+    if (argc != 3 || *end != '\0') {
+        fprintf(session->out, "error: usage: set [name value]\n");
+        return 1;
+    }
+    switch (tunable_set(argv[1], value)) {
+        case 0:
+            fprintf(session->out, "%s = %ld\n", argv[1], value);
+            break;
+        case -1:
+            fprintf(session->out, "error: no tunable called %s\n", argv[1]);
+            break;
+        default:
+            fprintf(session->out, "error: %ld is out of range for %s\n",
+                    value, argv[1]);
+    }
+    return 1;
+}
+
+/* pushes stats every interval until the admin sends anything, which is
+ * then run as the next command */
+static int cmd_watch(AdminSession* session, int argc, char** argv) {
+    double interval = argc > 1 ? atof(argv[1]) : 1;
+    if (interval < ADMIN_WATCH_MIN) {
+        fprintf(session->out, "error: interval must be at least %gs\n",
+                ADMIN_WATCH_MIN);
+        return 1;
+    }
+    char *line;
+    while (1) {
+        admin_report_stats(session->out, session->args->progStats);
+        fprintf(session->out, "end\n");
+        if (fflush(session->out)) {
+            return 0;
+        }
+        switch (admin_read_line(session, &line, interval * 1000)) {
+            case 0:
+                return 0;
+            case 1:
+                admin_unread_line(session);
+                fprintf(session->out, "watch stopped\n");
+                return 1;
+        }
+    }
+}
+
+static int cmd_transform(AdminSession* session, int argc, char** argv) {
+    const char *error;
+    if (argc == 2 && (error = transform_configure(argv[1])) != NULL) {
+        fprintf(session->out, "error: %s\n", error);
+        return 1;
+    }
+    if (argc > 2) {
+        fprintf(session->out, "error: usage: transform [stage,stage...]\n");
+        return 1;
+    }
+    transform_report(session->out);
+    return 1;
+}
+
+static int cmd_quit(AdminSession* session, int argc, char** argv) {
+    return 0;
+}
+
+static const AdminCommand commands[] = {
+    {"help", "", "list commands", cmd_help},
+    {"stats", "", "program-wide and per-shard counters", cmd_stats},
+    {"conns", "[max]", "list connected users", cmd_conns},
+    {"pool", "", "worker pool queues and steals, per worker", cmd_pool},
+    {"peers", "", "links to other stations: throughput and queue depth",
+            cmd_peers},
+    {"slabs", "", "objects in use and free in each slab pool", cmd_slabs},
+    {"placement", "", "NUMA nodes, and the CPUs each serving thread may use",
+            cmd_placement},
+    {"histo", "[reset]", "latency percentiles, optionally clearing them",
+            cmd_histo},
+    {"set", "[name value]", "list tunables, or change one", cmd_set},
+    {"transform", "[stage,stage...]",
+            "the echo pipeline and its stages' counts and timing, or a new one",
+            cmd_transform},
+    {"watch", "[seconds]", "push stats every interval until told otherwise",
+            cmd_watch},
+    {"handover", "", "give every user to the new thomas asking, and exit",
+        cmd_handover},
+    {"quit", "", "hang up", cmd_quit},
+    {NULL, NULL, NULL, NULL}
+};
+
+static int cmd_help(AdminSession* session, int argc, char** argv) {
+    for (const AdminCommand *c = commands; c->name != NULL; ++c) {
+        fprintf(session->out, "%s %s - %s\n", c->name, c->usage, c->help);
+    }
+    return 1;
+}
+
+/* runs one command line, ending the reply with "end"
+ * returns 0 if the admin should be hung up on */
+int admin_run_command(AdminSession* session, char* line) {
+    char *argv[ADMIN_MAX_ARGS];
+    int argc = 0;
+    char *save = NULL; // sessions each have a thread: no strtok
+    for (char *word = strtok_r(line, " \t\r", &save); word != NULL &&
+            argc < ADMIN_MAX_ARGS; word = strtok_r(NULL, " \t\r", &save)) {
+        argv[argc++] = word;
+    }
+    if (argc == 0) {
+        return 1;
+    }
+    int keepGoing = 1;
+    const AdminCommand *c;
+    for (c = commands; c->name != NULL; ++c) {
+        if (!strcmp(c->name, argv[0])) {
+            keepGoing = c->run(session, argc, argv);
+            break;
+        }
+    }
+    if (c->name == NULL) {
+        fprintf(session->out, "error: unknown command %s (try help)\n",
+                argv[0]);
+    }
+    if (keepGoing) {
+        fprintf(session->out, "end\n");
+    }
+    return keepGoing;
+}
+
+/* handles a single connected admin client until it leaves
  * takes a pointer to an instance of AdminClientThreadArgs */
 void* admin_client_thread(void* arg) {
     AdminClientThreadArgs *myArgs = (AdminClientThreadArgs*) arg;
     pthread_mutex_lock(&myArgs->adminStats->counterLock);
     int adminId = ++myArgs->adminStats->counter;
     pthread_mutex_unlock(&myArgs->adminStats->counterLock);
-    printf("Admin %d connected!\n", adminId);
-    FILE* write = fdopen(myArgs->fd, "w");
-    pthread_mutex_lock(&myArgs->progStats->currentUsersLock);
-    fprintf(write, "hello! we have %d users! goodbye!\n", 
-            myArgs->progStats->currentUsers);
-    pthread_mutex_unlock(&myArgs->progStats->currentUsersLock);
-    fflush(write);
-    /*
-    const char *message = "hello! goodbye!\n";
-    int len = strlen(message);
-    send(myArgs->fd, message, len+1, 0);
-    */
-
-    close(myArgs->fd);
-    printf("Admin %d disconnected!\n", adminId);
-    free(myArgs);
+    log_msg(LOG_LEVEL_INFO, "Admin %d connected!", adminId);
+
+    AdminSession *session = slab_alloc(&sessionSlab);
+    session->fd = myArgs->fd;
+    session->id = adminId;
+    session->inLen = session->lineLen = 0;
+    session->args = myArgs;
+    session->out = fdopen(myArgs->fd, "w");
+    StatsSnapshot snap;
+    stats_snapshot(myArgs->progStats, &snap);
+    fprintf(session->out, "hello! we have %ld users! (try help)\n",
+            snap.currentUsers);
+    fflush(session->out);
+
+    // e.g. socat - UNIX-CONNECT:control-socket, then "stats", "watch 1"
+    char *line;
+    while (admin_read_line(session, &line, -1) == 1) {
+        if (!admin_run_command(session, line)) {
+            break;
+        }
+        if (fflush(session->out)) {
+            break; // they've gone
+        }
+    }
+
+    fprintf(session->out, "goodbye!\n");
+    fclose(session->out); // closes myArgs->fd
+    log_msg(LOG_LEVEL_INFO, "Admin %d disconnected!", adminId);
+    slab_free(&sessionSlab, session);
+    slab_free(&argsSlab, myArgs);
     return NULL;
 }
 
@@ -70,8 +369,14 @@ void admin_begin_processing(int sock, AdminStats* adminStats,
     args->adminStats = adminStats;
     args->progStats = progStats;
     pthread_t threadId;
-    pthread_create(&threadId, NULL, admin_process_connections,
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    // its admins' threads inherit wherever this goes
+    int slot = placement_prepare(&attr, "admin", -1, 0);
+    pthread_create(&threadId, &attr, admin_process_connections,
             (void*) args);
+    placement_started(slot, threadId);
+    pthread_attr_destroy(&attr);
     pthread_detach(threadId);
 }
 
@@ -95,7 +400,7 @@ void* admin_process_connections(void* arg) {
             perror("Error accepting on control socket");
             exit(1);
         }
-        newArgs = malloc(sizeof(AdminClientThreadArgs));
+        newArgs = slab_alloc(&argsSlab);
         newArgs->fd = newSock;
         newArgs->s = remote;
         newArgs->adminStats = args->adminStats;
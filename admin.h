@@ -6,7 +6,9 @@
 // socat - UNIX-CONNECT:control-socket
 
 /* Contains admin functions relating to the control socket.
- * Multiple admin connections are possible
+ * Multiple admin connections are possible, and each one stays open:
+ * admins send one command per line and every reply ends with "end"
+ * (see "help" for the commands).
  */
 
 #include <sys/types.h>
@@ -15,6 +17,21 @@
 #include <unistd.h>
 #include <pthread.h>
 #include "shared.h"
+#include "user.h"
+#include "histo.h"
+#include "conn.h"
+#include "tunables.h"
+#include "logger.h"
+#include "handover.h"
+#include "slab.h"
+#include "udp.h"
+#include "shmring.h"
+#include "transform.h"
+
+#define ADMIN_LINE_MAX 512
+#define ADMIN_MAX_ARGS 8
+#define ADMIN_CONNS_DEFAULT 100 // connections listed by a bare "conns"
+#define ADMIN_WATCH_MIN 0.1 // seconds
 
 /* one instance is shared between admin threads */
 typedef struct {
@@ -44,7 +61,34 @@ typedef struct {
  * resembles "user_open_listen"
  */
 int make_control_socket(char *filename);
+/* the same for any AF_UNIX stream socket; what names it in messages */
+int bind_unix_socket(char *filename, const char *what);
+
+/* one admin's connection, as the command loop sees it */
+typedef struct {
+    int fd;
+    int id;
+    FILE* out; // replies go here; flushed after each command
+    char in[ADMIN_LINE_MAX]; // what they've sent that we haven't run yet
+    size_t inLen;
+    size_t lineLen; // the line last handed out, dropped on the next read
+    AdminClientThreadArgs* args;
+} AdminSession;
+
+/* an entry in the command table
+ * run returns 0 to hang up on the admin */
+typedef struct {
+    const char *name;
+    const char *usage;
+    const char *help;
+    int (*run)(AdminSession*, int argc, char** argv);
+} AdminCommand;
 
+/* the program-wide and per-shard numbers, as for "stats" */
+void admin_report_stats(FILE* out, ProgStats* progStats);
+/* runs one command line, ending the reply with "end"
+ * returns 0 if the admin should be hung up on */
+int admin_run_command(AdminSession* session, char* line);
 /* a single thread for a single user: tied to a file descriptor 
  * always returns NULL, returns when connection closes */
 void* admin_client_thread(void*);
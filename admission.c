@@ -0,0 +1,107 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "admission.h"
+#include "throttle.h"
+#include "tunables.h"
+#include "histo.h"
+
+static long maxUsers = 0, acceptRate = 0, latencyUs = 0, maxQueue = 0;
+static long pausing = 0;
+
+// shared by every acceptor; taken once per newcomer, so uncontended
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static TokenBucket accepts;
+static Histogram seen; // the echo times as of the last window
+static uint64_t windowAt = 0;
+static uint64_t windowP99 = 0;
+
+void admission_init(void) {
+    tunable_register("max_users", &maxUsers, 0, 1L << 30,
+            "users connected at once past which newcomers are refused;"
+            " 0 for no limit");
+    tunable_register("accept_rate", &acceptRate, 0, 1L << 30,
+            "new users let in per second; 0 for no limit");
+    tunable_register("admit_latency_us", &latencyUs, 0, 1L << 30,
+            "recent p99 echo time past which newcomers are refused;"
+            " 0 for no limit");
+    tunable_register("admit_queue", &maxQueue, 0, 1L << 30,
+            "pool engine: users waiting for a worker past which newcomers"
+            " are refused; 0 for no limit");
+    tunable_register("admit_pause", &pausing, 0, 1,
+            "1 to stop accepting while over a limit, 0 to turn people away");
+}
+
+int admission_pausing(void) {
+    return tunable_get(&pausing);
+}
+
+/* the p99 of the echoes timed since the last window, which is moved on
+ * if it's over; call with the lock held
+ * windows are only taken when someone's knocking, so after a quiet spell
+ * one covers all of it; the next is then taken sooner, so that a
+ * slow patch that's over doesn't keep people out for long */
+static uint64_t recent_p99(uint64_t now) {
+    uint64_t windowNs = ADMISSION_WINDOW_MS * 1000000ULL;
+    if (now - windowAt < windowNs) {
+        return windowP99;
+    }
+    static Histogram merged, window; // 8KB each: not on the stack
+    histo_merge(HISTO_ECHO, &merged);
+    if (merged.count >= seen.count) {
+        window.count = 0;
+        for (int i = 0; i < HISTO_BUCKETS; ++i) {
+            // an admin's histo reset can race with this: never go negative
+            window.bucket[i] = merged.bucket[i] > seen.bucket[i]
+                    ? merged.bucket[i] - seen.bucket[i] : 0;
+            window.count += window.bucket[i];
+        }
+        window.max = merged.max;
+        windowP99 = histo_percentile(&window, 0.99);
+    } else {
+        // reset since: it's all recent
+        windowP99 = histo_percentile(&merged, 0.99);
+    }
+    seen = merged;
+    if (now - windowAt > 2 * windowNs) {
+        windowAt = now - windowNs + ADMISSION_PAUSE_MS * 1000000ULL;
+    } else {
+        windowAt = now;
+    }
+    return windowP99;
+}
+
+AdmitVerdict admission_check(long users, long queued) {
+    long cap = tunable_get(&maxUsers), rate = tunable_get(&acceptRate);
+    long latency = tunable_get(&latencyUs), depth = tunable_get(&maxQueue);
+    if (cap && users >= cap) {
+        return ADMIT_USERS;
+    }
+    if (depth && queued >= depth) {
+        return ADMIT_QUEUE;
+    }
+    if (!rate && !latency) {
+        return ADMIT_OK;
+    }
+    AdmitVerdict verdict = ADMIT_OK;
+    uint64_t now = histo_now();
+    pthread_mutex_lock(&lock);
+    if (latency && recent_p99(now) > latency * 1000ULL) {
+        verdict = ADMIT_LATENCY;
+    } else if (rate && throttle_take(&accepts, rate, 1, now)) {
+        accepts.tokens += 1; // not let in, so not charged
+        verdict = ADMIT_RATE;
+    }
+    pthread_mutex_unlock(&lock);
+    return verdict;
+}
+
+void admission_reject(int fd, AdmitVerdict why, ProgStats *ps) {
+    static const StatField fields[] = {STAT_COUNT, STAT_REJECT_USERS,
+            STAT_REJECT_RATE, STAT_REJECT_LATENCY, STAT_REJECT_QUEUE};
+    stats_add(ps, fields[why], 1);
+    // non-blocking or not, a fresh socket has room for this
+    send(fd, ADMISSION_BUSY, sizeof(ADMISSION_BUSY) - 1,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+}
@@ -0,0 +1,48 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+/* vim: set filetype=c : */
+
+/* Admission control: whether a new user may come in right now, so that
+ * past a point newcomers are turned away rather than everyone already
+ * here slowing down together. Each limit is a tunable, off (0) by
+ * default and changeable with "set":
+ *  max_users         users connected at once, across every shard
+ *  accept_rate       users let in per second (a token bucket holding
+ *                    throttle_burst_ms of it)
+ *  admit_latency_us  the p99 echo time over the last ADMISSION_WINDOW_MS
+ *                    past which nobody new is let in
+ *  admit_queue       pool engine: users waiting for a worker
+ * With admit_pause 0 an acceptor over a limit accepts anyway, tells
+ * the newcomer it's busy and hangs up: cheap for us, and they know
+ * straight away. With admit_pause 1 it stops accepting until it's back
+ * under, leaving newcomers in the listen backlog (and the kernel to
+ * refuse them once that's full).
+ */
+
+#include <stdint.h>
+#include "stats.h"
+
+#define ADMISSION_WINDOW_MS 100 // latency is judged over this much time
+#define ADMISSION_PAUSE_MS 10 // how often a paused acceptor looks again
+#define ADMISSION_BUSY "Busy, try again later\n"
+
+/* which limit refused someone */
+typedef enum {
+    ADMIT_OK,
+    ADMIT_USERS,
+    ADMIT_RATE,
+    ADMIT_LATENCY,
+    ADMIT_QUEUE
+} AdmitVerdict;
+
+/* registers the tunables */
+void admission_init(void);
+/* whether one more user may come in, given how many are connected and
+ * how many are waiting for a worker; if so it's taken from accept_rate */
+AdmitVerdict admission_check(long users, long queued);
+/* whether acceptors should wait rather than turn people away */
+int admission_pausing(void);
+/* counts a refusal, and tells fd's user we're busy and closes it */
+void admission_reject(int fd, AdmitVerdict why, ProgStats* ps);
+
+#endif
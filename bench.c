@@ -0,0 +1,598 @@
+/*
+** thomas-bench: load generator for a running thomas
+** Opens N connections, sends fixed-size lowercase messages and checks
+** each one comes back capitalised, then reports throughput and latency.
+**   closed loop (default): each connection sends its next message as
+**       soon as the last one's echo is back
+**   fixed rate (-r): messages go out on schedule whether or not echoes
+**       have come back; latency counts from when a message was due, so
+**       a stalled server can't hide behind a stalled client
+**   storm (-m storm): connect, wait for the welcome, one message, close,
+**       over and over, to hammer the accept path
+**   rings (-R): closed loop over a thomas's shared-memory rings, one
+**       client per thread, spinning briefly for each echo before asking
+**       to be woken
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "histo.h"
+#include "shmring.h"
+
+const char usage_msg[] =
+"Usage: ./thomas-bench -p port [-h host] [-c conns] [-s size] [-r rate]\n"
+"                      [-d seconds] [-T threads] [-m mode] [-u path]\n"
+"       ./thomas-bench -R path [-s size] [-d seconds] [-T threads]\n"
+"-p port              where thomas is listening\n"
+"-h host              defaults to 127.0.0.1\n"
+"-u path              connect to thomas's -U unix socket instead of a port\n"
+"-R path              use shared-memory rings from thomas's -R socket,\n"
+"                     one per thread; closed loop only\n"
+"-c conns             concurrent connections, defaults to 10\n"
+"-s size              bytes per message, defaults to 64\n"
+"-r rate              messages per second in total; 0 (default) is closed loop\n"
+"-d seconds           how long to run, defaults to 10\n"
+"-T threads           client threads, defaults to 1\n"
+"-m mode              echo (default) or storm\n"
+"";
+
+#define WELCOME "Welcome...\n"
+#define WELCOME_LEN 11
+#define MAX_INFLIGHT 256 // messages sent but not yet echoed, per connection
+#define READ_SIZE 65536
+#define RING_SPIN_NS 20000 // looking for an echo before asking to be woken
+
+typedef enum { MODE_ECHO, MODE_STORM, MODE_RING } BenchMode;
+
+typedef struct {
+    struct sockaddr_storage addr; // a port, or -u/-R's unix socket
+    socklen_t addrLen;
+    int conns;
+    size_t size;
+    double rate;
+    double seconds;
+    int threads;
+    BenchMode mode;
+} BenchArgs;
+
+typedef enum { CONNECTING, WELCOMING, RUNNING } ConnState;
+
+typedef struct {
+    int fd;
+    ConnState state;
+    size_t welcomeGot;
+    uint64_t openedAt;
+    // messages are sent whole and in order, so the echo stream is just
+    // the expected text repeated; offsets are into that stream
+    uint64_t sentBytes; // written so far
+    uint64_t queuedBytes; // written plus waiting to be written
+    uint64_t recvBytes;
+    // when each outstanding message was due, oldest first
+    uint64_t due[MAX_INFLIGHT];
+    int dueHead, dueCount;
+    uint64_t nextDue; // fixed rate only
+} BenchConn;
+
+typedef struct {
+    int id;
+    BenchArgs *args;
+    pthread_t thread;
+    int conns;
+    Histogram latency;
+    long messages;
+    long opened;
+    long mismatches;
+    long errors;
+} BenchThread;
+
+typedef struct {
+    int sock; // held open for as long as we want the rings
+    int wakeFd; // we wake thomas with this
+    int clientWakeFd; // and sleep on this
+    ShmRingPair *pair;
+} BenchRing;
+
+static char *message; // the text we send
+static char *expected; // what should come back
+
+static volatile int stopping = 0;
+
+static double secs(uint64_t ns) {
+    return ns / 1e9;
+}
+
+/* starts a non-blocking connect; returns 0 if it failed outright */
+static int bench_connect(BenchThread *t, int epfd, BenchConn *c) {
+    memset(c, 0, sizeof(*c));
+    int family = t->args->addr.ss_family;
+    c->fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        return 0;
+    }
+    int one = 1;
+    if (family == AF_INET) {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    c->openedAt = histo_now();
+    c->state = CONNECTING;
+    // a unix socket whose backlog is full says so, rather than waiting
+    if (connect(c->fd, (struct sockaddr*) &t->args->addr, t->args->addrLen)
+            && errno != EINPROGRESS && errno != EAGAIN) {
+        close(c->fd);
+        return 0;
+    }
+    // edge-triggered: we always read and write until EAGAIN
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 1;
+}
+
+/* queues one message, due at when */
+static void bench_queue(BenchThread *t, BenchConn *c, uint64_t when) {
+    c->due[(c->dueHead + c->dueCount++) % MAX_INFLIGHT] = when;
+    c->queuedBytes += t->args->size;
+}
+
+/* writes as much of the queued messages as the socket will take
+ * returns 0 on error */
+static int bench_flush(BenchThread *t, BenchConn *c) {
+    size_t size = t->args->size;
+    while (c->sentBytes < c->queuedBytes) {
+        size_t offset = c->sentBytes % size;
+        ssize_t n = send(c->fd, message + offset, size - offset,
+                MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->sentBytes += n;
+    }
+    return 1;
+}
+
+/* checks echoed bytes against the stream we expect, completing messages
+ * returns 0 if the connection is finished with */
+static int bench_receive(BenchThread *t, BenchConn *c, char *buf,
+        ssize_t n) {
+    size_t size = t->args->size;
+    uint64_t now = histo_now();
+    for (ssize_t i = 0; i < n; ) {
+        size_t offset = c->recvBytes % size;
+        size_t chunk = size - offset;
+        if (chunk > (size_t) (n - i)) {
+            chunk = n - i;
+        }
+        if (memcmp(buf + i, expected + offset, chunk)) {
+            ++t->mismatches;
+            return 0;
+        }
+        c->recvBytes += chunk;
+        i += chunk;
+        if (c->recvBytes % size == 0) {
+            if (c->dueCount == 0) {
+                ++t->mismatches; // an echo of something we never sent
+                return 0;
+            }
+            histo_add(&t->latency, now - c->due[c->dueHead]);
+            c->dueHead = (c->dueHead + 1) % MAX_INFLIGHT;
+            --c->dueCount;
+            ++t->messages;
+            if (t->args->mode == MODE_STORM) {
+                return 0; // one message per connection
+            }
+            if (t->args->rate == 0) {
+                bench_queue(t, c, now); // closed loop: the next one
+            }
+        }
+    }
+    return 1;
+}
+
+/* handles readiness on a connection; returns 0 when it should close */
+static int bench_service(BenchThread *t, BenchConn *c, char *buf) {
+    if (c->state == CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            ++t->errors;
+            return 0;
+        }
+        ++t->opened;
+        c->state = WELCOMING;
+    }
+    ssize_t n;
+    while ((n = recv(c->fd, buf, READ_SIZE, 0)) > 0) {
+        ssize_t used = 0;
+        if (c->state == WELCOMING) {
+            while (used < n && c->welcomeGot < WELCOME_LEN) {
+                if (buf[used++] != WELCOME[c->welcomeGot++]) {
+                    ++t->mismatches;
+                    return 0;
+                }
+            }
+            if (c->welcomeGot < WELCOME_LEN) {
+                continue;
+            }
+            c->state = RUNNING;
+            if (t->args->rate == 0) {
+                // storm latency covers the whole connection
+                bench_queue(t, c, t->args->mode == MODE_STORM ?
+                        c->openedAt : histo_now());
+            } else {
+                c->nextDue = histo_now();
+            }
+        }
+        if (!bench_receive(t, c, buf + used, n - used)) {
+            return 0;
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ++t->errors; // thomas shouldn't hang up on us
+        return 0;
+    }
+    if (c->state == RUNNING && !bench_flush(t, c)) {
+        ++t->errors;
+        return 0;
+    }
+    return 1;
+}
+
+static void bench_close(int epfd, BenchConn *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* fixed rate: queues every message that has come due */
+static void bench_schedule(BenchThread *t, int epfd, BenchConn *conns,
+        uint64_t now) {
+    uint64_t interval = t->conns * 1e9 / (t->args->rate / t->args->threads);
+    for (int i = 0; i < t->conns; ++i) {
+        BenchConn *c = &conns[i];
+        if (c->fd < 0 || c->state != RUNNING) {
+            continue;
+        }
+        while (c->nextDue <= now && c->dueCount < MAX_INFLIGHT) {
+            bench_queue(t, c, c->nextDue);
+            c->nextDue += interval;
+        }
+        if (c->sentBytes < c->queuedBytes && !bench_flush(t, c)) {
+            ++t->errors;
+            bench_close(epfd, c);
+        }
+    }
+}
+
+/* connects to the ring socket and maps the rings it sends back
+ * returns 0 on failure */
+static int bench_ring_attach(BenchThread *t, BenchRing *r) {
+    r->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (r->sock < 0 || connect(r->sock, (struct sockaddr*) &t->args->addr,
+            t->args->addrLen)) {
+        return 0;
+    }
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg;
+    if (recvmsg(r->sock, &msg, 0) != 1 || byte != 'R'
+            || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+            || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        return 0;
+    }
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    r->wakeFd = fds[1];
+    r->clientWakeFd = fds[2];
+    r->pair = mmap(NULL, sizeof(ShmRingPair), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    return r->pair != MAP_FAILED && r->pair->magic == SHMRING_MAGIC
+            && r->pair->version == SHMRING_VERSION
+            && r->pair->size == sizeof(ShmRingPair);
+}
+
+/* writes as much of the queued messages into the up ring as fits, waking
+ * thomas if it's asleep */
+static void bench_ring_flush(BenchThread *t, BenchConn *c, BenchRing *r) {
+    size_t size = t->args->size;
+    ShmRing *up = &r->pair->up;
+    struct iovec iov[2];
+    int wrote = 0;
+    while (c->sentBytes < c->queuedBytes && shmring_writable(up, iov)) {
+        size_t offset = c->sentBytes % size;
+        size_t n = size - offset < iov[0].iov_len
+                ? size - offset : iov[0].iov_len;
+        memcpy(iov[0].iov_base, message + offset, n);
+        shmring_produced(up, n);
+        c->sentBytes += n;
+        wrote = 1;
+    }
+    if (wrote && shmring_wake_wanted(&up->readerWaiting)) {
+        uint64_t one = 1;
+        write(r->wakeFd, &one, sizeof(one));
+    }
+}
+
+/* waits for something to read on the down ring: spins for a while, then
+ * asks to be woken and sleeps; returns 0 if nothing came in time */
+static int bench_ring_wait(BenchRing *r) {
+    ShmRing *down = &r->pair->down;
+    struct iovec iov[2];
+    uint64_t until = histo_now() + RING_SPIN_NS;
+    while (histo_now() < until) {
+        if (shmring_readable(down, iov)) {
+            return 1;
+        }
+    }
+    shmring_want_wake(&down->readerWaiting);
+    if (shmring_readable(down, iov)) {
+        return 1; // it came just as we asked; a wakeup may follow anyway
+    }
+    struct pollfd pfd = {r->clientWakeFd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) == 1) {
+        uint64_t count;
+        read(r->clientWakeFd, &count, sizeof(count));
+    }
+    return shmring_readable(down, iov) > 0;
+}
+
+/* -R: one closed-loop client over a ring pair, until we're stopped */
+static void bench_ring(BenchThread *t) {
+    BenchRing r;
+    BenchConn c;
+    memset(&c, 0, sizeof(c));
+    if (!bench_ring_attach(t, &r)) {
+        fprintf(stderr, "Can't attach to rings: %s\n", strerror(errno));
+        ++t->errors;
+        return;
+    }
+    ++t->opened;
+    bench_queue(t, &c, histo_now());
+    ShmRing *down = &r.pair->down;
+    struct iovec iov[2];
+    int ok = 1;
+    while (ok && !stopping) {
+        bench_ring_flush(t, &c, &r);
+        if (!bench_ring_wait(&r)) {
+            continue;
+        }
+        size_t n = shmring_readable(down, iov);
+        for (int i = 0; ok && i < 2; ++i) {
+            ok = bench_receive(t, &c, iov[i].iov_base, iov[i].iov_len);
+        }
+        shmring_consumed(down, n);
+        if (shmring_wake_wanted(&down->writerWaiting)) {
+            uint64_t one = 1;
+            write(r.wakeFd, &one, sizeof(one));
+        }
+    }
+    munmap(r.pair, sizeof(ShmRingPair));
+    close(r.wakeFd);
+    close(r.clientWakeFd);
+    close(r.sock);
+}
+
+static void* bench_thread(void *arg) {
+    BenchThread *t = (BenchThread*) arg;
+    if (t->args->mode == MODE_RING) {
+        bench_ring(t);
+        return NULL;
+    }
+    int epfd = epoll_create1(0);
+    BenchConn *conns = calloc(t->conns, sizeof(BenchConn));
+    char *buf = malloc(READ_SIZE);
+    struct epoll_event events[64];
+
+    for (int i = 0; i < t->conns; ++i) {
+        if (!bench_connect(t, epfd, &conns[i])) {
+            ++t->errors;
+            conns[i].fd = -1;
+        }
+    }
+    while (!stopping) {
+        int n = epoll_wait(epfd, events, 64, t->args->rate ? 1 : 100);
+        for (int i = 0; i < n; ++i) {
+            BenchConn *c = events[i].data.ptr;
+            if (!bench_service(t, c, buf)) {
+                bench_close(epfd, c);
+            }
+        }
+        if (t->args->rate) {
+            bench_schedule(t, epfd, conns, histo_now());
+        }
+        for (int i = 0; i < t->conns; ++i) {
+            // storm mode churns; echo mode only replaces casualties
+            if (conns[i].fd < 0 && (t->args->mode == MODE_STORM
+                    || !t->args->rate) && !stopping) {
+                if (!bench_connect(t, epfd, &conns[i])) {
+                    ++t->errors;
+                    conns[i].fd = -1;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < t->conns; ++i) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+    free(conns);
+    free(buf);
+    return NULL;
+}
+
+static BenchArgs parse_args(int argc, char **argv) {
+    BenchArgs a;
+    memset(&a, 0, sizeof(a));
+    char *host = "127.0.0.1", *path = NULL;
+    a.conns = 10;
+    a.size = 64;
+    a.seconds = 10;
+    a.threads = 1;
+    a.mode = MODE_ECHO;
+    int port = 0, c, errors = 0;
+    while ((c = getopt(argc, argv, "p:h:c:s:r:d:T:m:u:R:")) != -1) {
+        switch (c) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'h':
+                host = optarg;
+                break;
+            case 'c':
+                a.conns = atoi(optarg);
+                break;
+            case 's':
+                a.size = atol(optarg);
+                break;
+            case 'r':
+                a.rate = atof(optarg);
+                break;
+            case 'd':
+                a.seconds = atof(optarg);
+                break;
+            case 'T':
+                a.threads = atoi(optarg);
+                break;
+            case 'u':
+                path = optarg;
+                break;
+            case 'R':
+                path = optarg;
+                a.mode = MODE_RING;
+                break;
+            case 'm':
+                if (!strcmp(optarg, "storm")) {
+                    a.mode = MODE_STORM;
+                } else if (strcmp(optarg, "echo")) {
+                    ++errors;
+                }
+                break;
+            default:
+                ++errors;
+        }
+    }
+    if (path != NULL) {
+        struct sockaddr_un *local = (struct sockaddr_un*) &a.addr;
+        local->sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(local->sun_path)) {
+            fprintf(stderr, "Path is too long: %s\n", path);
+            ++errors;
+        } else {
+            strcpy(local->sun_path, path);
+        }
+        a.addrLen = sizeof(*local);
+        port = 1; // not needed
+    } else {
+        struct sockaddr_in *inet = (struct sockaddr_in*) &a.addr;
+        struct addrinfo hints, *info;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        inet->sin_family = AF_INET;
+        if (getaddrinfo(host, NULL, &hints, &info)) {
+            fprintf(stderr, "Bad host: %s\n", host);
+            ++errors;
+        } else {
+            inet->sin_addr = ((struct sockaddr_in*) info->ai_addr)->sin_addr;
+            freeaddrinfo(info);
+        }
+        inet->sin_port = htons(port);
+        a.addrLen = sizeof(*inet);
+    }
+    if (a.mode == MODE_RING) {
+        a.conns = a.threads; // a ring each
+    }
+    if (port <= 0 || port >= 65535 || a.conns < 1 || a.size < 1
+            || a.seconds <= 0 || a.threads < 1 || a.threads > a.conns
+            || a.rate < 0 || (a.mode == MODE_STORM && a.rate)
+            || (a.mode == MODE_RING && (a.rate || a.size > SHMRING_SIZE))) {
+        ++errors;
+    }
+    if (errors) {
+        fprintf(stderr, usage_msg);
+        exit(1);
+    }
+    return a;
+}
+
+int main(int argc, char **argv) {
+    BenchArgs args = parse_args(argc, argv);
+    // lowercase text, newline-terminated so line-based modes see lines
+    message = malloc(args.size);
+    expected = malloc(args.size);
+    for (size_t i = 0; i < args.size; ++i) {
+        message[i] = 'a' + i % 26;
+        expected[i] = 'A' + i % 26;
+    }
+    message[args.size - 1] = expected[args.size - 1] = '\n';
+
+    BenchThread *threads = calloc(args.threads, sizeof(BenchThread));
+    uint64_t start = histo_now();
+    for (int i = 0; i < args.threads; ++i) {
+        threads[i].id = i;
+        threads[i].args = &args;
+        threads[i].conns = args.conns / args.threads
+                + (i < args.conns % args.threads);
+        pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+    }
+    usleep(args.seconds * 1e6);
+    stopping = 1;
+
+    Histogram *latency = calloc(1, sizeof(Histogram));
+    long messages = 0, opened = 0, mismatches = 0, errors = 0;
+    for (int i = 0; i < args.threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        for (int b = 0; b < HISTO_BUCKETS; ++b) {
+            latency->bucket[b] += threads[i].latency.bucket[b];
+        }
+        latency->count += threads[i].latency.count;
+        if (threads[i].latency.max > latency->max) {
+            latency->max = threads[i].latency.max;
+        }
+        messages += threads[i].messages;
+        opened += threads[i].opened;
+        mismatches += threads[i].mismatches;
+        errors += threads[i].errors;
+    }
+    double elapsed = secs(histo_now() - start);
+
+    static const char *modes[] = {"echo", "storm", "rings"};
+    printf("%s, %d connections, %zu byte messages, %s, %.1fs\n",
+            modes[args.mode], args.conns,
+            args.size, args.rate ? "fixed rate" : "closed loop", elapsed);
+    printf("messages: %ld (%.0f/s, %.2f MB/s each way)\n", messages,
+            messages / elapsed, messages * args.size / elapsed / 1e6);
+    printf("connections: %ld opened (%.0f/s)\n", opened, opened / elapsed);
+    printf("latency: p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus "
+            "max=%.1fus\n", histo_percentile(latency, 0.5) / 1e3,
+            histo_percentile(latency, 0.9) / 1e3,
+            histo_percentile(latency, 0.99) / 1e3,
+            histo_percentile(latency, 0.999) / 1e3, latency->max / 1e3);
+    printf("errors: %ld, bad echoes: %ld\n", errors, mismatches);
+    return mismatches ? 2 : 0;
+}
@@ -0,0 +1,109 @@
+/*
+** Microbenchmark for the capitalise() kernels
+** Checks every kernel against the scalar one, then times each across
+** buffer sizes from 16 B to 1 MB, and the run kernels (utf8upper's ASCII
+** fast path) likewise on ASCII. Run with `make bench-capitalise`.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "capitalise.h"
+
+#define MIN_SIZE 16
+#define MAX_SIZE (1 << 20)
+#define BYTES_PER_RUN (256L << 20) // how much each kernel chews per size
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* every byte value, at every alignment and tail length */
+static int check(const CapitaliseImpl *impl, const char *src) {
+    static char want[MAX_SIZE], got[MAX_SIZE];
+    for (size_t offset = 0; offset < 64; ++offset) {
+        for (size_t len = 0; len < 200; ++len) {
+            memcpy(want, src + offset, len);
+            memcpy(got, src + offset, len);
+            capitalise_scalar(want, len);
+            impl->kernel(got, len);
+            if (memcmp(want, got, len)) {
+                fprintf(stderr, "%s differs from scalar (offset %zu, "
+                        "len %zu)\n", impl->name, offset, len);
+                return 0;
+            }
+            memcpy(want, src + offset, len);
+            memcpy(got, src + offset, len);
+            size_t wantRun = capitalise_run_scalar(want, len);
+            if (impl->run(got, len) != wantRun || memcmp(want, got, len)) {
+                fprintf(stderr, "%s's run differs from scalar (offset %zu, "
+                        "len %zu)\n", impl->name, offset, len);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* GB/s for each kernel (or its run kernel) at each size */
+static void table(const CapitaliseImpl *impls, const char *src,
+        char *buffer, int runs) {
+    printf("%10s", "size");
+    for (const CapitaliseImpl *impl = impls; impl->kernel; ++impl) {
+        printf(" %10s", impl->name);
+    }
+    printf("   (GB/s)\n");
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+        printf("%10zu", size);
+        for (const CapitaliseImpl *impl = impls; impl->kernel; ++impl) {
+            long reps = BYTES_PER_RUN / size;
+            memcpy(buffer, src, size);
+            double start = now();
+            for (long r = 0; r < reps; ++r) {
+                if (runs) {
+                    impl->run(buffer, size);
+                } else {
+                    impl->kernel(buffer, size);
+                }
+                // keep the compiler from hoisting the kernel out
+                __asm__ __volatile__("" : : "r"(buffer) : "memory");
+            }
+            double elapsed = now() - start;
+            printf(" %10.2f", reps * size / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+}
+
+int main(void) {
+    char *src = malloc(MAX_SIZE);
+    char *buffer = malloc(MAX_SIZE);
+    srand(2310);
+    for (size_t i = 0; i < MAX_SIZE; ++i) {
+        src[i] = rand() & 0xff;
+    }
+
+    const CapitaliseImpl *impls = capitalise_available();
+    int failed = 0;
+    for (const CapitaliseImpl *impl = impls; impl->kernel; ++impl) {
+        failed |= !check(impl, src);
+    }
+    if (failed) {
+        return 1;
+    }
+    printf("capitalise() dispatches to %s\n", capitalise_kernel_name());
+
+    table(impls, src, buffer, 0);
+    // ASCII, as the run kernels want it: they stop at the first byte
+    // that isn't
+    for (size_t i = 0; i < MAX_SIZE; ++i) {
+        src[i] &= 0x7f;
+    }
+    printf("\nrun kernels, on ASCII\n");
+    table(impls, src, buffer, 1);
+    free(src);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <string.h>
+#include "shared.h"
+#include "capitalise.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CAPITALISE_X86 1
+#endif
+
+/* one byte at a time; the reference the vector kernels must match */
+void capitalise_scalar(char *buffer, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = buffer[i];
+        // unsigned wraparound makes this a single compare
+        if ((unsigned char)(c - 'a') < 26) {
+            buffer[i] = c - ('a' - 'A');
+        }
+    }
+}
+
+/* up to the first byte over 0x7f */
+size_t capitalise_run_scalar(char *buffer, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = buffer[i];
+        if (c >= 0x80) {
+            return i;
+        }
+        if ((unsigned char)(c - 'a') < 26) {
+            buffer[i] = c - ('a' - 'A');
+        }
+    }
+    return len;
+}
+
+#ifdef CAPITALISE_X86
+/* 16 bytes at a time
+ * bytes >= 0x80 are negative as signed chars, so they never look like
+ * 'a'..'z' to the signed compares */
+__attribute__((target("sse2")))
+void capitalise_sse2(char *buffer, size_t len) {
+    const __m128i lo = _mm_set1_epi8('a' - 1);
+    const __m128i hi = _mm_set1_epi8('z' + 1);
+    const __m128i flip = _mm_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*) (buffer + i));
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+                _mm_cmplt_epi8(v, hi));
+        v = _mm_xor_si128(v, _mm_and_si128(lower, flip));
+        _mm_storeu_si128((__m128i*) (buffer + i), v);
+    }
+    capitalise_scalar(buffer + i, len - i);
+}
+
+/* 32 bytes at a time, same trick as sse2 */
+__attribute__((target("avx2")))
+void capitalise_avx2(char *buffer, size_t len) {
+    const __m256i lo = _mm256_set1_epi8('a' - 1);
+    const __m256i hi = _mm256_set1_epi8('z' + 1);
+    const __m256i flip = _mm256_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*) (buffer + i));
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+                _mm256_cmpgt_epi8(hi, v));
+        v = _mm256_xor_si256(v, _mm256_and_si256(lower, flip));
+        _mm256_storeu_si256((__m256i*) (buffer + i), v);
+    }
+    capitalise_sse2(buffer + i, len - i);
+}
+
+/* a vector with any high bit set goes to the scalar loop, which finds
+ * where the run ends */
+__attribute__((target("sse2")))
+size_t capitalise_run_sse2(char *buffer, size_t len) {
+    const __m128i lo = _mm_set1_epi8('a' - 1);
+    const __m128i hi = _mm_set1_epi8('z' + 1);
+    const __m128i flip = _mm_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*) (buffer + i));
+        if (_mm_movemask_epi8(v)) {
+            break;
+        }
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+                _mm_cmplt_epi8(v, hi));
+        v = _mm_xor_si128(v, _mm_and_si128(lower, flip));
+        _mm_storeu_si128((__m128i*) (buffer + i), v);
+    }
+    return i + capitalise_run_scalar(buffer + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t capitalise_run_avx2(char *buffer, size_t len) {
+    const __m256i lo = _mm256_set1_epi8('a' - 1);
+    const __m256i hi = _mm256_set1_epi8('z' + 1);
+    const __m256i flip = _mm256_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*) (buffer + i));
+        if (_mm256_movemask_epi8(v)) {
+            break;
+        }
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+                _mm256_cmpgt_epi8(hi, v));
+        v = _mm256_xor_si256(v, _mm256_and_si256(lower, flip));
+        _mm256_storeu_si256((__m256i*) (buffer + i), v);
+    }
+    return i + capitalise_run_sse2(buffer + i, len - i);
+}
+#endif
+
+/* scalar first, best last */
+static CapitaliseImpl impls[4];
+
+/* fills impls with what cpuid says we can run */
+static void capitalise_probe(void) {
+    int n = 0;
+    impls[n].name = "scalar";
+    impls[n].run = capitalise_run_scalar;
+    impls[n++].kernel = capitalise_scalar;
+#ifdef CAPITALISE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        impls[n].name = "sse2";
+        impls[n].run = capitalise_run_sse2;
+        impls[n++].kernel = capitalise_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impls[n].name = "avx2";
+        impls[n].run = capitalise_run_avx2;
+        impls[n++].kernel = capitalise_avx2;
+    }
+#endif
+    impls[n].name = NULL;
+    impls[n].kernel = NULL;
+    impls[n].run = NULL;
+}
+
+static pthread_once_t probeOnce = PTHREAD_ONCE_INIT;
+static const CapitaliseImpl *chosen = NULL;
+
+static void capitalise_choose(void) {
+    capitalise_probe();
+    chosen = impls;
+    while (chosen[1].kernel != NULL) {
+        ++chosen;
+    }
+}
+
+const CapitaliseImpl *capitalise_available(void) {
+    pthread_once(&probeOnce, capitalise_choose);
+    return impls;
+}
+
+const char *capitalise_kernel_name(void) {
+    pthread_once(&probeOnce, capitalise_choose);
+    return chosen->name;
+}
+
+/* takes a text buffer and its len, and returns the capitalised version */
+char *capitalise(char *buffer, int len)
+{
+    pthread_once(&probeOnce, capitalise_choose);
+    chosen->kernel(buffer, len);
+    return buffer;
+}
+
+size_t capitalise_ascii_run(char *buffer, size_t len) {
+    pthread_once(&probeOnce, capitalise_choose);
+    return chosen->run(buffer, len);
+}
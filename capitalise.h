@@ -0,0 +1,44 @@
+#ifndef CAPITALISE_H_
+#define CAPITALISE_H_
+/* vim: set filetype=c : */
+
+/* ASCII upper-casing kernels behind capitalise()
+ * Only 'a'..'z' change, which is exactly toupper() in the C locale we
+ * run in; every kernel gives byte-identical output to the scalar one.
+ * The widest one the CPU supports is picked (via cpuid) on first use.
+ *
+ * Each also has a run kernel, for UTF-8 (utf8.h): it capitalises only
+ * the leading run of ASCII, stopping at the first byte over 0x7f, and
+ * returns the run's length. It's the same loop with a movemask added.
+ */
+
+#include <stddef.h>
+
+typedef void (*CapitaliseKernel)(char*, size_t);
+typedef size_t (*CapitaliseRunKernel)(char*, size_t);
+
+typedef struct {
+    const char *name;
+    CapitaliseKernel kernel;
+    CapitaliseRunKernel run;
+} CapitaliseImpl;
+
+void capitalise_scalar(char*, size_t);
+size_t capitalise_run_scalar(char*, size_t);
+#if defined(__x86_64__) || defined(__i386__)
+void capitalise_sse2(char*, size_t);
+void capitalise_avx2(char*, size_t);
+size_t capitalise_run_sse2(char*, size_t);
+size_t capitalise_run_avx2(char*, size_t);
+#endif
+
+/* capitalises the ASCII run at the start of buffer with the chosen
+ * kernel; returns its length */
+size_t capitalise_ascii_run(char*, size_t);
+
+/* the kernels this CPU can run, scalar first, NULL-terminated */
+const CapitaliseImpl *capitalise_available(void);
+/* name of the kernel capitalise() dispatches to */
+const char *capitalise_kernel_name(void);
+
+#endif
@@ -0,0 +1,91 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include "conn.h"
+#include "histo.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    Conn *head;
+} __attribute__((aligned(64))) ConnStripe;
+
+static ConnStripe stripes[CONN_STRIPES];
+
+void conn_init(Conn *conn, int fd, int shard, struct sockaddr_in *peer,
+        uint64_t acceptedAt) {
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->shard = shard;
+    if (peer != NULL) {
+        conn->peer = *peer;
+    }
+    conn->acceptedAt = acceptedAt;
+    conn->lastReadAt = acceptedAt;
+}
+
+void conn_register(Conn *conn) {
+    ConnStripe *stripe = &stripes[conn->fd % CONN_STRIPES];
+    pthread_mutex_lock(&stripe->lock);
+    conn->prev = NULL;
+    conn->next = stripe->head;
+    if (stripe->head != NULL) {
+        stripe->head->prev = conn;
+    }
+    stripe->head = conn;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+void conn_unregister(Conn *conn) {
+    ConnStripe *stripe = &stripes[conn->fd % CONN_STRIPES];
+    pthread_mutex_lock(&stripe->lock);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        stripe->head = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+void conn_foreach(void (*fn)(Conn*, void*), void *arg) {
+    for (int i = 0; i < CONN_STRIPES; ++i) {
+        pthread_mutex_lock(&stripes[i].lock);
+        for (Conn *c = stripes[i].head; c != NULL; c = c->next) {
+            fn(c, arg);
+        }
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+}
+
+void conn_report(FILE *out, int limit) {
+    uint64_t now = histo_now();
+    int shown = 0, total = 0;
+    char ip[INET_ADDRSTRLEN];
+    for (int i = 0; i < CONN_STRIPES; ++i) {
+        pthread_mutex_lock(&stripes[i].lock);
+        for (Conn *c = stripes[i].head; c != NULL; c = c->next) {
+            ++total;
+            if (shown == limit) {
+                continue;
+            }
+            ++shown;
+            if (c->peer.sin_family == AF_INET) {
+                inet_ntop(AF_INET, &c->peer.sin_addr, ip, sizeof(ip));
+            } else {
+                strcpy(ip, "local");
+            }
+            fprintf(out, "fd %d shard %d from %s:%d age %.1fs in %ld out %ld"
+                    " queued %zu\n",
+                    c->fd, c->shard, ip, ntohs(c->peer.sin_port),
+                    (now - c->acceptedAt) / 1e9,
+                    __atomic_load_n(&c->bytesIn, __ATOMIC_RELAXED),
+                    __atomic_load_n(&c->bytesOut, __ATOMIC_RELAXED),
+                    __atomic_load_n(&c->out.bytes, __ATOMIC_RELAXED));
+        }
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+    if (total > shown) {
+        fprintf(out, "... and %d more\n", total - shown);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef CONN_H_
+#define CONN_H_
+/* vim: set filetype=c : */
+
+/* What every user connection has, whichever engine serves it.
+ * Engines embed a Conn in their own per-connection struct and register
+ * it for its lifetime, so admins can list who's connected ("conns").
+ * The registry is striped by fd so connects on different cores rarely
+ * share a lock; nothing on the read/write path touches it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "timer.h"
+#include "outq.h"
+#include "lines.h"
+#include "throttle.h"
+#include "transform.h"
+
+#define CONN_STRIPES 64
+
+typedef struct Conn {
+    int fd;
+    int shard;
+    struct sockaddr_in peer;
+    uint64_t acceptedAt; // histo_now() when accept() returned
+    // written by the owning thread only, read racily by admins
+    long bytesIn, bytesOut;
+    uint64_t lastReadAt; // histo_now() of the last read with data in it
+    Timer timer; // for its timeouts, on its engine's wheel
+    OutQueue out; // echoes the socket hasn't taken yet
+    LineReader lines; // line mode's unfinished line
+    Throttle throttle; // rate limits' buckets, owned like the rest
+    TransformCarry carry; // a UTF-8 sequence the last read cut off
+    struct Conn *prev, *next; // registry stripe
+} Conn;
+
+/* makes what accept() said of a local (AF_UNIX) user into a blank
+ * peer that says so; returns 1 if it was one */
+static inline int conn_local_peer(struct sockaddr_in *peer) {
+    if (peer->sin_family == AF_INET) {
+        return 0;
+    }
+    memset(peer, 0, sizeof(*peer));
+    peer->sin_family = AF_UNIX;
+    return 1;
+}
+/* fills in the identity of a freshly accepted connection */
+void conn_init(Conn *conn, int fd, int shard, struct sockaddr_in *peer,
+        uint64_t acceptedAt);
+/* (un)lists conn; unregister before freeing it */
+void conn_register(Conn *conn);
+void conn_unregister(Conn *conn);
+/* per-connection traffic, from the owning thread */
+static inline void conn_add_in(Conn *conn, long n) {
+    __atomic_store_n(&conn->bytesIn, conn->bytesIn + n, __ATOMIC_RELAXED);
+}
+static inline void conn_note_read(Conn *conn, uint64_t now) {
+    __atomic_store_n(&conn->lastReadAt, now, __ATOMIC_RELAXED);
+}
+static inline void conn_add_out(Conn *conn, long n) {
+    __atomic_store_n(&conn->bytesOut, conn->bytesOut + n, __ATOMIC_RELAXED);
+}
+/* calls fn on every registered connection, with its stripe locked */
+void conn_foreach(void (*fn)(Conn*, void*), void *arg);
+/* a line per connection, at most limit of them */
+void conn_report(FILE *out, int limit);
+
+#endif
@@ -0,0 +1,487 @@
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handover.h"
+#include "user.h"
+#include "udp.h"
+#include "logger.h"
+
+/* a thread that touches user sockets */
+typedef struct Participant {
+    pthread_t thread;
+    int parked;
+    struct Participant *prev, *next;
+} Participant;
+
+static __thread Participant *me = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER; // a park or leave
+static pthread_cond_t thawed = PTHREAD_COND_INITIALIZER;
+static Participant *participants = NULL;
+static int participantCount = 0, parkedCount = 0;
+static int frozen = 0; // atomic; changed with lock held
+static int busy = 0; // a handover is under way
+static int given = 0;
+
+/* only here to make blocking calls return EINTR */
+static void handover_poke(int sig) {
+}
+
+void handover_init(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handover_poke; // and no SA_RESTART
+    if (sigaction(SIGUSR1, &sa, 0)) {
+        perror("Configuring SIGUSR1");
+        exit(1);
+    }
+}
+
+void handover_join(void) {
+    me = malloc(sizeof(Participant));
+    me->thread = pthread_self();
+    me->parked = 0;
+    pthread_mutex_lock(&lock);
+    me->prev = NULL;
+    me->next = participants;
+    if (participants != NULL) {
+        participants->prev = me;
+    }
+    participants = me;
+    ++participantCount;
+    pthread_mutex_unlock(&lock);
+}
+
+void handover_leave(void) {
+    pthread_mutex_lock(&lock);
+    if (me->prev != NULL) {
+        me->prev->next = me->next;
+    } else {
+        participants = me->next;
+    }
+    if (me->next != NULL) {
+        me->next->prev = me->prev;
+    }
+    --participantCount;
+    pthread_cond_signal(&changed);
+    pthread_mutex_unlock(&lock);
+    free(me);
+    me = NULL;
+}
+
+void handover_checkpoint(void) {
+    if (!__atomic_load_n(&frozen, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    me->parked = 1;
+    ++parkedCount;
+    pthread_cond_signal(&changed);
+    while (frozen) {
+        pthread_cond_wait(&thawed, &lock);
+    }
+    me->parked = 0;
+    --parkedCount;
+    pthread_mutex_unlock(&lock);
+}
+
+int handover_given(void) {
+    return __atomic_load_n(&given, __ATOMIC_RELAXED);
+}
+
+/* stops every participant at a checkpoint, poking the stragglers
+ * returns 0 if some still haven't stopped after HANDOVER_FREEZE_SECONDS */
+static int handover_freeze(void) {
+    struct timespec giveUp;
+    clock_gettime(CLOCK_REALTIME, &giveUp);
+    giveUp.tv_sec += HANDOVER_FREEZE_SECONDS;
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&frozen, 1, __ATOMIC_RELEASE);
+    while (parkedCount < participantCount) {
+        for (Participant *p = participants; p != NULL; p = p->next) {
+            if (!p->parked) {
+                pthread_kill(p->thread, SIGUSR1);
+            }
+        }
+        struct timespec poke;
+        clock_gettime(CLOCK_REALTIME, &poke);
+        poke.tv_nsec += HANDOVER_POKE_MS * 1000000L;
+        if (poke.tv_nsec >= 1000000000L) {
+            poke.tv_nsec -= 1000000000L;
+            ++poke.tv_sec;
+        }
+        pthread_cond_timedwait(&changed, &lock, &poke);
+        if (poke.tv_sec > giveUp.tv_sec || (poke.tv_sec == giveUp.tv_sec
+                && poke.tv_nsec >= giveUp.tv_nsec)) {
+            break;
+        }
+    }
+    int done = parkedCount == participantCount;
+    pthread_mutex_unlock(&lock);
+    return done;
+}
+
+static void handover_thaw(void) {
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&frozen, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&thawed);
+    pthread_mutex_unlock(&lock);
+}
+
+/* what's going down the socket, gathered while everyone's frozen */
+typedef struct {
+    HandoverRecord *records;
+    int *fds; // -1 for a record without one
+    char **pending; // what follows each record (rec->pending and partial)
+    int count, space;
+} HandoverList;
+
+static HandoverRecord *handover_add(HandoverList *list, int kind, int fd) {
+    if (list->count == list->space) {
+        list->space = list->space ? list->space * 2 : 256;
+        list->records = realloc(list->records,
+                list->space * sizeof(HandoverRecord));
+        list->fds = realloc(list->fds, list->space * sizeof(int));
+        list->pending = realloc(list->pending,
+                list->space * sizeof(char*));
+    }
+    HandoverRecord *rec = &list->records[list->count];
+    memset(rec, 0, sizeof(*rec));
+    rec->kind = kind;
+    list->pending[list->count] = NULL;
+    list->fds[list->count++] = fd;
+    return rec;
+}
+
+static void handover_add_conn(Conn *conn, void *arg) {
+    HandoverList *list = (HandoverList*) arg;
+    HandoverRecord *rec = handover_add(list, HANDOVER_CONN, conn->fd);
+    rec->shard = conn->shard;
+    rec->peer = conn->peer;
+    rec->acceptedAt = conn->acceptedAt;
+    rec->lastReadAt = conn->lastReadAt;
+    rec->bytesIn = conn->bytesIn;
+    rec->bytesOut = conn->bytesOut;
+    rec->pending = conn->out.bytes;
+    rec->partial = conn->lines.len;
+    rec->skipping = conn->lines.skipping;
+    rec->carryLen = conn->carry.len;
+    memcpy(rec->carry, conn->carry.bytes, conn->carry.len);
+    if (rec->pending + rec->partial) {
+        char *blob = malloc(rec->pending + rec->partial);
+        if (rec->pending) {
+            char *queued = outq_copy(&conn->out);
+            memcpy(blob, queued, rec->pending);
+            free(queued);
+        }
+        line_save(&conn->lines, blob + rec->pending);
+        list->pending[list->count - 1] = blob;
+    }
+}
+
+/* one sendmsg of count records, each followed by its pending output,
+ * with the fds of those that have one
+ * returns 0, or -1 with errno set */
+static int handover_send(int sock, HandoverRecord *records, int *fds,
+        char **pending, int count) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_BATCH)];
+        struct cmsghdr align;
+    } control;
+    int passing[HANDOVER_BATCH];
+    int nfds = 0;
+    for (int i = 0; i < count; ++i) {
+        if (fds[i] >= 0) {
+            passing[nfds++] = fds[i];
+        }
+    }
+    struct iovec iov[HANDOVER_BATCH * 2];
+    int iovs = 0;
+    for (int i = 0; i < count; ++i) {
+        iov[iovs].iov_base = &records[i];
+        iov[iovs++].iov_len = sizeof(HandoverRecord);
+        if (records[i].pending + records[i].partial) {
+            iov[iovs].iov_base = pending[i];
+            iov[iovs++].iov_len = records[i].pending + records[i].partial;
+        }
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovs;
+    if (nfds) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), passing, sizeof(int) * nfds);
+    }
+    // the fds go with the first byte; anything left over is plain data
+    while (msg.msg_iovlen) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (msg.msg_iovlen && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+    }
+    return 0;
+}
+
+/* sends the lot, a batch at a time; fd-less records go on their own */
+static int handover_send_all(int sock, HandoverList *list) {
+    if (write(sock, HANDOVER_MAGIC, strlen(HANDOVER_MAGIC)) < 0) {
+        return -1;
+    }
+    int i = 0;
+    while (i < list->count) {
+        int n = 1;
+        while (i + n < list->count && n < HANDOVER_BATCH
+                && (list->fds[i + n] >= 0) == (list->fds[i] >= 0)) {
+            ++n;
+        }
+        if (handover_send(sock, list->records + i, list->fds + i,
+                list->pending + i, n)) {
+            return -1;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+const char* handover_give(int sock, ProgStats *ps) {
+    if (!user_handover_ok()) {
+        return "the uring engine can't hand over";
+    }
+    if (__atomic_exchange_n(&busy, 1, __ATOMIC_ACQUIRE)) {
+        return "a handover is already under way";
+    }
+    if (!handover_freeze()) {
+        handover_thaw();
+        __atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+        return "couldn't stop every thread in time";
+    }
+
+    HandoverList list;
+    memset(&list, 0, sizeof(list));
+    conn_foreach(handover_add_conn, &list);
+    int users = list.count;
+    for (int i = 0; i < user_shard_count(); ++i) {
+        UserShard *shard = user_shard(i);
+        HandoverRecord *rec = handover_add(&list, HANDOVER_LISTENER,
+                shard->fd);
+        rec->shard = shard->id;
+        rec->accepted = shard->accepted;
+        rec->currentUsers = shard->currentUsers;
+    }
+    for (int i = 0; i < udp_socket_count(); ++i) {
+        handover_add(&list, HANDOVER_DATAGRAM, udp_socket_fd(i));
+    }
+    stats_snapshot(ps, &handover_add(&list, HANDOVER_END, -1)->stats);
+
+    int failed = handover_send_all(sock, &list);
+    for (int i = 0; i < list.count; ++i) {
+        free(list.pending[i]);
+    }
+    free(list.records);
+    free(list.fds);
+    free(list.pending);
+    if (failed) {
+        // they may have some of the fds, but they're gone: carry on
+        handover_thaw();
+        __atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+        return "the new thomas went away";
+    }
+    __atomic_store_n(&given, 1, __ATOMIC_RELAXED);
+    log_msg(LOG_LEVEL_INFO, "Handed over %d users and %d listeners", users,
+            user_shard_count());
+
+    // they hang up once they've read everything: then it's theirs
+    struct pollfd pfd = {sock, POLLIN, 0};
+    char discard[64];
+    while (poll(&pfd, 1, HANDOVER_ACK_SECONDS * 1000) > 0
+            && read(sock, discard, sizeof(discard)) > 0) {
+    }
+    exit(0);
+}
+
+/* reads everything after the "handover" command into h
+ * the reply starts with text (a greeting, or an error) until the magic
+ * line; then records, with fds arriving alongside in the same order */
+static void handover_receive(int sock, Handover *h) {
+    size_t recordSize = sizeof(HandoverRecord);
+    size_t len = 0, space = 65536;
+    char *in = malloc(space);
+    int *fds = NULL;
+    int fdCount = 0, fdNext = 0, fdSpace = 0;
+    size_t want = recordSize; // what the next record needs to be whole
+    int started = 0, connSpace = 0;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_BATCH)];
+        struct cmsghdr align;
+    } control;
+
+    while (1) {
+        while (space - len < want) {
+            space *= 2;
+            in = realloc(in, space);
+        }
+        struct iovec iov = {in + len, space - len};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Old thomas hung up mid-handover\n");
+            exit(1);
+        }
+        if (msg.msg_flags & MSG_CTRUNC) {
+            fprintf(stderr, "Handover sent more fds than expected\n");
+            exit(1);
+        }
+        len += n;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET
+                    || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (fdCount + count > fdSpace) {
+                fdSpace = (fdCount + count) * 2;
+                fds = realloc(fds, fdSpace * sizeof(int));
+            }
+            memcpy(fds + fdCount, CMSG_DATA(cmsg), count * sizeof(int));
+            fdCount += count;
+        }
+
+        size_t used = 0;
+        while (!started) {
+            char *newline = memchr(in + used, '\n', len - used);
+            if (newline == NULL) {
+                break;
+            }
+            size_t lineLen = newline - (in + used) + 1;
+            if (lineLen == strlen(HANDOVER_MAGIC)
+                    && !memcmp(in + used, HANDOVER_MAGIC, lineLen)) {
+                started = 1;
+            } else if (!strncmp(in + used, "error", 5)) {
+                fprintf(stderr, "Handover refused: %.*s", (int) lineLen,
+                        in + used);
+                exit(1);
+            }
+            used += lineLen;
+        }
+        want = recordSize;
+        while (started && len - used >= recordSize) {
+            // a copy: after someone's pending output it may not be aligned
+            HandoverRecord rec;
+            memcpy(&rec, in + used, recordSize);
+            size_t extra = rec.pending + rec.partial;
+            if (len - used < recordSize + extra) {
+                want = recordSize + extra;
+                break;
+            }
+            used += recordSize;
+            if (rec.kind == HANDOVER_END) {
+                h->stats = rec.stats;
+                free(in);
+                free(fds);
+                return;
+            }
+            if (fdNext == fdCount) {
+                fprintf(stderr, "Handover record arrived without its fd\n");
+                exit(1);
+            }
+            int fd = fds[fdNext++];
+            if (rec.kind == HANDOVER_LISTENER) {
+                if (h->listeners == HANDOVER_MAX_LISTENERS) {
+                    fprintf(stderr, "Too many shards\n");
+                    exit(1);
+                }
+                h->listener[h->listeners] = rec;
+                h->listenerFd[h->listeners++] = fd;
+                continue;
+            }
+            if (rec.kind == HANDOVER_DATAGRAM) {
+                if (h->datagrams == HANDOVER_MAX_LISTENERS) {
+                    fprintf(stderr, "Too many datagram sockets\n");
+                    exit(1);
+                }
+                h->datagramFd[h->datagrams++] = fd;
+                continue;
+            }
+            if (h->conns == connSpace) {
+                connSpace = connSpace ? connSpace * 2 : 256;
+                h->conn = realloc(h->conn, connSpace * recordSize);
+                h->connFd = realloc(h->connFd, connSpace * sizeof(int));
+                h->connPending = realloc(h->connPending,
+                        connSpace * sizeof(char*));
+            }
+            h->conn[h->conns] = rec;
+            h->connPending[h->conns] = NULL;
+            if (extra) {
+                h->connPending[h->conns] = malloc(extra);
+                memcpy(h->connPending[h->conns], in + used, extra);
+                used += extra;
+            }
+            h->connFd[h->conns++] = fd;
+        }
+        len -= used;
+        memmove(in, in + used, len);
+    }
+}
+
+void handover_take(const char *path, Handover *h) {
+    memset(h, 0, sizeof(*h));
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("Creating socket");
+        exit(1);
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) > sizeof(addr.sun_path) - 1) {
+        fprintf(stderr, "Path is too long: we only have char[%d]\n",
+                (int) sizeof(addr.sun_path));
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr))) {
+        perror("Error connecting to the old thomas");
+        exit(1);
+    }
+    const char command[] = "handover\n";
+    if (write(sock, command, strlen(command)) < 0) {
+        perror("Error asking for a handover");
+        exit(1);
+    }
+    handover_receive(sock, h);
+    close(sock); // lets the old one go
+    printf("Took over %d users and %d listeners\n", h->conns,
+            h->listeners);
+}
@@ -0,0 +1,101 @@
+#ifndef HANDOVER_H_
+#define HANDOVER_H_
+/* vim: set filetype=c : */
+
+/* Zero-downtime restarts: a new thomas started with -H connects to the
+ * old one's control socket and says "handover". The old one
+ *  - freezes every thread that touches user sockets (acceptors, epoll
+ *    loops, per-user threads) at a checkpoint between reads, poking
+ *    them out of blocking calls with SIGUSR1 (a user's thread blocked
+ *    sending queues what's left on its OutQueue first, so a client
+ *    that's stopped reading can't hold the handover up);
+ *  - sends each live user's fd and Conn (and any output still queued
+ *    for them, and in line mode their unfinished line), then each
+ *    listener's fd with
+ *    its shard's counts, then any datagram sockets, then the
+ *    program-wide stats, all as
+ *    HandoverRecords with the fds attached by SCM_RIGHTS;
+ *  - waits for the new one to hang up, and exits.
+ * Connections arriving meanwhile wait in the listen backlog, which the
+ * new process accepts from once it has the listener: nobody is refused
+ * and nobody is disconnected.
+ *
+ * The uring engine can't be frozen like this (the kernel keeps
+ * receiving for it), so it can neither give nor take a handover.
+ */
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "shared.h"
+#include "conn.h"
+
+#define HANDOVER_MAGIC "thomas handover 8\n" // precedes the records
+#define HANDOVER_BATCH 64 // records (and fds) per sendmsg
+#define HANDOVER_POKE_MS 2 // between rounds of SIGUSR1 while freezing
+#define HANDOVER_FREEZE_SECONDS 5 // give up (and thaw) if not frozen by then
+#define HANDOVER_ACK_SECONDS 10 // longest the old one waits to be let go
+
+typedef enum {
+    HANDOVER_CONN, // a live user; carries its fd
+    HANDOVER_LISTENER, // a shard's listener; carries its fd
+    HANDOVER_DATAGRAM, // a -u socket; carries its fd
+    HANDOVER_END // the program-wide stats; no fd
+} HandoverKind;
+
+/* what goes down the socket; the same size whatever its kind */
+typedef struct {
+    int32_t kind;
+    int32_t shard;
+    // HANDOVER_CONN: the Conn's fields
+    struct sockaddr_in peer;
+    uint64_t acceptedAt, lastReadAt;
+    int64_t bytesIn, bytesOut;
+    int64_t pending; // this many bytes of its queued output follow
+    int64_t partial, skipping; // then its unfinished line, in line mode
+    int64_t carryLen; // a UTF-8 sequence its last read cut off
+    char carry[8];
+    // HANDOVER_LISTENER: the shard's counts
+    int64_t accepted, currentUsers;
+    // HANDOVER_END
+    StatsSnapshot stats;
+} HandoverRecord;
+
+#define HANDOVER_MAX_LISTENERS 256 // MAX_SHARDS
+
+/* everything the new process got, each record's fd alongside it */
+typedef struct {
+    int listeners;
+    HandoverRecord listener[HANDOVER_MAX_LISTENERS];
+    int listenerFd[HANDOVER_MAX_LISTENERS];
+    int datagrams;
+    int datagramFd[HANDOVER_MAX_LISTENERS];
+    int conns;
+    HandoverRecord* conn;
+    int* connFd;
+    // malloc'd queued output then unfinished line, or NULL if neither
+    char** connPending;
+    StatsSnapshot stats;
+} Handover;
+
+/* installs the SIGUSR1 handler that knocks threads out of syscalls
+ * call before starting any threads */
+void handover_init(void);
+/* threads that touch user sockets join before they first do, and
+ * leave (if ever) after they last do */
+void handover_join(void);
+void handover_leave(void);
+/* joined threads call this between reads, and whenever a blocking call
+ * returns EINTR: if a handover is under way it doesn't return until it
+ * has failed, and the caller must not have half-done work on a socket */
+void handover_checkpoint(void);
+/* set once we've given our users away: nothing of ours to clean up */
+int handover_given(void);
+
+/* the old side, on the admin connection fd: doesn't return if it works
+ * returns an error message otherwise, with everyone thawed again */
+const char* handover_give(int fd, ProgStats* ps);
+/* the new side: connects to the control socket at path and takes the
+ * lot; exits the program if it can't */
+void handover_take(const char* path, Handover* h);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "histo.h"
+
+static const char *metricNames[HISTO_METRICS] = {
+    "accept-welcome", "echo", "lifetime"
+};
+
+static Histogram *slots[HISTO_METRICS]; // each an array of slotCount
+static int slotCount = 1;
+static unsigned int nextSlot = 0;
+static __thread int mySlot = -1;
+
+uint64_t histo_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int histo_bucket(uint64_t value) {
+    if (value < HISTO_SUB) {
+        return (int) value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTO_SUB_BITS;
+    return (shift + 1) * HISTO_SUB + (int) ((value >> shift) & (HISTO_SUB - 1));
+}
+
+/* the middle of the values that land in bucket */
+uint64_t histo_bucket_value(int bucket) {
+    if (bucket < HISTO_SUB) {
+        return bucket;
+    }
+    int shift = bucket / HISTO_SUB - 1;
+    uint64_t low = (uint64_t) (HISTO_SUB + bucket % HISTO_SUB) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+void histo_add(Histogram *h, uint64_t value) {
+    h->count++;
+    h->bucket[histo_bucket(value)]++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+uint64_t histo_percentile(const Histogram *h, double fraction) {
+    if (h->count == 0) {
+        return 0;
+    }
+    // the rank of the sample we want, rounded up
+    uint64_t want = (uint64_t) (fraction * h->count);
+    if (want < fraction * h->count || want < 1) {
+        ++want;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTO_BUCKETS; ++i) {
+        seen += h->bucket[i];
+        if (seen >= want) {
+            uint64_t value = histo_bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+void histo_init(void) {
+    long want = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    while (slotCount < want && slotCount < HISTO_MAX_SLOTS) {
+        slotCount *= 2;
+    }
+    for (int m = 0; m < HISTO_METRICS; ++m) {
+        slots[m] = calloc(slotCount, sizeof(Histogram));
+    }
+}
+
+void histo_record(HistoMetric metric, uint64_t ns) {
+    if (mySlot < 0) {
+        mySlot = __atomic_fetch_add(&nextSlot, 1, __ATOMIC_RELAXED);
+    }
+    Histogram *h = &slots[metric][mySlot & (slotCount - 1)];
+    __atomic_fetch_add(&h->bucket[histo_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void histo_merge(HistoMetric metric, Histogram *out) {
+    memset(out, 0, sizeof(*out));
+    for (int s = 0; s < slotCount; ++s) {
+        Histogram *h = &slots[metric][s];
+        for (int i = 0; i < HISTO_BUCKETS; ++i) {
+            out->bucket[i] += __atomic_load_n(&h->bucket[i],
+                    __ATOMIC_RELAXED);
+        }
+        uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        if (max > out->max) {
+            out->max = max;
+        }
+    }
+    // counted from the buckets so percentiles always add up
+    for (int i = 0; i < HISTO_BUCKETS; ++i) {
+        out->count += out->bucket[i];
+    }
+}
+
+void histo_reset(void) {
+    for (int m = 0; m < HISTO_METRICS; ++m) {
+        for (int s = 0; s < slotCount; ++s) {
+            Histogram *h = &slots[m][s];
+            for (int i = 0; i < HISTO_BUCKETS; ++i) {
+                __atomic_store_n(&h->bucket[i], 0, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void histo_report(FILE *out) {
+    Histogram *h = malloc(sizeof(Histogram));
+    for (int m = 0; m < HISTO_METRICS; ++m) {
+        histo_merge(m, h);
+        fprintf(out, "%s: n=%llu p50=%.1fus p90=%.1fus p99=%.1fus "
+                "p99.9=%.1fus max=%.1fus\n", metricNames[m],
+                (unsigned long long) h->count,
+                histo_percentile(h, 0.5) / 1e3,
+                histo_percentile(h, 0.9) / 1e3,
+                histo_percentile(h, 0.99) / 1e3,
+                histo_percentile(h, 0.999) / 1e3,
+                h->max / 1e3);
+    }
+    free(h);
+}
@@ -0,0 +1,58 @@
+#ifndef HISTO_H_
+#define HISTO_H_
+/* vim: set filetype=c : */
+
+/* HDR-style latency histograms, in nanoseconds.
+ * Buckets are log-spaced with 16 linear sub-buckets per power of two,
+ * so any recorded value is within ~6% of its bucket, from 1ns up to
+ * the full 64-bit range, in under 8KB per histogram.
+ *
+ * The data path records into per-thread histograms (threads share one
+ * once there are more threads than slots), with one relaxed atomic add;
+ * readers merge the slots on demand.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HISTO_SUB_BITS 4
+#define HISTO_SUB (1 << HISTO_SUB_BITS)
+#define HISTO_BUCKETS ((64 - HISTO_SUB_BITS + 1) * HISTO_SUB)
+#define HISTO_MAX_SLOTS 64
+
+/* what we time */
+typedef enum {
+    HISTO_ACCEPT_WELCOME, // accept() returning to the welcome being sent
+    HISTO_ECHO, // a read completing to its echo being written
+    HISTO_LIFETIME, // accept to close
+    HISTO_METRICS
+} HistoMetric;
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bucket[HISTO_BUCKETS];
+} Histogram;
+
+/* monotonic clock in ns, for timestamps to record against */
+uint64_t histo_now(void);
+
+/* bucket arithmetic, also usable on a private (non-atomic) Histogram */
+int histo_bucket(uint64_t value);
+uint64_t histo_bucket_value(int bucket);
+void histo_add(Histogram *h, uint64_t value);
+/* smallest value at or above the given fraction (0-1) of samples */
+uint64_t histo_percentile(const Histogram *h, double fraction);
+
+/* the program-wide histograms */
+void histo_init(void);
+/* records one sample into the calling thread's histogram */
+void histo_record(HistoMetric metric, uint64_t ns);
+/* sums every thread's histogram for metric into out */
+void histo_merge(HistoMetric metric, Histogram *out);
+/* zeroes them all; samples racing with this may survive it */
+void histo_reset(void);
+/* a line per metric: count, p50/p90/p99/p99.9 and max in microseconds */
+void histo_report(FILE *out);
+
+#endif
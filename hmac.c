@@ -0,0 +1,143 @@
+#include <string.h>
+#include "hmac.h"
+
+#define SHA256_BLOCK 64
+
+typedef struct {
+    uint32_t h[8];
+    uint8_t block[SHA256_BLOCK];
+    size_t used; // bytes in block
+    uint64_t total; // bytes hashed so far
+} Sha256;
+
+static const uint32_t roundK[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t ror(uint32_t x, int n) {
+    return x >> n | x << (32 - n);
+}
+
+static void sha256_block(Sha256 *s, const uint8_t *p) {
+    uint32_t w[64], v[8];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t) p[4 * i] << 24 | p[4 * i + 1] << 16
+                | p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ w[i - 15] >> 3;
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ w[i - 2] >> 10;
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, s->h, sizeof(v));
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = ror(v[4], 6) ^ ror(v[4], 11) ^ ror(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + roundK[i] + w[i];
+        uint32_t s0 = ror(v[0], 2) ^ ror(v[0], 13) ^ ror(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; ++i) {
+        s->h[i] += v[i];
+    }
+}
+
+static void sha256_start(Sha256 *s) {
+    static const uint32_t first[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->h, first, sizeof(first));
+    s->used = 0;
+    s->total = 0;
+}
+
+static void sha256_add(Sha256 *s, const void *data, size_t len) {
+    const uint8_t *p = data;
+    s->total += len;
+    while (len) {
+        size_t take = SHA256_BLOCK - s->used;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(s->block + s->used, p, take);
+        s->used += take;
+        p += take;
+        len -= take;
+        if (s->used == SHA256_BLOCK) {
+            sha256_block(s, s->block);
+            s->used = 0;
+        }
+    }
+}
+
+static void sha256_end(Sha256 *s, uint8_t out[HMAC_SIZE]) {
+    uint64_t bits = s->total * 8;
+    uint8_t pad = 0x80;
+    sha256_add(s, &pad, 1);
+    pad = 0;
+    while (s->used != SHA256_BLOCK - 8) {
+        sha256_add(s, &pad, 1);
+    }
+    uint8_t length[8];
+    for (int i = 0; i < 8; ++i) {
+        length[i] = bits >> (56 - 8 * i);
+    }
+    sha256_add(s, length, sizeof(length));
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i] = s->h[i] >> 24;
+        out[4 * i + 1] = s->h[i] >> 16;
+        out[4 * i + 2] = s->h[i] >> 8;
+        out[4 * i + 3] = s->h[i];
+    }
+}
+
+void hmac_sha256(const void *key, size_t keyLen, const void *message,
+        size_t len, uint8_t out[HMAC_SIZE]) {
+    uint8_t pad[SHA256_BLOCK] = {0}, inner[HMAC_SIZE];
+    Sha256 s;
+    // a key longer than a block is hashed down first
+    if (keyLen > SHA256_BLOCK) {
+        sha256_start(&s);
+        sha256_add(&s, key, keyLen);
+        sha256_end(&s, pad);
+    } else {
+        memcpy(pad, key, keyLen);
+    }
+    for (int i = 0; i < SHA256_BLOCK; ++i) {
+        pad[i] ^= 0x36;
+    }
+    sha256_start(&s);
+    sha256_add(&s, pad, sizeof(pad));
+    sha256_add(&s, message, len);
+    sha256_end(&s, inner);
+    for (int i = 0; i < SHA256_BLOCK; ++i) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    sha256_start(&s);
+    sha256_add(&s, pad, sizeof(pad));
+    sha256_add(&s, inner, sizeof(inner));
+    sha256_end(&s, out);
+}
+
+int hmac_equal(const uint8_t *a, const uint8_t *b) {
+    // every byte, so how long it takes says nothing about where they differ
+    uint8_t differ = 0;
+    for (int i = 0; i < HMAC_SIZE; ++i) {
+        differ |= a[i] ^ b[i];
+    }
+    return !differ;
+}
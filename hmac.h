@@ -0,0 +1,22 @@
+#ifndef HMAC_H_
+#define HMAC_H_
+/* vim: set filetype=c : */
+
+/* HMAC-SHA256 (RFC 2104 over FIPS 180-4), for stations to prove they
+ * know the authfile's secret without ever sending it. It's only run on
+ * a handful of bytes per link, so it's the plain textbook version, with
+ * nothing to link.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HMAC_SIZE 32 // bytes in a SHA-256 digest
+
+/* the HMAC of the len bytes at message under key, into out */
+void hmac_sha256(const void* key, size_t keyLen, const void* message,
+        size_t len, uint8_t out[HMAC_SIZE]);
+/* 1 if a and b hold the same HMAC_SIZE bytes, taking as long either way */
+int hmac_equal(const uint8_t* a, const uint8_t* b);
+
+#endif
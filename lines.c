@@ -0,0 +1,172 @@
+#include <string.h>
+#include "lines.h"
+#include "slab.h"
+#include "shared.h"
+#include "transform.h"
+
+static size_t lineMax = 0; // 0: not in line mode
+static SlabPool bufferSlab;
+
+void lines_init(size_t max) {
+    lineMax = max;
+    // with room in front for line_transform's seam
+    slab_pool_init(&bufferSlab, "line buffers", TRANSFORM_CARRY_MAX + max);
+}
+
+int lines_enabled(void) {
+    return lineMax != 0;
+}
+
+size_t lines_max(void) {
+    return lineMax;
+}
+
+void line_start(LineReader *r) {
+    memset(r, 0, sizeof(*r));
+    if (lineMax) {
+        r->buf = (char*) slab_alloc(&bufferSlab) + TRANSFORM_CARRY_MAX;
+    }
+}
+
+void line_stop(LineReader *r) {
+    if (r->buf != NULL) {
+        slab_free(&bufferSlab, r->buf - TRANSFORM_CARRY_MAX);
+        r->buf = NULL;
+    }
+}
+
+/* how many of iov the len bytes from logical offset from cover, where
+ * the ring wraps */
+static int line_spans(LineReader *r, size_t from, size_t len,
+        struct iovec iov[LINES_IOV]) {
+    size_t at = (r->start + from) % lineMax;
+    size_t first = lineMax - at < len ? lineMax - at : len;
+    iov[0].iov_base = r->buf + at;
+    iov[0].iov_len = first;
+    if (first == len) {
+        return 1;
+    }
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+/* the logical offset of the first newline in [from, to), or -1 */
+static long line_find(LineReader *r, size_t from, size_t to) {
+    struct iovec span[LINES_IOV];
+    int spans = line_spans(r, from, to - from, span);
+    for (int i = 0; i < spans; ++i) {
+        char *nl = memchr(span[i].iov_base, '\n', span[i].iov_len);
+        if (nl != NULL) {
+            return from + (nl - (char*) span[i].iov_base);
+        }
+        from += span[i].iov_len;
+    }
+    return -1;
+}
+
+/* forgets the first n bytes */
+static void line_drop(LineReader *r, size_t n) {
+    r->start = (r->start + n) % lineMax;
+    r->len -= n;
+    r->scanned = r->scanned > n ? r->scanned - n : 0;
+    if (r->len == 0) {
+        r->start = 0; // fewer wraps
+    }
+}
+
+/* the pipeline over reply's spans, carrying a UTF-8 sequence the ring's
+ * wrap cut in two across the seam; one cut off at the very end (only
+ * at EOF) goes back after it as it was */
+static void line_transform(struct iovec reply[LINES_IOV], int spans) {
+    TransformCarry seam = {0};
+    for (int i = 0; i < spans; ++i) {
+        size_t len = reply[i].iov_len;
+        reply[i].iov_base = transform_stream(&seam, reply[i].iov_base, &len);
+        reply[i].iov_len = len;
+    }
+    struct iovec *last = &reply[spans - 1];
+    memcpy((char*) last->iov_base + last->iov_len, seam.bytes, seam.len);
+    last->iov_len += seam.len;
+}
+
+int line_space(LineReader *r, struct iovec iov[LINES_IOV]) {
+    return line_spans(r, r->len, lineMax - r->len, iov);
+}
+
+int line_take(LineReader *r, size_t n, struct iovec reply[LINES_IOV],
+        long *lines, long *tooLong) {
+    r->len += n;
+    *lines = *tooLong = 0;
+    if (r->skipping) {
+        long nl = line_find(r, 0, r->len);
+        if (nl < 0) {
+            line_drop(r, r->len);
+            return 0;
+        }
+        line_drop(r, nl + 1);
+        r->skipping = 0;
+    }
+    // the complete lines end just after the last newline
+    size_t end = 0;
+    long nl;
+    while (r->scanned < r->len
+            && (nl = line_find(r, r->scanned, r->len)) >= 0) {
+        r->scanned = end = nl + 1;
+        ++*lines;
+    }
+    r->scanned = r->len;
+    if (end) {
+        int spans = line_spans(r, 0, end, reply);
+        line_transform(reply, spans);
+        r->replying = end;
+        return spans;
+    }
+    if (r->len == lineMax) {
+        line_drop(r, r->len);
+        r->skipping = 1;
+        ++*tooLong;
+        reply[0].iov_base = LINES_TOO_LONG;
+        reply[0].iov_len = strlen(LINES_TOO_LONG);
+        return 1;
+    }
+    return 0;
+}
+
+void line_release(LineReader *r) {
+    line_drop(r, r->replying);
+    r->replying = 0;
+}
+
+int line_rest(LineReader *r, struct iovec reply[LINES_IOV]) {
+    if (r->len == 0) {
+        return 0;
+    }
+    int spans = line_spans(r, 0, r->len, reply);
+    line_transform(reply, spans);
+    r->replying = r->len;
+    return spans;
+}
+
+void line_save(LineReader *r, char *out) {
+    struct iovec span[LINES_IOV];
+    int spans = r->len ? line_spans(r, 0, r->len, span) : 0;
+    for (int i = 0; i < spans; ++i) {
+        memcpy(out, span[i].iov_base, span[i].iov_len);
+        out += span[i].iov_len;
+    }
+}
+
+void line_restore(LineReader *r, const char *data, size_t len,
+        int skipping) {
+    if (len >= lineMax) {
+        // an old one with longer lines than ours: too long all the same
+        len = 0;
+        skipping = 1;
+    }
+    memcpy(r->buf, data, len);
+    r->start = 0;
+    r->len = len;
+    r->scanned = 0;
+    r->skipping = skipping;
+}
@@ -0,0 +1,58 @@
+#ifndef LINES_H_
+#define LINES_H_
+/* vim: set filetype=c : */
+
+/* Line mode (-L): users get whole lines back, never fragments, however
+ * the bytes arrived. Each connection reads into a ring buffer as long as
+ * the longest line allowed, from a slab. After every read, memchr finds
+ * each newline in the new bytes; all the lines that are now complete
+ * are capitalised where they lie and sent back with one writev, however
+ * many were pipelined into that read. What's left is the start of the
+ * next line, and waits for the rest of it.
+ *
+ * A line that fills the buffer without ending is answered with
+ * LINES_TOO_LONG, and the rest of it is thrown away as it arrives.
+ */
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define LINES_IOV 2 // replies from one read: the ring may wrap
+#define LINES_TOO_LONG "error: line too long\n"
+
+typedef struct {
+    char *buf; // NULL when we're not in line mode
+    size_t start, len; // unconsumed bytes
+    size_t scanned; // of those, how many have been searched already
+    size_t replying; // handed out by line_take, until line_release
+    int skipping; // throwing away the rest of an over-long line
+} LineReader;
+
+/* turns line mode on, for lines of up to max bytes with their newline */
+void lines_init(size_t max);
+int lines_enabled(void);
+size_t lines_max(void);
+
+/* gets r a buffer if we're in line mode, else leaves it off */
+void line_start(LineReader* r);
+/* gives the buffer back */
+void line_stop(LineReader* r);
+/* where the next read should go: returns how many of iov it used */
+int line_space(LineReader* r, struct iovec iov[LINES_IOV]);
+/* takes in n bytes just read into line_space and fills reply with
+ * what's to go back: every line now complete, capitalised in place, or
+ * LINES_TOO_LONG; call line_release once it's been sent or copied
+ * returns how many of reply it used, and counts the lines in *lines and
+ * the over-long ones in *tooLong */
+int line_take(LineReader* r, size_t n, struct iovec reply[LINES_IOV],
+        long* lines, long* tooLong);
+void line_release(LineReader* r);
+/* at EOF: the unfinished line, capitalised, as the last reply */
+int line_rest(LineReader* r, struct iovec reply[LINES_IOV]);
+
+/* for a handover: copies the unfinished line (r->len bytes) to out */
+void line_save(LineReader* r, char* out);
+/* the other side: r, just started, gets it back */
+void line_restore(LineReader* r, const char* data, size_t len, int skipping);
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "logger.h"
+#include "tunables.h"
+
+static const char *levelNames[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static LogRing *rings = NULL; // every live (or undrained) thread's ring
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static __thread LogRing *myRing = NULL;
+
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static char batch[LOG_BATCH_SIZE];
+static size_t batchLen = 0;
+
+static int logFd = STDOUT_FILENO;
+static const char *logPath = NULL;
+static volatile sig_atomic_t reopenWanted = 0;
+static long drops = 0;
+static long level = LOG_LEVEL_INFO;
+
+static size_t log_align(size_t n) {
+    return (n + 7) & ~(size_t) 7;
+}
+
+/* the thread is exiting: its ring goes once the writer has emptied it */
+static void log_ring_orphan(void *arg) {
+    LogRing *ring = (LogRing*) arg;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static LogRing *log_my_ring(void) {
+    if (myRing == NULL) {
+        // not calloc: most threads only ever touch the first page or so
+        if (posix_memalign((void**) &myRing, CACHE_LINE, sizeof(LogRing))) {
+            fprintf(stderr, "Error allocating a log ring\n");
+            exit(1);
+        }
+        myRing->head = myRing->tail = 0;
+        myRing->dead = 0;
+        pthread_setspecific(ringKey, myRing);
+        pthread_mutex_lock(&ringsLock);
+        myRing->next = rings;
+        __atomic_store_n(&rings, myRing, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&ringsLock);
+    }
+    return myRing;
+}
+
+void log_msg(LogLevel msgLevel, const char *format, ...) {
+    if ((long) msgLevel < tunable_get(&level)) {
+        return;
+    }
+    char text[LOG_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if (len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX - 1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    LogRing *ring = log_my_ring();
+    size_t need = log_align(sizeof(LogRecord) + len);
+    uint64_t tail = ring->tail;
+    size_t pos = tail & (LOG_RING_SIZE - 1);
+    size_t toEnd = LOG_RING_SIZE - pos;
+    // records never wrap: skip the end of the ring if it won't fit there
+    size_t skip = toEnd < need ? toEnd : 0;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail + skip + need - head > LOG_RING_SIZE) {
+        __atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (skip) {
+        if (skip >= sizeof(LogRecord)) {
+            ((LogRecord*) (ring->data + pos))->len = LOG_WRAP;
+        }
+        tail += skip;
+        pos = 0;
+    }
+    LogRecord *rec = (LogRecord*) (ring->data + pos);
+    rec->len = len;
+    rec->level = msgLevel;
+    rec->when = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    memcpy(rec + 1, text, len);
+    __atomic_store_n(&ring->tail, tail + need, __ATOMIC_RELEASE);
+}
+
+static void log_write_batch(void) {
+    size_t done = 0;
+    while (done < batchLen) {
+        ssize_t n = write(logFd, batch + done, batchLen - done);
+        if (n < 0) {
+            break; // nowhere to complain to: the log is how we complain
+        }
+        done += n;
+    }
+    batchLen = 0;
+}
+
+/* copies one formatted line into the batch, writing it out when full */
+static void log_append(LogRecord *rec) {
+    if (batchLen + LOG_LINE_MAX + 64 > LOG_BATCH_SIZE) {
+        log_write_batch();
+    }
+    time_t secs = rec->when / 1000000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    batchLen += strftime(batch + batchLen, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    batchLen += sprintf(batch + batchLen, ".%03d %s ",
+            (int) (rec->when / 1000000 % 1000), levelNames[rec->level]);
+    memcpy(batch + batchLen, rec + 1, rec->len);
+    batchLen += rec->len;
+    batch[batchLen++] = '\n';
+}
+
+/* empties one ring into the batch; returns how many records it had */
+static int log_drain_ring(LogRing *ring) {
+    int count = 0;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        size_t pos = head & (LOG_RING_SIZE - 1);
+        size_t toEnd = LOG_RING_SIZE - pos;
+        LogRecord *rec = (LogRecord*) (ring->data + pos);
+        if (toEnd < sizeof(LogRecord) || rec->len == LOG_WRAP) {
+            head += toEnd;
+            continue;
+        }
+        log_append(rec);
+        head += log_align(sizeof(LogRecord) + rec->len);
+        ++count;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void log_open(void) {
+    if (logPath == NULL) {
+        return;
+    }
+    int fd = open(logPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return; // keep writing to the old one
+    }
+    if (logFd != STDOUT_FILENO) {
+        close(logFd);
+    }
+    logFd = fd;
+}
+
+/* one pass over every ring, with drainLock held; frees those whose
+ * threads have gone
+ * returns how many records were written */
+static int log_drain_locked(void) {
+    int count = 0;
+    if (reopenWanted) {
+        reopenWanted = 0;
+        log_write_batch();
+        log_open();
+    }
+    // new rings only ever go on the front, and only we take them off,
+    // so everything past the head is ours to walk without the lock
+    LogRing **link = &rings;
+    LogRing *ring;
+    while ((ring = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL) {
+        int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        count += log_drain_ring(ring);
+        if (!dead) {
+            link = &ring->next;
+            continue;
+        }
+        pthread_mutex_lock(&ringsLock);
+        LogRing **at = &rings;
+        while (*at != ring) {
+            at = &(*at)->next; // someone pushed in front of it meanwhile
+        }
+        *at = ring->next;
+        pthread_mutex_unlock(&ringsLock);
+        free(ring);
+    }
+    log_write_batch();
+    return count;
+}
+
+static int log_drain(void) {
+    pthread_mutex_lock(&drainLock);
+    int count = log_drain_locked();
+    pthread_mutex_unlock(&drainLock);
+    return count;
+}
+
+/* may run from exit() in a signal handler, possibly on the writer
+ * itself mid-drain, so it only waits so long for the lock */
+void log_flush(void) {
+    for (int tries = 0; tries < 100; ++tries) {
+        if (!pthread_mutex_trylock(&drainLock)) {
+            log_drain_locked();
+            pthread_mutex_unlock(&drainLock);
+            return;
+        }
+        usleep(1000);
+    }
+}
+
+static void* log_writer(void *arg) {
+    while (1) {
+        if (log_drain() == 0) {
+            usleep(LOG_IDLE_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+void log_start(const char *path) {
+    logPath = path;
+    if (path != NULL) {
+        log_open();
+        if (logFd == STDOUT_FILENO) {
+            perror("Error opening log file");
+            exit(1);
+        }
+    }
+    pthread_key_create(&ringKey, log_ring_orphan);
+    tunable_register("loglevel", &level, LOG_LEVEL_DEBUG, LOG_LEVEL_ERROR,
+            "least severe level logged: 0 debug 1 info 2 warn 3 error");
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, log_writer, NULL);
+    pthread_detach(threadId);
+    atexit(log_flush);
+}
+
+long log_drops(void) {
+    return __atomic_load_n(&drops, __ATOMIC_RELAXED);
+}
+
+void log_reopen(void) {
+    reopenWanted = 1;
+}
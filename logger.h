@@ -0,0 +1,66 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+/* vim: set filetype=c : */
+
+/* Asynchronous logging for everything the data path has to say.
+ * Each thread formats its message into its own single-producer ring
+ * (made on its first log call) without locks or syscalls; one
+ * background thread drains every ring and writes them out in batches.
+ * If a thread's ring is full the message is dropped and counted.
+ *
+ * Goes to the -l logfile if there is one, stdout otherwise. SIGHUP
+ * makes the writer reopen the file, for logrotate.
+ */
+
+#include <stdint.h>
+#include <signal.h>
+#include "stats.h" // CACHE_LINE
+
+#define LOG_RING_SIZE 65536 // bytes per thread, a power of two
+#define LOG_LINE_MAX 512 // longer messages are truncated
+#define LOG_BATCH_SIZE 65536 // bytes the writer gathers per write()
+#define LOG_IDLE_MS 2 // writer's nap when every ring was empty
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+/* what a message looks like in a ring; its text follows it */
+typedef struct {
+    uint16_t len; // of the text, or LOG_WRAP
+    uint16_t level;
+    uint32_t pad;
+    uint64_t when; // CLOCK_REALTIME ns
+} LogRecord;
+
+#define LOG_WRAP 0xffff // the rest of the ring is empty: go back to 0
+
+/* one thread's ring; what the writer moves and what the owner moves are
+ * on lines of their own, so logging doesn't fight the drain for them */
+typedef struct LogRing {
+    char data[LOG_RING_SIZE];
+    // the writer thread's
+    uint64_t head __attribute__((aligned(CACHE_LINE))); // consumer position
+    struct LogRing *next;
+    // the owning thread's
+    uint64_t tail __attribute__((aligned(CACHE_LINE))); // producer position
+    int dead; // the owner has exited: free once drained
+} LogRing;
+
+/* opens the log (path may be NULL for stdout) and starts the writer
+ * exits the program if the file can't be opened */
+void log_start(const char *path);
+/* formats and queues a message if level is at or above "loglevel" */
+void log_msg(LogLevel level, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+/* messages dropped because their thread's ring was full */
+long log_drops(void);
+/* asks the writer to reopen the log; async-signal-safe */
+void log_reopen(void);
+/* writes out everything queued so far, from any thread */
+void log_flush(void);
+
+#endif
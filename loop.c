@@ -0,0 +1,379 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "loop.h"
+#include "logger.h"
+#include "handover.h"
+#include "station.h"
+#include "slab.h"
+#include "placement.h"
+
+static SlabPool connSlab = SLAB_POOL("epoll conns", sizeof(LoopConn));
+
+/* sets up an epoll instance per loop and starts their threads */
+LoopGroup* loop_group_create(int count, UserShard* shard) {
+    LoopGroup *group = malloc(sizeof(LoopGroup));
+    group->count = count;
+    group->next = 0;
+    group->loops = calloc(count, sizeof(EventLoop));
+    for (int i = 0; i < count; ++i) {
+        EventLoop *loop = &group->loops[i];
+        loop->id = i;
+        loop->shard = shard;
+        timeout_wheel_init(&loop->wheel);
+        pthread_mutex_init(&loop->wheelLock, NULL);
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            perror("Error creating epoll instance");
+            exit(1);
+        }
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        int slot = placement_prepare(&attr, "epoll loop", shard->id, i);
+        if (pthread_create(&loop->thread, &attr, loop_thread, (void*) loop)) {
+            fprintf(stderr, "Error starting event loop thread\n");
+            exit(1);
+        }
+        placement_started(slot, loop->thread);
+        pthread_attr_destroy(&attr);
+        pthread_detach(loop->thread);
+    }
+    return group;
+}
+
+/* counts the user in and registers it with a loop
+ * epoll_ctl is safe to call while the loop thread is in epoll_wait */
+void loop_group_adopt(LoopGroup* group, Conn* from) {
+    EventLoop *loop = &group->loops[group->next++ % group->count];
+    int fd = from->fd;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_msg(LOG_LEVEL_ERROR, "Error making client socket non-blocking: %s",
+                strerror(errno));
+        outq_clear(&from->out);
+        line_stop(&from->lines);
+        close(fd);
+        return;
+    }
+
+    LoopConn *conn = slab_alloc(&connSlab);
+    conn->base = *from;
+    conn->loop = loop;
+    conn->paused = 0;
+    conn->draining = 0;
+    conn->throttled = 0;
+
+    user_count_in(loop->shard);
+    conn_register(&conn->base);
+
+    // a handed-over user may come with output still to send
+    struct epoll_event ev;
+    conn->events = EPOLLIN | EPOLLRDHUP;
+    if (conn->base.out.bytes) {
+        conn->events |= EPOLLOUT;
+    }
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    // added, then armed, under the wheel's lock: the loop can't expire it
+    // (a handed-over user may be long overdue) or close it, freeing it,
+    // until both are done, and never before it's in the epoll set
+    pthread_mutex_lock(&loop->wheelLock);
+    int added = !epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (added) {
+        timeout_arm(&loop->wheel, &conn->base);
+    }
+    pthread_mutex_unlock(&loop->wheelLock);
+    if (!added) {
+        log_msg(LOG_LEVEL_ERROR, "Error adding client to event loop: %s",
+                strerror(errno));
+        conn_unregister(&conn->base);
+        outq_clear(&conn->base.out);
+        line_stop(&conn->base.lines);
+        close(fd);
+        user_count_out(loop->shard);
+        slab_free(&connSlab, conn);
+    }
+}
+
+/* drops a connection: the counterpart of the tail of user_client_thread */
+static void loop_close_conn(LoopConn* conn) {
+    EventLoop *loop = conn->loop;
+    if (conn->throttled) {
+        LoopConn **link = &loop->throttled;
+        while (*link != conn) {
+            link = &(*link)->throttledNext;
+        }
+        *link = conn->throttledNext;
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->base.fd, NULL);
+    pthread_mutex_lock(&loop->wheelLock);
+    timer_cancel(&loop->wheel, &conn->base.timer);
+    pthread_mutex_unlock(&loop->wheelLock);
+    conn_unregister(&conn->base);
+    outq_clear(&conn->base.out);
+    line_stop(&conn->base.lines);
+    throttle_stop(&conn->base.throttle);
+    close(conn->base.fd);
+    log_msg(LOG_LEVEL_INFO, "Done");
+    user_count_out(loop->shard);
+    histo_record(HISTO_LIFETIME, histo_now() - conn->base.acceptedAt);
+    slab_free(&connSlab, conn);
+}
+
+/* sends what we can of the queue
+ * returns 0 if the connection's broken */
+static int loop_flush(LoopConn* conn) {
+    ProgStats *ps = conn->loop->shard->progStats;
+    ssize_t n = outq_flush(&conn->base.out, conn->base.fd);
+    if (n < 0) {
+        stats_add(ps, STAT_WRITE_ERRORS, 1);
+        return 0;
+    }
+    stats_add(ps, STAT_BYTES_OUT, n);
+    conn_add_out(&conn->base, n);
+    return 1;
+}
+
+/* sends count buffers back in one go, queueing whatever the socket
+ * won't take now; anything already queued has to go first
+ * returns 0 if the connection's broken */
+static int loop_write(LoopConn* conn, struct iovec* iov, int count) {
+    ProgStats *ps = conn->loop->shard->progStats;
+    ssize_t n = 0;
+    size_t len = 0;
+    for (int i = 0; i < count; ++i) {
+        len += iov[i].iov_len;
+    }
+    if (!conn->base.out.bytes) {
+        // MSG_NOSIGNAL: a client hanging up must not take the process
+        // with it
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        n = sendmsg(conn->base.fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                stats_add(ps, STAT_WRITE_ERRORS, 1);
+                return 0;
+            }
+            n = 0;
+        }
+        stats_add(ps, STAT_BYTES_OUT, n);
+        conn_add_out(&conn->base, n);
+    }
+    if ((size_t) n < len) {
+        outq_push_iov(&conn->base.out, iov, count, n);
+    }
+    return 1;
+}
+
+/* reads whatever is waiting, transforms it and sends it back
+ * in line mode it reads into the connection's ring instead, and sends
+ * back only whole lines
+ * returns 0 if the connection is finished with */
+static int loop_read(LoopConn* conn, char* buffer) {
+    ProgStats *ps = conn->loop->shard->progStats;
+    LineReader *lines = &conn->base.lines;
+    struct iovec iov[LINES_IOV];
+    int count;
+    ssize_t numBytesRead;
+    if (lines->buf != NULL) {
+        numBytesRead = readv(conn->base.fd, iov, line_space(lines, iov));
+    } else {
+        numBytesRead = read(conn->base.fd, buffer, LOOP_BUFFER_SIZE);
+    }
+    if (numBytesRead == 0) {
+        if ((lines->buf != NULL && (count = line_rest(lines, iov)))
+                || (count = transform_rest(&conn->base.carry, iov))) {
+            // the last line never ended, or the input stopped part way
+            // through a UTF-8 sequence: it goes back as it is
+            int sent = loop_write(conn, iov, count);
+            if (lines->buf != NULL) {
+                line_release(lines);
+            }
+            if (!sent) {
+                return 0;
+            }
+        }
+        // their echoes may still be queued: see them out first
+        conn->draining = 1;
+        return conn->base.out.bytes != 0;
+    }
+    if (numBytesRead < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 1;
+        }
+        stats_add(ps, STAT_READ_ERRORS, 1);
+        log_msg(LOG_LEVEL_WARN, "Error reading from socket: %s",
+                strerror(errno));
+        return 0;
+    }
+    uint64_t readAt = histo_now();
+    stats_add(ps, STAT_BYTES_IN, numBytesRead);
+    conn_add_in(&conn->base, numBytesRead);
+    conn_note_read(&conn->base, readAt);
+    if (lines->buf != NULL) {
+        long lineCount, tooLong;
+        count = line_take(lines, numBytesRead, iov, &lineCount, &tooLong);
+        stats_add(ps, STAT_LINES, lineCount);
+        stats_add(ps, STAT_LONG_LINES, tooLong);
+    } else {
+        size_t len = numBytesRead;
+        iov[0].iov_base = transform_stream(&conn->base.carry, buffer, &len);
+        iov[0].iov_len = len;
+        count = 1;
+    }
+    station_forward(&conn->base, iov, count);
+    int sent = !count || loop_write(conn, iov, count);
+    if (lines->buf != NULL) {
+        line_release(lines);
+    }
+    if (!sent) {
+        return 0;
+    }
+    histo_record(HISTO_ECHO, histo_now() - readAt);
+    if (throttle_charge(&conn->base.throttle, conn->base.peer.sin_addr, ps,
+            numBytesRead, readAt) && !conn->throttled) {
+        // loop_watch stops reading; loop_resume starts again
+        conn->throttled = 1;
+        conn->throttledNext = conn->loop->throttled;
+        conn->loop->throttled = conn;
+    }
+    return 1;
+}
+
+/* points epoll at what conn needs next: its queue sent, and more to
+ * read unless it's queued too much (or they've finished)
+ * returns 0 if the connection is finished with */
+static int loop_watch(LoopConn* conn) {
+    size_t queued = conn->base.out.bytes;
+    if (conn->draining && !queued) {
+        return 0;
+    }
+    if (!conn->paused && queued >= outq_hwm()) {
+        conn->paused = 1;
+        stats_add(conn->loop->shard->progStats, STAT_OUTPUT_PAUSES, 1);
+    } else if (conn->paused && queued <= outq_lwm()) {
+        conn->paused = 0;
+    }
+    uint32_t events = queued ? EPOLLOUT : 0;
+    if (!conn->paused && !conn->draining && !conn->throttled) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events != conn->events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->base.fd, &ev)) {
+            log_msg(LOG_LEVEL_ERROR, "Error watching client: %s",
+                    strerror(errno));
+            return 0;
+        }
+        conn->events = events;
+    }
+    return 1;
+}
+
+/* does whatever epoll said conn is ready for
+ * returns 0 if the connection is finished with */
+static int loop_service_conn(LoopConn* conn, uint32_t events, char* buffer) {
+    // a hang-up or error shows up as a failed write or read
+    if ((events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && conn->base.out.bytes
+            && !loop_flush(conn)) {
+        return 0;
+    }
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            && (conn->events & EPOLLIN) && !loop_read(conn, buffer)) {
+        return 0;
+    }
+    return loop_watch(conn);
+}
+
+/* closes whoever's run out of time; rearms the rest for their next
+ * deadline
+ * only this thread frees conns, so the expired ones are safe to use
+ * once they're off the wheel */
+static void loop_expire(EventLoop* loop) {
+    uint64_t now = histo_now();
+    pthread_mutex_lock(&loop->wheelLock);
+    Timer *timer = timer_advance(&loop->wheel, now);
+    pthread_mutex_unlock(&loop->wheelLock);
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        LoopConn *conn = (LoopConn*) timeout_conn(timer);
+        TimeoutKind kind = timeout_check(&conn->base, now);
+        if (kind == TIMEOUT_NONE) {
+            pthread_mutex_lock(&loop->wheelLock);
+            timeout_arm(&loop->wheel, &conn->base);
+            pthread_mutex_unlock(&loop->wheelLock);
+        } else {
+            timeout_expired(loop->shard->progStats, &conn->base, kind);
+            loop_close_conn(conn);
+        }
+        timer = next;
+    }
+}
+
+/* reads again from whoever's waited out their rate limit
+ * returns how long epoll_wait may wait for, in ms, so the rest aren't
+ * kept waiting longer than they should be */
+static int loop_resume(EventLoop* loop) {
+    uint64_t now = histo_now(), soonest = 0;
+    LoopConn **link = &loop->throttled;
+    while (*link != NULL) {
+        LoopConn *conn = *link;
+        uint64_t until = conn->base.throttle.until;
+        if (until > now) {
+            if (!soonest || until < soonest) {
+                soonest = until;
+            }
+            link = &conn->throttledNext;
+            continue;
+        }
+        *link = conn->throttledNext;
+        conn->throttled = 0;
+        if (!loop_watch(conn)) {
+            loop_close_conn(conn);
+        }
+    }
+    int wait = TIMEOUT_TICK_MS;
+    if (soonest && (soonest - now + 999999) / 1000000 < (uint64_t) wait) {
+        wait = (soonest - now + 999999) / 1000000;
+    }
+    return wait;
+}
+
+/* waits on this loop's epoll instance forever */
+void* loop_thread(void* arg) {
+    EventLoop *loop = (EventLoop*) arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    // with room in front for a sequence the last read cut off, on our
+    // own node
+    char *buffer = (char*) placement_alloc(TRANSFORM_CARRY_MAX
+            + LOOP_BUFFER_SIZE, -1) + TRANSFORM_CARRY_MAX;
+
+    handover_join();
+    while (1) {
+        handover_checkpoint();
+        int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS,
+                loop_resume(loop));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting on event loop");
+            exit(1);
+        }
+        for (int i = 0; i < n; ++i) {
+            LoopConn *conn = (LoopConn*) events[i].data.ptr;
+            if (!loop_service_conn(conn, events[i].events, buffer)) {
+                loop_close_conn(conn);
+            }
+        }
+        loop_expire(loop);
+    }
+    placement_free(buffer - TRANSFORM_CARRY_MAX,
+            TRANSFORM_CARRY_MAX + LOOP_BUFFER_SIZE);
+    return NULL;
+}
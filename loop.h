@@ -0,0 +1,68 @@
+#ifndef LOOP_H_
+#define LOOP_H_
+/* vim: set filetype=c : */
+
+/* The epoll engine: a small fixed set of loop threads, each with its own
+ * epoll instance, multiplexing every user connection handed to it.
+ * The accept thread still does accept(); it just adopts the new fd into
+ * one of the loops instead of spawning a thread for it.
+ *
+ * Whatever a user's socket won't take straight away waits in its
+ * Conn's OutQueue until the socket's writable again. Once that passes
+ * output_hwm we stop reading from them (and so stop making more) until
+ * it's back down to half. Likewise while a rate limit has them waiting,
+ * until the loop's next pass after their throttle runs out.
+ */
+
+#include <sys/epoll.h>
+#include <pthread.h>
+#include "shared.h"
+#include "histo.h"
+#include "conn.h"
+#include "timeout.h"
+
+#define LOOP_MAX_EVENTS 64
+#define LOOP_BUFFER_SIZE 16384
+
+struct LoopConn;
+
+/* one epoll instance serviced by one thread */
+typedef struct {
+    int epfd;
+    int id;
+    pthread_t thread;
+    UserShard* shard; // the listener whose connections this loop serves
+    // its connections' timeouts; the acceptor arms new ones, hence a lock
+    TimerWheel wheel;
+    pthread_mutex_t wheelLock;
+    struct LoopConn* throttled; // waiting out a rate limit: not reading
+} EventLoop;
+
+/* the set of loops a listener spreads its connections over */
+typedef struct {
+    int count;
+    unsigned int next; // round-robin cursor, only touched by the acceptor
+    EventLoop* loops;
+} LoopGroup;
+
+/* per-connection state owned by a loop */
+typedef struct LoopConn {
+    Conn base;
+    EventLoop* loop;
+    uint32_t events; // what epoll is watching for
+    int paused; // too much queued: not reading
+    int draining; // they've stopped sending: close once the queue's empty
+    int throttled; // on the loop's throttled list
+    struct LoopConn* throttledNext;
+} LoopConn;
+
+/* creates and starts count loop threads; exits the program on failure */
+LoopGroup* loop_group_create(int count, UserShard* shard);
+/* hands an accepted (blocking) connection to the next loop in the group,
+ * copying conn; the loop owns its fd from then on and closes it when
+ * the client leaves */
+void loop_group_adopt(LoopGroup* group, Conn* conn);
+/* body of a loop thread; arg is its EventLoop */
+void* loop_thread(void*);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "outq.h"
+#include "tunables.h"
+#include "slab.h"
+
+static long hwm = OUTQ_DEFAULT_HWM;
+static SlabPool chunkSlab = SLAB_POOL("output chunks", sizeof(OutChunk));
+
+void outq_init(void) {
+    tunable_register("output_hwm", &hwm, 4096, 1L << 30,
+            "bytes queued for a user before we stop reading from them");
+}
+
+size_t outq_hwm(void) {
+    return tunable_get(&hwm);
+}
+
+size_t outq_lwm(void) {
+    return tunable_get(&hwm) / 2;
+}
+
+void outq_push(OutQueue *q, const char *data, size_t len) {
+    __atomic_store_n(&q->bytes, q->bytes + len, __ATOMIC_RELAXED);
+    while (len) {
+        OutChunk *tail = q->tail;
+        if (tail == NULL || tail->end == OUTQ_CHUNK_DATA) {
+            tail = slab_alloc(&chunkSlab);
+            tail->next = NULL;
+            tail->start = tail->end = 0;
+            if (q->tail != NULL) {
+                q->tail->next = tail;
+            } else {
+                q->head = tail;
+            }
+            q->tail = tail;
+        }
+        size_t n = OUTQ_CHUNK_DATA - tail->end;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(tail->data + tail->end, data, n);
+        tail->end += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void outq_push_iov(OutQueue *q, struct iovec *iov, int count, size_t skip) {
+    for (int i = 0; i < count; ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        outq_push(q, (char*) iov[i].iov_base + skip, iov[i].iov_len - skip);
+        skip = 0;
+    }
+}
+
+/* drops n written bytes off the front */
+static void outq_consume(OutQueue *q, size_t n) {
+    __atomic_store_n(&q->bytes, q->bytes - n, __ATOMIC_RELAXED);
+    while (n) {
+        OutChunk *chunk = q->head;
+        size_t left = chunk->end - chunk->start;
+        if (n < left) {
+            chunk->start += n;
+            return;
+        }
+        n -= left;
+        q->head = chunk->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        slab_free(&chunkSlab, chunk);
+    }
+}
+
+ssize_t outq_flush(OutQueue *q, int fd) {
+    struct iovec iov[OUTQ_IOV];
+    ssize_t written = 0;
+    while (q->head != NULL) {
+        int count = 0;
+        size_t want = 0;
+        for (OutChunk *c = q->head; c != NULL && count < OUTQ_IOV;
+                c = c->next) {
+            iov[count].iov_base = c->data + c->start;
+            iov[count].iov_len = c->end - c->start;
+            want += iov[count++].iov_len;
+        }
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR && written) {
+                break;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? written : -1;
+        }
+        outq_consume(q, n);
+        written += n;
+        if ((size_t) n < want) {
+            break; // the socket's full
+        }
+    }
+    return written;
+}
+
+char* outq_copy(OutQueue *q) {
+    if (q->bytes == 0) {
+        return NULL;
+    }
+    char *copy = malloc(q->bytes);
+    size_t at = 0;
+    for (OutChunk *c = q->head; c != NULL; c = c->next) {
+        memcpy(copy + at, c->data + c->start, c->end - c->start);
+        at += c->end - c->start;
+    }
+    return copy;
+}
+
+void outq_clear(OutQueue *q) {
+    outq_consume(q, q->bytes);
+}
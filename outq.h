@@ -0,0 +1,53 @@
+#ifndef OUTQ_H_
+#define OUTQ_H_
+/* vim: set filetype=c : */
+
+/* A connection's output that the socket wouldn't take yet: a list of
+ * fixed-size chunks from a slab, filled in order and flushed oldest
+ * first with writev so everything pending can go out in one syscall.
+ *
+ * The "output_hwm" tunable is how much a connection may have queued
+ * before we stop reading from it; reading starts again once it's down
+ * to half that.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define OUTQ_IOV 64 // chunks per writev
+#define OUTQ_DEFAULT_HWM 262144
+#define OUTQ_CHUNK_DATA 16320 // a 16KB slab object with the header
+
+typedef struct OutChunk {
+    struct OutChunk *next;
+    size_t start, end; // what's still to go out
+    char data[OUTQ_CHUNK_DATA];
+} OutChunk;
+
+typedef struct {
+    OutChunk *head, *tail;
+    size_t bytes; // not yet written; changed atomically for admins
+} OutQueue;
+
+/* registers output_hwm */
+void outq_init(void);
+/* the high- and low-water marks in bytes */
+size_t outq_hwm(void);
+size_t outq_lwm(void);
+/* copies len bytes onto the end of q */
+void outq_push(OutQueue* q, const char* data, size_t len);
+/* the same for what count iovecs hold, less the first skip bytes */
+void outq_push_iov(OutQueue* q, struct iovec* iov, int count, size_t skip);
+/* writes as much of q to fd as it will take right now; on a blocking fd,
+ * a signal stops it rather than being retried, so the caller can get to
+ * a handover checkpoint
+ * returns how much that was, or -1 with errno set (EINTR if the signal
+ * came before anything went) */
+ssize_t outq_flush(OutQueue* q, int fd);
+/* the queued bytes in one malloc'd block (NULL if none) */
+char* outq_copy(OutQueue* q);
+/* throws away anything queued */
+void outq_clear(OutQueue* q);
+
+#endif
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE // cpu_set_t, pthread_attr_setaffinity_np
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "placement.h"
+
+#define PLACEMENT_NODE_DIR "/sys/devices/system/node"
+#define PLACEMENT_LIST_MAX 4096 // longest CPU list we'll read or print
+
+typedef enum { PLACE_NONE, PLACE_CPUS, PLACE_NODES } PlacementPolicy;
+
+typedef struct {
+    char role[PLACEMENT_ROLE_MAX];
+    int shard, index;
+    int node; // -1 if it spans nodes
+    pthread_t thread;
+    int started;
+} PlacedThread;
+
+// the machine, as far as we may use it
+static cpu_set_t allowed; // our affinity at startup
+static int nodeCount = 0;
+static int nodeId[PLACEMENT_MAX_NODES];
+static cpu_set_t nodeCpus[PLACEMENT_MAX_NODES];
+static int nodesFromSys = 0;
+
+// the policy, fixed once configured
+static PlacementPolicy policy = PLACE_NONE;
+static char policySpec[PLACEMENT_LIST_MAX];
+static int cpuList[CPU_SETSIZE], cpuCount = 0; // PLACE_CPUS, in order
+static cpu_set_t cpuSet;
+static int nodeList[PLACEMENT_MAX_NODES], nodeListCount = 0; // indexes
+static unsigned nextCpu = 0, nextNode = 0; // atomic
+
+static pthread_mutex_t placedLock = PTHREAD_MUTEX_INITIALIZER;
+static PlacedThread placed[PLACEMENT_MAX_THREADS];
+static int placedCount = 0;
+static long transient = 0; // users' threads placed; atomic
+
+/* "0-3,8,10-11" into set; returns 0 if it's not a list */
+static int placement_parse_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 0) {
+            return 0;
+        }
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo) {
+                return 0;
+            }
+            p = end;
+        }
+        if (hi >= CPU_SETSIZE) {
+            return 0;
+        }
+        for (long i = lo; i <= hi; ++i) {
+            CPU_SET(i, set);
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p != '\0' && *p != '\n') {
+            return 0;
+        } else {
+            break;
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/* set back into "0-3,8" form */
+static void placement_format(const cpu_set_t *set, char *out, size_t size) {
+    size_t used = 0;
+    out[0] = '\0';
+    for (int i = 0; i < CPU_SETSIZE && used < size; ++i) {
+        if (!CPU_ISSET(i, set)) {
+            continue;
+        }
+        int j = i;
+        while (j + 1 < CPU_SETSIZE && CPU_ISSET(j + 1, set)) {
+            ++j;
+        }
+        used += snprintf(out + used, size - used, used ? ",%d" : "%d", i);
+        if (j > i && used < size) {
+            used += snprintf(out + used, size - used, "-%d", j);
+        }
+        i = j;
+    }
+}
+
+/* a one-line sysfs file, read into set */
+static int placement_read_list(const char *path, cpu_set_t *set) {
+    char line[PLACEMENT_LIST_MAX];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    int ok = fgets(line, sizeof(line), f) != NULL
+            && placement_parse_list(line, set);
+    fclose(f);
+    return ok;
+}
+
+void placement_init(void) {
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        CPU_ZERO(&allowed);
+        for (long i = 0; i < sysconf(_SC_NPROCESSORS_ONLN)
+                && i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, &allowed);
+        }
+    }
+    cpu_set_t online;
+    if (placement_read_list(PLACEMENT_NODE_DIR "/online", &online)) {
+        for (int n = 0; n < CPU_SETSIZE && nodeCount < PLACEMENT_MAX_NODES;
+                ++n) {
+            char path[128];
+            snprintf(path, sizeof(path), PLACEMENT_NODE_DIR "/node%d/cpulist",
+                    n);
+            cpu_set_t cpus;
+            // memory-only nodes have an empty list: no threads go there
+            if (CPU_ISSET(n, &online) && placement_read_list(path, &cpus)) {
+                CPU_AND(&nodeCpus[nodeCount], &cpus, &allowed);
+                if (CPU_COUNT(&nodeCpus[nodeCount])) {
+                    nodeId[nodeCount++] = n;
+                }
+            }
+        }
+    }
+    nodesFromSys = nodeCount > 0;
+    if (!nodesFromSys) {
+        // no NUMA in this kernel: it's all one node
+        nodeId[0] = 0;
+        nodeCpus[0] = allowed;
+        nodeCount = 1;
+    }
+}
+
+/* the index of the node cpu is on, or -1 */
+static int placement_cpu_node(int cpu) {
+    for (int i = 0; i < nodeCount; ++i) {
+        if (CPU_ISSET(cpu, &nodeCpus[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *placement_configure(const char *spec) {
+    static char error[PLACEMENT_LIST_MAX + 64];
+    cpu_set_t set;
+    if (strlen(spec) >= sizeof(policySpec)) {
+        return "policy too long";
+    }
+    if (!strncmp(spec, "cpus:", 5)) {
+        if (!placement_parse_list(spec + 5, &set)) {
+            return "cpus: wants a list like 0-3,8";
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &set)) {
+                continue;
+            }
+            if (!CPU_ISSET(cpu, &allowed)) {
+                snprintf(error, sizeof(error), "CPU %d isn't ours to use",
+                        cpu);
+                return error;
+            }
+            cpuList[cpuCount++] = cpu;
+        }
+        cpuSet = set;
+        policy = PLACE_CPUS;
+    } else if (!strcmp(spec, "nodes") || !strncmp(spec, "nodes:", 6)) {
+        if (spec[5] == '\0') {
+            for (int i = 0; i < nodeCount; ++i) {
+                nodeList[nodeListCount++] = i;
+            }
+        } else if (!placement_parse_list(spec + 6, &set)) {
+            return "nodes: wants a list like 0,1";
+        }
+        for (int n = 0; spec[5] != '\0' && n < CPU_SETSIZE; ++n) {
+            if (!CPU_ISSET(n, &set)) {
+                continue;
+            }
+            int i = 0;
+            while (i < nodeCount && nodeId[i] != n) {
+                ++i;
+            }
+            if (i == nodeCount) {
+                snprintf(error, sizeof(error), "no node %d with CPUs of ours",
+                        n);
+                return error;
+            }
+            nodeList[nodeListCount++] = i;
+        }
+        policy = PLACE_NODES;
+    } else {
+        return "expected cpus:LIST, nodes or nodes:LIST";
+    }
+    strcpy(policySpec, spec);
+    return NULL;
+}
+
+int placement_prepare(pthread_attr_t *attr, const char *role, int shard,
+        int index) {
+    cpu_set_t set;
+    int node;
+    if (policy == PLACE_NONE) {
+        return -1;
+    }
+    if (policy == PLACE_CPUS && index < 0) {
+        set = cpuSet; // a user's thread: any of them
+        node = -1;
+    } else if (policy == PLACE_CPUS) {
+        int cpu = cpuList[__atomic_fetch_add(&nextCpu, 1, __ATOMIC_RELAXED)
+                % cpuCount];
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        node = placement_cpu_node(cpu);
+    } else {
+        // a shard's threads share its node; the rest take turns
+        unsigned pick = shard >= 0 ? (unsigned) shard : index >= 0
+                ? (unsigned) index
+                : __atomic_fetch_add(&nextNode, 1, __ATOMIC_RELAXED);
+        node = nodeList[pick % nodeListCount];
+        set = nodeCpus[node];
+    }
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (index < 0) {
+        __atomic_fetch_add(&transient, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    pthread_mutex_lock(&placedLock);
+    int slot = placedCount < PLACEMENT_MAX_THREADS ? placedCount++ : -1;
+    if (slot >= 0) {
+        PlacedThread *p = &placed[slot];
+        snprintf(p->role, sizeof(p->role), "%s", role);
+        p->shard = shard;
+        p->index = index;
+        p->node = node;
+        p->started = 0;
+    }
+    pthread_mutex_unlock(&placedLock);
+    return slot;
+}
+
+void placement_started(int slot, pthread_t thread) {
+    if (slot < 0) {
+        return;
+    }
+    pthread_mutex_lock(&placedLock);
+    placed[slot].thread = thread;
+    placed[slot].started = 1;
+    pthread_mutex_unlock(&placedLock);
+}
+
+int placement_node(int slot) {
+    return slot < 0 ? -1 : placed[slot].node;
+}
+
+void* placement_alloc(size_t size, int node) {
+    if (policy == PLACE_NONE) {
+        void *buffer = malloc(size);
+        if (buffer == NULL) {
+            fprintf(stderr, "Out of memory for a %zu byte buffer\n", size);
+            exit(1);
+        }
+        return buffer;
+    }
+    if (node < 0) {
+        int cpu = sched_getcpu();
+        node = cpu < 0 ? -1 : placement_cpu_node(cpu);
+    }
+    void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        fprintf(stderr, "Out of memory for a %zu byte buffer\n", size);
+        exit(1);
+    }
+    if (node >= 0 && nodesFromSys && nodeId[node] < PLACEMENT_MAX_NODES) {
+        // preferred, not bound: a full node falls back to another
+        unsigned long mask[PLACEMENT_MAX_NODES / (8 * sizeof(long))] = {0};
+        int id = nodeId[node];
+        mask[id / (8 * sizeof(long))] |= 1UL << (id % (8 * sizeof(long)));
+        // pages are placed when first touched, wherever that's from
+        syscall(SYS_mbind, buffer, size, MPOL_PREFERRED, mask,
+                (unsigned long) PLACEMENT_MAX_NODES + 1, 0);
+    }
+    return buffer;
+}
+
+void placement_free(void *buffer, size_t size) {
+    if (policy == PLACE_NONE) {
+        free(buffer);
+    } else {
+        munmap(buffer, size);
+    }
+}
+
+void placement_report(FILE *out) {
+    char list[PLACEMENT_LIST_MAX];
+    fprintf(out, "policy: %s\n", policy == PLACE_NONE
+            ? "none (the scheduler decides)" : policySpec);
+    for (int i = 0; i < nodeCount; ++i) {
+        placement_format(&nodeCpus[i], list, sizeof(list));
+        fprintf(out, "node %d: cpus %s%s\n", nodeId[i], list,
+                nodesFromSys ? "" : " (no NUMA information)");
+    }
+    pthread_mutex_lock(&placedLock);
+    for (int i = 0; i < placedCount; ++i) {
+        PlacedThread *p = &placed[i];
+        cpu_set_t set;
+        // what the kernel actually holds it to, not what we asked for
+        if (!p->started || pthread_getaffinity_np(p->thread, sizeof(set),
+                &set)) {
+            continue;
+        }
+        placement_format(&set, list, sizeof(list));
+        fprintf(out, "%s %d", p->role, p->index);
+        if (p->shard >= 0) {
+            fprintf(out, " (shard %d)", p->shard);
+        }
+        if (p->node >= 0) {
+            fprintf(out, ": node %d, cpus %s\n", nodeId[p->node], list);
+        } else {
+            fprintf(out, ": cpus %s\n", list);
+        }
+    }
+    pthread_mutex_unlock(&placedLock);
+    if (policy != PLACE_NONE) {
+        fprintf(out, "user threads placed: %ld\n",
+                __atomic_load_n(&transient, __ATOMIC_RELAXED));
+    }
+}
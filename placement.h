@@ -0,0 +1,54 @@
+#ifndef PLACEMENT_H_
+#define PLACEMENT_H_
+/* vim: set filetype=c : */
+
+/* Where the serving threads run, set with -A; by default the scheduler
+ * decides.
+ *
+ * "-A cpus:0-3,8-11" pins each accept loop, event loop and pool worker
+ * to one of those CPUs, round-robin in the order they start; a thread
+ * per user (the threads engine) may run on any of them.
+ *
+ * "-A nodes" (or "nodes:0,1" for some of them) puts each shard on a NUMA
+ * node, round-robin: its accept loop, its event loops and its users'
+ * threads all run on that node's CPUs, so the state of its connections,
+ * allocated by those threads, is first touched there and stays there.
+ * Pool workers, shared by every shard, are spread over the nodes.
+ *
+ * Buffers a thread keeps for life (an epoll loop's read buffer, an
+ * io_uring loop's receive buffers, a worker's deque) come from
+ * placement_alloc(), which mbind()s them to the thread's node. The
+ * topology comes from /sys/devices/system/node, and mbind is a raw
+ * syscall, so there's nothing to link. "placement" on the control
+ * socket shows the nodes and every placed thread's CPUs.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define PLACEMENT_MAX_NODES 64
+#define PLACEMENT_MAX_THREADS 1024 // listed by "placement"
+#define PLACEMENT_ROLE_MAX 32
+
+/* reads the machine's nodes and CPUs; call before placement_configure */
+void placement_init(void);
+/* sets the policy from -A; returns NULL on success, or what was wrong */
+const char *placement_configure(const char* spec);
+/* fills attr in for a new thread of role (e.g. "epoll loop"), serving
+ * shard (or -1 for all of them), the index-th of its kind (or -1 for a
+ * user's own thread, which isn't listed)
+ * returns its slot, for placement_started and placement_node, or -1 */
+int placement_prepare(pthread_attr_t* attr, const char* role, int shard,
+        int index);
+/* lists the thread just made with that attr */
+void placement_started(int slot, pthread_t thread);
+/* the node slot's thread runs on, or -1 if it could be anywhere */
+int placement_node(int slot);
+/* size bytes on node (-1: this thread's), for a thread's own buffers;
+ * exits the program if memory's run out */
+void* placement_alloc(size_t size, int node);
+void placement_free(void* buffer, size_t size);
+/* the policy, the nodes, and each placed thread */
+void placement_report(FILE* out);
+
+#endif
@@ -0,0 +1,205 @@
+#include <unistd.h>
+#include <time.h>
+#include "pool.h"
+#include "placement.h"
+
+/* sets up every worker's deque and starts their threads */
+WorkerPool* pool_create(int count, int stackKb, int depth) {
+    WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+    pool->count = count;
+    pool->depth = depth;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->space, NULL);
+    if (posix_memalign((void**) &pool->workers, CACHE_LINE,
+            count * sizeof(PoolWorker))) {
+        fprintf(stderr, "Error allocating worker pool\n");
+        exit(1);
+    }
+    memset(pool->workers, 0, count * sizeof(PoolWorker));
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_attr_setstacksize(&attr, (size_t) stackKb * 1024)) {
+        fprintf(stderr, "Invalid worker stack size: %d KB\n", stackKb);
+        exit(1);
+    }
+    for (int i = 0; i < count; ++i) {
+        PoolWorker *worker = &pool->workers[i];
+        worker->id = i;
+        worker->pool = pool;
+        // shared by every shard: spread over the nodes, deque and all
+        int slot = placement_prepare(&attr, "pool worker", -1, i);
+        worker->tasks = placement_alloc(depth * sizeof(PoolTask),
+                placement_node(slot));
+        pthread_mutex_init(&worker->lock, NULL);
+        if (pthread_create(&worker->thread, &attr, pool_worker_thread,
+                (void*) worker)) {
+            fprintf(stderr, "Error starting pool worker thread\n");
+            exit(1);
+        }
+        placement_started(slot, worker->thread);
+    }
+    pthread_attr_destroy(&attr);
+    return pool;
+}
+
+/* takes this worker's oldest task, or the newest of a victim's
+ * returns 1 and fills *task if there was one */
+static int pool_take(PoolWorker *worker, PoolTask *task, int steal) {
+    int found = 0;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head != worker->tail) {
+        if (steal) {
+            --worker->tail;
+            *task = worker->tasks[worker->tail % worker->pool->depth];
+        } else {
+            *task = worker->tasks[worker->head % worker->pool->depth];
+            ++worker->head;
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+/* our own deque first, then everyone else's starting with our neighbour */
+static int pool_find_task(PoolWorker *worker, PoolTask *task) {
+    WorkerPool *pool = worker->pool;
+    if (pool_take(worker, task, 0)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->count; ++i) {
+        PoolWorker *victim = &pool->workers[(worker->id + i) % pool->count];
+        if (pool_take(victim, task, 1)) {
+            __atomic_fetch_add(&worker->stolen, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* a task has left the queues: wake an acceptor if it was waiting on that
+ * pending and acceptorsWaiting are seq_cst so that either we see the
+ * acceptor waiting, or it sees our decrement before it sleeps */
+static void pool_taken(WorkerPool *pool) {
+    __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->acceptorsWaiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->space);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void* pool_worker_thread(void *arg) {
+    PoolWorker *worker = (PoolWorker*) arg;
+    WorkerPool *pool = worker->pool;
+    PoolTask task;
+    while (1) {
+        if (pool_find_task(worker, &task)) {
+            pool_taken(pool);
+            __atomic_store_n(&worker->busy, 1, __ATOMIC_RELAXED);
+            task.run(task.arg);
+            __atomic_store_n(&worker->busy, 0, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&worker->ran, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        // pool_submit signals under the lock after bumping pending,
+        // so checking it here with the lock held can't miss a wakeup
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) <= 0) {
+            ++pool->idle;
+            pthread_cond_wait(&pool->work, &pool->lock);
+            --pool->idle;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+int pool_wait_space(WorkerPool *pool, int timeoutMs) {
+    long capacity = (long) pool->count * pool->depth;
+    if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) < capacity) {
+        return 1;
+    }
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeoutMs / 1000;
+    until.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_nsec -= 1000000000L;
+        ++until.tv_sec;
+    }
+    int timedOut = 0;
+    pthread_mutex_lock(&pool->lock);
+    __atomic_fetch_add(&pool->acceptorsWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) >= capacity) {
+        __atomic_fetch_add(&pool->fullWaits, 1, __ATOMIC_RELAXED);
+    }
+    while (!timedOut
+            && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) >= capacity) {
+        if (timeoutMs < 0) {
+            pthread_cond_wait(&pool->space, &pool->lock);
+        } else {
+            timedOut = pthread_cond_timedwait(&pool->space, &pool->lock,
+                    &until) == ETIMEDOUT;
+        }
+    }
+    __atomic_fetch_sub(&pool->acceptorsWaiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->lock);
+    return !timedOut;
+}
+
+int pool_submit(WorkerPool *pool, void (*run)(void*), void *arg) {
+    unsigned int start = __atomic_fetch_add(&pool->next, 1,
+            __ATOMIC_RELAXED);
+    for (int i = 0; i < pool->count; ++i) {
+        PoolWorker *worker = &pool->workers[(start + i) % pool->count];
+        pthread_mutex_lock(&worker->lock);
+        if (worker->tail - worker->head < pool->depth) {
+            PoolTask *task = &worker->tasks[worker->tail % pool->depth];
+            task->run = run;
+            task->arg = arg;
+            ++worker->tail;
+            __atomic_fetch_add(&pool->pending, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&worker->lock);
+
+            pthread_mutex_lock(&pool->lock);
+            if (pool->idle) {
+                pthread_cond_signal(&pool->work);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+    return -1;
+}
+
+/* a summary line, then (if perWorker) a line per worker */
+void pool_report(FILE *out, WorkerPool *pool, int perWorker) {
+    int busy = 0;
+    long stolen = 0;
+    for (int i = 0; i < pool->count; ++i) {
+        busy += __atomic_load_n(&pool->workers[i].busy, __ATOMIC_RELAXED);
+        stolen += __atomic_load_n(&pool->workers[i].stolen,
+                __ATOMIC_RELAXED);
+    }
+    fprintf(out, "pool: %d workers, %d busy, %ld queued (max %d each), "
+            "%ld steals, %ld full waits\n", pool->count, busy,
+            __atomic_load_n(&pool->pending, __ATOMIC_RELAXED), pool->depth,
+            stolen, __atomic_load_n(&pool->fullWaits, __ATOMIC_RELAXED));
+    for (int i = 0; perWorker && i < pool->count; ++i) {
+        PoolWorker *worker = &pool->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        long queued = worker->tail - worker->head;
+        pthread_mutex_unlock(&worker->lock);
+        fprintf(out, "pool worker %d: %ld queued, %ld run, %ld stolen%s\n",
+                worker->id, queued,
+                __atomic_load_n(&worker->ran, __ATOMIC_RELAXED),
+                __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED),
+                __atomic_load_n(&worker->busy, __ATOMIC_RELAXED)
+                    ? ", busy" : "");
+    }
+}
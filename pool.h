@@ -0,0 +1,75 @@
+#ifndef POOL_H_
+#define POOL_H_
+/* vim: set filetype=c : */
+
+/* The pool engine: blocking I/O like the threads engine, but on a fixed
+ * set of worker threads made up front instead of one per connection.
+ * The accept thread pushes each connection onto the back of one
+ * worker's bounded deque (round-robin, skipping full ones). A worker
+ * takes its own oldest task first; when it has none it steals the
+ * newest from someone else's. Workers with nothing to do sleep.
+ *
+ * A task runs to completion on its worker, so the pool size is how many
+ * users are served at once; the rest wait queued with their welcome.
+ * When every deque is full the acceptor stops accepting until there's
+ * room, leaving the rest in the listen backlog.
+ */
+
+#include <pthread.h>
+#include "shared.h"
+
+#define POOL_DEFAULT_WORKERS 64
+#define POOL_DEFAULT_STACK_KB 256
+#define POOL_DEFAULT_DEPTH 64
+
+/* one unit of work: run(arg) */
+typedef struct {
+    void (*run)(void*);
+    void* arg;
+} PoolTask;
+
+struct WorkerPool;
+
+/* a worker thread and its deque; the lock covers tasks, head and tail */
+typedef struct {
+    pthread_mutex_t lock;
+    PoolTask* tasks; // ring of pool->depth
+    long head; // the oldest task: where the owner takes from
+    long tail; // where the acceptor pushes and thieves steal from
+    int id;
+    int busy; // running a task right now
+    long ran; // tasks run, stolen ones included
+    long stolen; // tasks taken from another worker's deque
+    pthread_t thread;
+    struct WorkerPool* pool;
+} __attribute__((aligned(CACHE_LINE))) PoolWorker;
+
+typedef struct WorkerPool {
+    int count;
+    int depth; // per-worker deque capacity
+    unsigned int next; // round-robin cursor for acceptors (atomic)
+    long pending; // tasks queued across every deque
+    long fullWaits; // times an acceptor had to wait for room
+    int acceptorsWaiting;
+    int idle; // workers asleep on work
+    pthread_mutex_t lock; // for the two condition variables
+    pthread_cond_t work;
+    pthread_cond_t space;
+    PoolWorker* workers;
+} WorkerPool;
+
+/* creates and starts count workers with stackKb KB stacks, each with a
+ * deque of depth tasks; exits the program on failure */
+WorkerPool* pool_create(int count, int stackKb, int depth);
+/* blocks until some deque has room for another task, or for timeoutMs
+ * if that isn't negative; returns 1 if there's room */
+int pool_wait_space(WorkerPool* pool, int timeoutMs);
+/* queues a task; returns 0, or -1 if every deque is full */
+int pool_submit(WorkerPool* pool, void (*run)(void*), void* arg);
+/* writes the pool's queue depth, steal count and so on, and if
+ * perWorker is set, the same for each worker */
+void pool_report(FILE* out, WorkerPool* pool, int perWorker);
+/* body of a worker thread; arg is its PoolWorker */
+void* pool_worker_thread(void*);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "resolver.h"
+#include "tunables.h"
+#include "logger.h"
+
+static ResolverEntry cache[RESOLVER_CACHE_SIZE];
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static ResolverRequest queue[RESOLVER_QUEUE_LEN];
+static int queueHead = 0, queueLen = 0;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+
+static long numeric = 1; // tunable; until resolver_start says otherwise
+
+/* fibonacci hashing of the address onto the table */
+static unsigned int resolver_slot(in_addr_t addr) {
+    return ((unsigned int) addr * 2654435769u) >> 22
+            & (RESOLVER_CACHE_SIZE - 1);
+}
+
+int resolver_cached(struct in_addr addr, char *name, size_t len) {
+    time_t now = time(NULL);
+    unsigned int slot = resolver_slot(addr.s_addr);
+    int found = 0;
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < RESOLVER_CACHE_PROBES; ++i) {
+        ResolverEntry *e = &cache[(slot + i) & (RESOLVER_CACHE_SIZE - 1)];
+        if (e->addr == addr.s_addr && e->expires > now) {
+            snprintf(name, len, "%s", e->name);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
+
+/* remembers name for addr, taking over its old slot, a free or expired
+ * one, or else whichever nearby entry expires soonest */
+static void resolver_remember(in_addr_t addr, const char *name) {
+    time_t now = time(NULL);
+    unsigned int slot = resolver_slot(addr);
+    pthread_mutex_lock(&cacheLock);
+    ResolverEntry *victim = NULL;
+    for (int i = 0; i < RESOLVER_CACHE_PROBES; ++i) {
+        ResolverEntry *e = &cache[(slot + i) & (RESOLVER_CACHE_SIZE - 1)];
+        if (e->addr == addr || e->addr == 0 || e->expires <= now) {
+            victim = e;
+            break;
+        }
+        if (victim == NULL || e->expires < victim->expires) {
+            victim = e;
+        }
+    }
+    victim->addr = addr;
+    victim->expires = now + RESOLVER_TTL;
+    snprintf(victim->name, sizeof(victim->name), "%s", name);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+static void resolver_print(struct sockaddr_in *from, const char *name,
+        int shard) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from->sin_addr, ip, sizeof(ip));
+    log_msg(LOG_LEVEL_INFO, "Accepted connection from %s (%s), port %d, shard %d",
+            ip, name, ntohs(from->sin_port), shard);
+}
+
+/* takes queued clients and does the slow bit
+ * a failed lookup is cached as the numeric address so a client without
+ * a PTR record doesn't cost a DNS round trip every time it connects */
+static void* resolver_thread(void* arg) {
+    ResolverRequest req;
+    char name[MAX_HOST_NAME_LEN];
+    while (1) {
+        pthread_mutex_lock(&queueLock);
+        while (queueLen == 0) {
+            pthread_cond_wait(&queueReady, &queueLock);
+        }
+        req = queue[queueHead];
+        queueHead = (queueHead + 1) % RESOLVER_QUEUE_LEN;
+        --queueLen;
+        pthread_mutex_unlock(&queueLock);
+
+        // someone ahead of us in the queue may have looked it up already
+        if (!resolver_cached(req.from.sin_addr, name, sizeof(name))) {
+            int error = getnameinfo((struct sockaddr*) &req.from,
+                    sizeof(req.from), name, sizeof(name), NULL, 0,
+                    NI_NAMEREQD);
+            if (error) {
+                inet_ntop(AF_INET, &req.from.sin_addr, name, sizeof(name));
+            }
+            resolver_remember(req.from.sin_addr.s_addr, name);
+        }
+        resolver_print(&req.from, name, req.shard);
+    }
+    return NULL;
+}
+
+/* the threads start regardless, so numeric can be turned off live */
+void resolver_start(int numericOnly) {
+    numeric = numericOnly;
+    tunable_register("numeric", &numeric, 0, 1,
+            "log client addresses without reverse DNS");
+    for (int i = 0; i < RESOLVER_THREADS; ++i) {
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, resolver_thread, NULL);
+        pthread_detach(threadId);
+    }
+}
+
+void resolver_log_accept(struct sockaddr_in *from, int shard) {
+    char name[MAX_HOST_NAME_LEN];
+    if (from->sin_family != AF_INET) {
+        log_msg(LOG_LEVEL_INFO, "Accepted local connection, shard %d", shard);
+        return;
+    }
+    if (tunable_get(&numeric)) {
+        inet_ntop(AF_INET, &from->sin_addr, name, sizeof(name));
+        resolver_print(from, name, shard);
+        return;
+    }
+    if (resolver_cached(from->sin_addr, name, sizeof(name))) {
+        resolver_print(from, name, shard);
+        return;
+    }
+
+    pthread_mutex_lock(&queueLock);
+    int queued = queueLen < RESOLVER_QUEUE_LEN;
+    if (queued) {
+        queue[(queueHead + queueLen) % RESOLVER_QUEUE_LEN].from = *from;
+        queue[(queueHead + queueLen) % RESOLVER_QUEUE_LEN].shard = shard;
+        ++queueLen;
+        pthread_cond_signal(&queueReady);
+    }
+    pthread_mutex_unlock(&queueLock);
+    if (!queued) {
+        // resolvers are swamped: log it numerically rather than wait
+        inet_ntop(AF_INET, &from->sin_addr, name, sizeof(name));
+        resolver_print(from, name, shard);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+/* vim: set filetype=c : */
+
+/* Reverse DNS for the "Accepted connection" log line, kept off the
+ * accept path: the acceptor only ever checks a small TTL cache, and
+ * misses are queued for resolver threads to look up with getnameinfo.
+ * In numeric mode there are no lookups at all.
+ */
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_HOST_NAME_LEN 128
+#define RESOLVER_THREADS 2
+#define RESOLVER_QUEUE_LEN 256 // lookups waiting; beyond this we log numeric
+#define RESOLVER_CACHE_SIZE 1024 // entries, a power of two
+#define RESOLVER_CACHE_PROBES 8 // slots tried before evicting
+#define RESOLVER_TTL 300 // seconds a name (or a failure) is remembered
+
+/* one remembered address */
+typedef struct {
+    in_addr_t addr; // network order; 0 means the slot is empty
+    time_t expires;
+    char name[MAX_HOST_NAME_LEN];
+} ResolverEntry;
+
+/* an accepted connection waiting for its log line */
+typedef struct {
+    struct sockaddr_in from;
+    int shard;
+} ResolverRequest;
+
+/* starts the resolver threads; numericOnly is the initial setting of the
+ * "numeric" tunable */
+void resolver_start(int numericOnly);
+/* prints the accept line for this client now if the name is cached
+ * (or we're numeric only), otherwise once a resolver thread has it
+ * never blocks on DNS */
+void resolver_log_accept(struct sockaddr_in *from, int shard);
+/* copies a cached, unexpired name for addr into name
+ * returns 0 if there isn't one */
+int resolver_cached(struct in_addr addr, char *name, size_t len);
+
+#endif
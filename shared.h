@@ -6,14 +6,28 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include "stats.h"
 
-// important
+/* one user listener and its accept loop, with its own workers
+ * with -S there are several, all SO_REUSEPORT on the same address */
 typedef struct {
-    int currentUsers; // network users connected right now
-    pthread_mutex_t currentUsersLock;
-} ProgStats;
+    int id;
+    int fd; // the listening socket
+    long accepted; // connections accepted on this shard, ever (atomic)
+    long currentUsers; // connected through this shard right now (atomic)
+    ProgStats* progStats;
+} __attribute__((aligned(CACHE_LINE))) UserShard;
+
+/* count a user in or out, both in its shard and in ProgStats */
+void user_count_in(UserShard*);
+void user_count_out(UserShard*);
+/* users connected right now, over every shard */
+long user_current(void);
 
 /* code shared between user and admin space */
 char* capitalise(char*, int);
+/* runs the echo pipeline (transform.h) over buffer in place
+ * returns its new length, which is less if a stage dropped bytes */
+size_t transform_apply(char*, size_t);
 
 #endif
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE // memfd_create
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "shmring.h"
+#include "admin.h"
+#include "histo.h"
+#include "logger.h"
+#include "transform.h"
+#include "tunables.h"
+
+// what an epoll event is for, in the low bits of its client's pointer
+#define EV_ACCEPT 0 // the ring socket: no client
+#define EV_WAKE 1 // the client's woken us
+#define EV_HANGUP 2 // the client's socket has something to say
+#define EV_MASK 3
+
+typedef struct ShmRingClient {
+    int sock; // the connection it came in on, until it hangs up
+    int wakeFd; // it wakes us with this
+    int clientWakeFd; // and we it with this
+    ShmRingPair *pair;
+    uint64_t openedAt;
+    long bytes; // echoed, read racily by admins
+    int hungUp; // to be closed once this round of events is done
+    TransformCarry carry; // a UTF-8 sequence cut off by either ring's wrap
+    struct ShmRingClient *prev, *next;
+} ShmRingClient;
+
+#define SHMRING_SEAM 4 // bytes taken along with a carry, to finish it
+
+static int listenFd = -1, epfd = -1;
+static ProgStats *progStats;
+static long spinUs = 0;
+// only the ring thread changes the list; the lock is for admins
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static ShmRingClient *clients = NULL;
+static int clientCount = 0;
+
+/* watches fd for events on c's behalf */
+static int shmring_watch(int fd, ShmRingClient *c, int kind,
+        uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = (uintptr_t) c | kind;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* sends the client its rings and eventfds, over the socket it came in on
+ * returns 0 on failure */
+static int shmring_send_fds(int sock, int fds[3]) {
+    char byte = 'R';
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/* makes a newly connected client its rings */
+static void shmring_accept(void) {
+    int sock = accept(listenFd, NULL, NULL);
+    if (sock < 0) {
+        log_msg(LOG_LEVEL_ERROR, "Error accepting ring client: %s",
+                strerror(errno));
+        return;
+    }
+    ShmRingClient *c = calloc(1, sizeof(ShmRingClient));
+    c->sock = sock;
+    int memFd = memfd_create("thomas rings", MFD_CLOEXEC);
+    c->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->clientWakeFd = eventfd(0, EFD_CLOEXEC);
+    c->pair = MAP_FAILED;
+    if (memFd >= 0 && !ftruncate(memFd, sizeof(ShmRingPair))) {
+        c->pair = mmap(NULL, sizeof(ShmRingPair), PROT_READ | PROT_WRITE,
+                MAP_SHARED, memFd, 0);
+    }
+    int fds[3] = {memFd, c->wakeFd, c->clientWakeFd};
+    if (c->pair == MAP_FAILED || c->wakeFd < 0 || c->clientWakeFd < 0) {
+        log_msg(LOG_LEVEL_ERROR, "Error making rings: %s", strerror(errno));
+    } else {
+        c->pair->magic = SHMRING_MAGIC;
+        c->pair->version = SHMRING_VERSION;
+        c->pair->size = sizeof(ShmRingPair);
+        // nothing to do until they send something
+        shmring_want_wake(&c->pair->up.readerWaiting);
+        if (shmring_send_fds(sock, fds)
+                && !shmring_watch(c->wakeFd, c, EV_WAKE, EPOLLIN)
+                && !shmring_watch(sock, c, EV_HANGUP, EPOLLIN | EPOLLRDHUP)) {
+            close(memFd); // they've a copy, and we've the mapping
+            c->openedAt = histo_now();
+            pthread_mutex_lock(&lock);
+            c->next = clients;
+            if (clients != NULL) {
+                clients->prev = c;
+            }
+            clients = c;
+            ++clientCount;
+            pthread_mutex_unlock(&lock);
+            stats_user_in(progStats);
+            stats_add(progStats, STAT_RING_USERS, 1);
+            log_msg(LOG_LEVEL_INFO, "Ring client %d attached", sock);
+            return;
+        }
+    }
+    if (c->pair != MAP_FAILED) {
+        munmap(c->pair, sizeof(ShmRingPair));
+    }
+    for (int i = 0; i < 3; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    close(sock);
+    free(c);
+}
+
+/* lets go of a client that's hung up */
+static void shmring_close(ShmRingClient *c) {
+    pthread_mutex_lock(&lock);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        clients = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    --clientCount;
+    pthread_mutex_unlock(&lock);
+    // closing them takes them out of the epoll set
+    close(c->wakeFd);
+    close(c->clientWakeFd);
+    close(c->sock);
+    munmap(c->pair, sizeof(ShmRingPair));
+    stats_user_out(progStats);
+    log_msg(LOG_LEVEL_INFO, "Ring client %d detached", c->sock);
+    free(c);
+}
+
+/* copies len bytes into the room in out, across the ring's wrap */
+static void shmring_put(struct iovec out[2], const char *from, size_t len) {
+    size_t first = len < out[0].iov_len ? len : out[0].iov_len;
+    memcpy(out[0].iov_base, from, first);
+    memcpy(out[1].iov_base, from + first, len - first);
+}
+
+/* transforms what c has sent into its down ring, as far as there's
+ * room; returns the bytes taken, adding those echoed to *echoed */
+static size_t shmring_echo(ShmRingClient *c, size_t *echoed) {
+    ShmRing *up = &c->pair->up, *down = &c->pair->down;
+    size_t moved = 0, room;
+    struct iovec in[2], out[2];
+    while (shmring_readable(up, in) && (room = shmring_writable(down, out))) {
+        size_t n, len;
+        if (c->carry.len) {
+            // a sequence was cut off: finish it aside, with the next few
+            // bytes, and put the lot wherever down has room for it
+            char scratch[TRANSFORM_CARRY_MAX + SHMRING_SEAM];
+            if (room <= c->carry.len) {
+                break;
+            }
+            n = in[0].iov_len < SHMRING_SEAM ? in[0].iov_len : SHMRING_SEAM;
+            n = n < room - c->carry.len ? n : room - c->carry.len;
+            memcpy(scratch + TRANSFORM_CARRY_MAX, in[0].iov_base, n);
+            len = n;
+            char *start = transform_stream(&c->carry,
+                    scratch + TRANSFORM_CARRY_MAX, &len);
+            shmring_put(out, start, len);
+        } else {
+            n = in[0].iov_len < out[0].iov_len
+                    ? in[0].iov_len : out[0].iov_len;
+            memcpy(out[0].iov_base, in[0].iov_base, n);
+            len = n;
+            transform_stream(&c->carry, out[0].iov_base, &len);
+        }
+        shmring_produced(down, len);
+        shmring_consumed(up, n);
+        moved += n;
+        *echoed += len;
+    }
+    return moved;
+}
+
+/* echoes all c has sent, then asks to be woken when there's more (or
+ * room for it), and wakes c if it asked */
+static void shmring_service(ShmRingClient *c) {
+    ShmRingPair *pair = c->pair;
+    uint64_t count;
+    read(c->wakeFd, &count, sizeof(count)); // just to clear it
+    size_t total = 0, echoed = 0, n;
+    do {
+        total += shmring_echo(c, &echoed);
+        // either up's empty or down's full; they may change that just
+        // before we ask, so look once more after asking
+        shmring_want_wake(&pair->up.readerWaiting);
+        shmring_want_wake(&pair->down.writerWaiting);
+        total += (n = shmring_echo(c, &echoed));
+    } while (n);
+    if (!total) {
+        return;
+    }
+    stats_add(progStats, STAT_BYTES_IN, total);
+    stats_add(progStats, STAT_BYTES_OUT, echoed);
+    __atomic_store_n(&c->bytes, c->bytes + echoed, __ATOMIC_RELAXED);
+    // both asks taken back, whichever made us write
+    if (shmring_wake_wanted(&pair->down.readerWaiting)
+            | shmring_wake_wanted(&pair->up.writerWaiting)) {
+        uint64_t one = 1;
+        write(c->clientWakeFd, &one, sizeof(one));
+        stats_add(progStats, STAT_RING_WAKEUPS, 1);
+    }
+}
+
+/* ring_spin_us: keeps looking at every client's rings for a while
+ * rather than sleep, for the round trips a wakeup would slow down
+ * the deadline doesn't move however busy they are, so newcomers and
+ * hangups waiting in epoll get seen at least that often */
+static void shmring_spin(long us) {
+    uint64_t until = histo_now() + us * 1000;
+    struct iovec iov[2];
+    while (histo_now() < until) {
+        for (ShmRingClient *c = clients; c != NULL; c = c->next) {
+            if (shmring_readable(&c->pair->up, iov)) {
+                shmring_service(c);
+            }
+        }
+    }
+}
+
+static void *shmring_thread(void *arg) {
+    struct epoll_event events[SHMRING_MAX_EVENTS];
+    ShmRingClient *gone[SHMRING_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, SHMRING_MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("Error waiting on ring clients");
+            exit(1);
+        }
+        int goneCount = 0;
+        for (int i = 0; i < n; ++i) {
+            ShmRingClient *c = (ShmRingClient*) (uintptr_t)
+                    (events[i].data.u64 & ~(uint64_t) EV_MASK);
+            switch (events[i].data.u64 & EV_MASK) {
+                case EV_ACCEPT:
+                    shmring_accept();
+                    break;
+                case EV_WAKE:
+                    if (!c->hungUp) {
+                        shmring_service(c);
+                    }
+                    break;
+                case EV_HANGUP:
+                    // they've nothing to send us this way but goodbye;
+                    // its wake may be later in this round, so not yet
+                    c->hungUp = 1;
+                    gone[goneCount++] = c;
+                    break;
+            }
+        }
+        for (int i = 0; i < goneCount; ++i) {
+            shmring_close(gone[i]);
+        }
+        long us = tunable_get(&spinUs);
+        if (us) {
+            shmring_spin(us);
+        }
+    }
+    return NULL;
+}
+
+void shmring_listen(char *path, ProgStats *ps) {
+    progStats = ps;
+    tunable_register("ring_spin_us", &spinUs, 0, 1000000,
+            "how long the ring thread polls the rings before sleeping");
+    listenFd = bind_unix_socket(path, "ring socket");
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (listen(listenFd, SOMAXCONN) || epfd < 0
+            || shmring_watch(listenFd, NULL, EV_ACCEPT, EPOLLIN)) {
+        perror("Error listening for ring clients");
+        exit(1);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, shmring_thread, NULL)) {
+        fprintf(stderr, "Error starting ring thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+int shmring_clients(void) {
+    return __atomic_load_n(&clientCount, __ATOMIC_RELAXED);
+}
+
+void shmring_report(FILE *out) {
+    uint64_t now = histo_now();
+    pthread_mutex_lock(&lock);
+    for (ShmRingClient *c = clients; c != NULL; c = c->next) {
+        fprintf(out, "ring client %d age %.1fs echoed %ld\n", c->sock,
+                (now - c->openedAt) / 1e9,
+                __atomic_load_n(&c->bytes, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&lock);
+}
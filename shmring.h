@@ -0,0 +1,107 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+/* vim: set filetype=c : */
+
+/* Shared-memory rings (-R): for local clients that want echoes in
+ * microseconds, with no socket on the data path at all.
+ *
+ * A client connects to the ring socket (AF_UNIX) and gets back one byte
+ * with three fds attached: a memfd holding a ShmRingPair, an eventfd to
+ * wake us with, and an eventfd we wake it with. It maps the memfd and
+ * from then on writes into up and reads its echoes, capitalised, from
+ * down. It keeps the socket open for as long as it wants the rings:
+ * hanging up is how it says goodbye.
+ *
+ * Each ring has one producer and one consumer, so it needs no lock:
+ * the producer alone moves tail and the consumer head, each publishing
+ * with a release store. Wakeups only happen when asked for. A side with
+ * nothing to do sets its waiting flag, looks once more, then sleeps on
+ * its eventfd; the other side, having made progress, clears the flag
+ * and writes the eventfd only if it was set (shmring_wake_wanted). So
+ * a busy pair makes no syscalls, and a client that spins briefly on
+ * down before asking to be woken gets its echo without any.
+ *
+ * thomas serves every client's rings from one thread. The rings don't
+ * survive a handover: their clients are hung up on and reconnect.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "stats.h"
+
+#define SHMRING_MAGIC 0x676e69726d6f6874ULL // "thomring" on x86
+#define SHMRING_VERSION 1
+#define SHMRING_SIZE (1 << 20) // bytes each way; a power of two
+#define SHMRING_MAX_EVENTS 64
+
+typedef struct {
+    uint64_t tail __attribute__((aligned(64))); // bytes ever produced
+    uint32_t writerWaiting; // the producer's asleep until there's room
+    uint64_t head __attribute__((aligned(64))); // bytes ever consumed
+    uint32_t readerWaiting; // the consumer's asleep until there's data
+    char data[SHMRING_SIZE] __attribute__((aligned(64)));
+} ShmRing;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size; // of this struct
+    ShmRing up; // client to thomas
+    ShmRing down; // thomas to client: the echoes
+} ShmRingPair;
+
+/* consumer: what there is to read, as up to two runs (the second from
+ * the start of data, after wrapping); returns the bytes in both */
+static inline size_t shmring_readable(ShmRing* r, struct iovec iov[2]) {
+    uint64_t head = r->head;
+    size_t n = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    size_t start = head & (SHMRING_SIZE - 1);
+    iov[0].iov_base = r->data + start;
+    iov[0].iov_len = n < SHMRING_SIZE - start ? n : SHMRING_SIZE - start;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = n - iov[0].iov_len;
+    return n;
+}
+
+/* producer: the room there is to write, likewise */
+static inline size_t shmring_writable(ShmRing* r, struct iovec iov[2]) {
+    uint64_t tail = r->tail;
+    size_t n = SHMRING_SIZE
+            - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+    size_t start = tail & (SHMRING_SIZE - 1);
+    iov[0].iov_base = r->data + start;
+    iov[0].iov_len = n < SHMRING_SIZE - start ? n : SHMRING_SIZE - start;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = n - iov[0].iov_len;
+    return n;
+}
+
+/* hands n bytes over to the other side */
+static inline void shmring_consumed(ShmRing* r, size_t n) {
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+}
+static inline void shmring_produced(ShmRing* r, size_t n) {
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
+
+/* asks to be woken; look again before sleeping on the strength of it */
+static inline void shmring_want_wake(uint32_t* waiting) {
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+}
+/* after handing bytes over: whether the other side asked to be woken
+ * (taking the ask back), in which case write its eventfd */
+static inline int shmring_wake_wanted(uint32_t* waiting) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(waiting, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/* binds path and starts the thread serving clients' rings; exits the
+ * program if it can't */
+void shmring_listen(char* path, ProgStats* ps);
+/* a line per client, and how many there are */
+void shmring_report(FILE* out);
+int shmring_clients(void);
+
+#endif
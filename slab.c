@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+/* a thread's free objects from one pool */
+typedef struct {
+    SlabObject *free;
+    int count;
+} SlabCache;
+
+static pthread_mutex_t poolsLock = PTHREAD_MUTEX_INITIALIZER;
+static SlabPool *pools[SLAB_MAX_POOLS];
+static int poolCount = 0; // atomic
+
+static __thread SlabCache caches[SLAB_MAX_POOLS];
+static __thread int cachesUsed = 0;
+static pthread_key_t exitKey; // only there for its destructor
+static pthread_once_t exitKeyOnce = PTHREAD_ONCE_INIT;
+
+/* puts the list first..last (count objects) in pool's depot */
+static void slab_deposit(SlabPool *pool, SlabObject *first,
+        SlabObject *last, int count) {
+    pthread_mutex_lock(&pool->lock);
+    last->next = pool->depot;
+    pool->depot = first;
+    pool->depotCount += count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* hands back everything an exiting thread was holding */
+static void slab_thread_exit(void *unused) {
+    int count = __atomic_load_n(&poolCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ++i) {
+        SlabCache *cache = &caches[i];
+        if (cache->count == 0) {
+            continue;
+        }
+        SlabObject *last = cache->free;
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        slab_deposit(pools[i], cache->free, last, cache->count);
+        cache->free = NULL;
+        cache->count = 0;
+    }
+}
+
+static void slab_make_key(void) {
+    pthread_key_create(&exitKey, slab_thread_exit);
+}
+
+/* gives pool its id the first time any thread uses it */
+static void slab_register(SlabPool *pool) {
+    pthread_mutex_lock(&poolsLock);
+    if (pool->id == 0) {
+        if (poolCount == SLAB_MAX_POOLS) {
+            fprintf(stderr, "Too many slab pools\n");
+            exit(1);
+        }
+        pools[poolCount] = pool;
+        pool->batch = SLAB_BYTES / pool->size;
+        if (pool->batch > SLAB_BATCH) {
+            pool->batch = SLAB_BATCH;
+        } else if (pool->batch < SLAB_MIN_BATCH) {
+            pool->batch = SLAB_MIN_BATCH;
+        }
+        __atomic_store_n(&pool->id, poolCount + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&poolCount, poolCount + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&poolsLock);
+}
+
+/* this thread's list for pool */
+static SlabCache *slab_cache(SlabPool *pool) {
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (id == 0) {
+        slab_register(pool);
+        id = pool->id;
+    }
+    if (!cachesUsed) {
+        // so it's handed back when we exit
+        pthread_once(&exitKeyOnce, slab_make_key);
+        pthread_setspecific(exitKey, caches);
+        cachesUsed = 1;
+    }
+    return &caches[id - 1];
+}
+
+/* adds a new slab's worth of objects to the depot; called locked */
+static void slab_carve(SlabPool *pool) {
+    size_t count = SLAB_BYTES / pool->size;
+    if (count < (size_t) pool->batch) {
+        count = pool->batch;
+    }
+    char *slab;
+    if (posix_memalign((void**) &slab, SLAB_ALIGN, count * pool->size)) {
+        fprintf(stderr, "Out of memory for %s\n", pool->name);
+        exit(1);
+    }
+    // pushed backwards, so they're handed out in address order
+    for (size_t i = count; i-- > 0; ) {
+        SlabObject *object = (SlabObject*) (slab + i * pool->size);
+        object->next = pool->depot;
+        pool->depot = object;
+    }
+    pool->depotCount += count;
+    ++pool->slabs;
+    pool->objects += count;
+}
+
+/* fills an empty list with a batch from the depot */
+static void slab_refill(SlabPool *pool, SlabCache *cache) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->depot == NULL) {
+        slab_carve(pool);
+    }
+    SlabObject *last = pool->depot;
+    int count = 1;
+    while (last->next != NULL && count < pool->batch) {
+        last = last->next;
+        ++count;
+    }
+    cache->free = pool->depot;
+    cache->count = count;
+    pool->depot = last->next;
+    pool->depotCount -= count;
+    last->next = NULL;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void slab_pool_init(SlabPool *pool, const char *name, size_t size) {
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->size = (size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+void* slab_alloc(SlabPool *pool) {
+    SlabCache *cache = slab_cache(pool);
+    if (cache->free == NULL) {
+        slab_refill(pool, cache);
+    }
+    SlabObject *object = cache->free;
+    cache->free = object->next;
+    --cache->count;
+    __atomic_fetch_add(&pool->inUse, 1, __ATOMIC_RELAXED);
+    return object;
+}
+
+void* slab_zalloc(SlabPool *pool) {
+    void *object = slab_alloc(pool);
+    memset(object, 0, pool->size);
+    return object;
+}
+
+void slab_free(SlabPool *pool, void *object) {
+    SlabCache *cache = slab_cache(pool);
+    SlabObject *freed = (SlabObject*) object;
+    freed->next = cache->free;
+    cache->free = freed;
+    __atomic_fetch_sub(&pool->inUse, 1, __ATOMIC_RELAXED);
+    if (++cache->count < 2 * pool->batch) {
+        return;
+    }
+    // keep a batch's worth for ourselves, give the rest to everyone else
+    SlabObject *keep = cache->free;
+    for (int i = 1; i < pool->batch; ++i) {
+        keep = keep->next;
+    }
+    SlabObject *first = keep->next, *last = first;
+    int count = 1;
+    while (last->next != NULL) {
+        last = last->next;
+        ++count;
+    }
+    keep->next = NULL;
+    cache->count -= count;
+    slab_deposit(pool, first, last, count);
+}
+
+void slab_report(FILE *out) {
+    int count = __atomic_load_n(&poolCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ++i) {
+        SlabPool *pool = pools[i];
+        pthread_mutex_lock(&pool->lock);
+        long objects = pool->objects, slabs = pool->slabs;
+        long depot = pool->depotCount;
+        pthread_mutex_unlock(&pool->lock);
+        long inUse = __atomic_load_n(&pool->inUse, __ATOMIC_RELAXED);
+        fprintf(out, "slab %s: %ld in use, %ld free (%ld held by threads),"
+                " %ld in %ld slabs of %zu B objects\n", pool->name, inUse,
+                objects - inUse, objects - inUse - depot, objects, slabs,
+                pool->size);
+    }
+}
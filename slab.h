@@ -0,0 +1,63 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+/* vim: set filetype=c : */
+
+/* Fixed-size objects (connection state, output chunks) without going to
+ * malloc for each one. A SlabPool carves objects out of slabs it never
+ * gives back; each thread keeps its own free list per pool, so allocating
+ * and freeing are a couple of pointer moves. Objects are often freed by
+ * a different thread from the one that made them: a thread whose list
+ * grows to two batches hands one to the pool's depot, and a thread that
+ * runs out takes a batch from there (or has a new slab carved) under the
+ * pool's lock. A batch is up to SLAB_BATCH objects, fewer for big ones.
+ * Threads that exit hand their lists back.
+ *
+ * Once a workload has reached its peak, connecting and disconnecting
+ * users costs no malloc at all. "slabs" on the control socket shows
+ * each pool's occupancy.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define SLAB_MAX_POOLS 16
+#define SLAB_BATCH 32 // most objects moved to or from the depot at once
+#define SLAB_MIN_BATCH 4
+#define SLAB_BYTES 65536 // carved at once, unless that's less than a batch
+#define SLAB_ALIGN 64 // a cache line: neighbours are often other threads'
+
+typedef struct SlabObject {
+    struct SlabObject *next;
+} SlabObject;
+
+typedef struct {
+    const char *name;
+    size_t size; // per object, rounded up to SLAB_ALIGN
+    int id; // 1 + its index once registered, which happens on first use
+    int batch; // set when registered
+    pthread_mutex_t lock;
+    SlabObject *depot; // free objects no thread is holding on to
+    long depotCount;
+    long slabs, objects; // carved so far
+    long inUse; // atomic
+} SlabPool;
+
+/* a pool of objects of size bytes, for a static SlabPool */
+#define SLAB_POOL(name, size) \
+    {(name), ((size) + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1), 0, 0, \
+    PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0}
+
+/* the same for a pool whose size isn't known until run time; call
+ * before anything uses it */
+void slab_pool_init(SlabPool* pool, const char* name, size_t size);
+/* an object from pool, uninitialised; exits the program if memory's
+ * run out */
+void* slab_alloc(SlabPool* pool);
+/* the same, zeroed */
+void* slab_zalloc(SlabPool* pool);
+/* gives an object back to the pool it came from */
+void slab_free(SlabPool* pool, void* object);
+/* a line per pool that's been used */
+void slab_report(FILE* out);
+
+#endif
@@ -1,74 +1,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/types.h>
 #include <string.h>
-#include <signal.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/random.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include "station.h"
+#include "histo.h"
+#include "logger.h"
+#include "tunables.h"
+#include "hmac.h"
 
-typedef struct Data {
-    char *name;
-    char *secret;
-    FILE *log;
-    int port; // 1 to 65534, or 0 if undefined and not yet ephemeralised
-    char *interface;
-    char **argv;
-} Data;
-
-/* prints, kills the program */
-void error(int e) {
-    char *str;
-    switch (e) {
-        case 1:
-            str = "Usage: station name authfile log-file [port] [host]";
-            break;
-        case 2:
-            str = "Invalid name/auth";
-            break;
-        case 3:
-            str = "Unable to open log";
-            break;
-        case 4:
-            str = "Invalid port";
-            break;
-        case 5:
-            str = "Listen error";
-            break;
-        case 6:
-            str = "Unable to connect to station";
-            break;
-        case 7:
-            str = "Duplicate station names";
-            break;
-        case 99:
-            str = "Unspecified system call failure";
-            break;
-        case 0:
-            str = "";
-            break;
-        default:
-            str = "Unknown error";
-    }
-    fprintf(stderr, e ? "%s\n" : "%s", str); // effective
-    exit(e);
-}
+// a whole frame fits, with room for the next one to start arriving
+#define STATION_READ_BUF (2 * (sizeof(StationFrame) + STATION_FRAME_MAX))
+#define STATION_SECRET_MAX 4096
+#define STATION_BIND_WAIT 10 // seconds for an old thomas to let go
+#define STATION_NONCE 32 // random bytes each end says hello with
+
+/* someone who's dialled us, before they've proved they're a station */
+typedef struct {
+    int fd;
+    char name[64];
+} StationGuest;
+
+int stationLinks = 0;
+static char *secret;
+static long queueMax = STATION_DEFAULT_QUEUE;
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+static StationLink links[STATION_MAX_LINKS];
+static int slotCount = 0; // slots ever handed out (atomic)
+static int pending = 0; // accepted, still saying hello (atomic)
+
+static const char *stateNames[] = {"free", "down", "connecting", "up"};
 
 /* merrily assumes it'll fit in memory.
  * dynamically allocates space, consumes '\n'
  * also assumes it's opened in read mode */
-char *read_a_line(FILE *f) {
+static char *read_a_line(FILE *f) {
     int i = 0, size = 10;
-    if (f == NULL) {
-        char *str = malloc(sizeof(char));
-        str[0] = '\0';
-        return str;
-    }
     char *str = malloc(sizeof(char) * size);
-    char c;
+    int c;
     while (((c = fgetc(f)) != '\n') && (c != EOF)) {
         str[i++] = c;
         if (i >= size - 1) {
@@ -76,7 +52,7 @@ char *read_a_line(FILE *f) {
             str = realloc(str, sizeof(char) * size);
             if (str == NULL) {
                 fprintf(stderr, "So we *are* tested with huge lines.\n");
-                error(99);
+                exit(1);
             }
         }
     }
@@ -84,137 +60,542 @@ char *read_a_line(FILE *f) {
     return str;
 }
 
-/* parses the arguments, handles errors 1-3, otherwise returns arg data */
-Data *parse_args(int argc, char **argv) {
-    Data *d = malloc(sizeof(Data) * 1);
-    if (argc < 4 || argc > 6) {
-        error(1);
-    }
-    // read in auth secret
-    FILE *auth = fopen(argv[2], "r");
-    d->secret = read_a_line(auth);
-    if ((strlen(argv[2]) == 0) || auth == NULL || strlen(d->secret) == 0) {
-        error(2);
+char *station_read_secret(const char *authPath) {
+    FILE *auth = fopen(authPath, "r");
+    if (auth == NULL) {
+        return NULL;
     }
+    char *line = read_a_line(auth);
     fclose(auth);
-    if (argc >= 5) {
-        long int p = strtol(argv[4], NULL, 2 * 5);
-        if (p <= 0 || p >= 65535) {
-            // there's some LONG_MIN stuff but it's covered by these
-            error(4);
+    if (strlen(line) == 0 || strlen(line) > STATION_SECRET_MAX) {
+        free(line);
+        return NULL;
+    }
+    return line;
+}
+
+void station_init(char *s) {
+    secret = s;
+    for (int i = 0; i < STATION_MAX_LINKS; ++i) {
+        pthread_mutex_init(&links[i].lock, NULL);
+        pthread_cond_init(&links[i].wake, NULL);
+    }
+    tunable_register("station_queue", &queueMax, 65536, 1L << 30,
+            "bytes queued for a peer station before its frames are dropped");
+}
+
+/* a free slot for a new link, or NULL if they're all taken */
+static StationLink *station_slot(void) {
+    StationLink *link = NULL;
+    pthread_mutex_lock(&tableLock);
+    for (int i = 0; i < slotCount && link == NULL; ++i) {
+        if (__atomic_load_n(&links[i].state, __ATOMIC_ACQUIRE)
+                == LINK_FREE) {
+            link = &links[i];
         }
-        d->port = (int) p;
-    } else {
-        d->port = 0; // sentinel
     }
-    d->log = fopen(argv[3], "w");
-    if (d->log == NULL) {
-        fprintf(stderr, "Placeholder error: unable to open log file\n");
-        error(99); // TODO: presumably joel will specify this
+    if (link == NULL && slotCount < STATION_MAX_LINKS) {
+        link = &links[slotCount];
+        __atomic_store_n(&slotCount, slotCount + 1, __ATOMIC_RELEASE);
+    }
+    if (link != NULL) {
+        __atomic_store_n(&link->state, LINK_DOWN, __ATOMIC_RELEASE);
     }
-    d->interface = (argc == 6) ? argv[5] : NULL;
-    return d;
+    pthread_mutex_unlock(&tableLock);
+    return link;
 }
 
-/* set up our signal junk
- * SIGHUP triggers a log write
- * SIGPIPE gets ignored
- * outdated: all threads should sigmask except the sigwait() thread
- * so it can't all be done in one function
- */
-void signal_init() {
-    signal(SIGPIPE, SIG_IGN);
-    struct sigaction sa;
-    // sa.
-    if (sigaction(SIGHUP, &sa, NULL)) {
-        error(99);
+static void station_set_state(StationLink *link, int state) {
+    pthread_mutex_lock(&link->lock);
+    __atomic_store_n(&link->state, state, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&link->wake);
+    pthread_mutex_unlock(&link->lock);
+}
+
+static void station_put_frame(char *out, int type, uint32_t stream,
+        size_t len) {
+    StationFrame frame;
+    frame.len = htonl(len);
+    frame.stream = htonl(stream);
+    frame.type = htons(type);
+    frame.unused = 0;
+    memcpy(out, &frame, sizeof(frame));
+}
+
+/* returns 0 if the link's gone */
+static int station_write_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= n;
     }
+    return 1;
 }
 
-/* straight from peter: takes a hostname, returns its IP as an in_addr */
-struct in_addr *name_to_ip_addr(char *hostname)
-{
-    int error;
-    struct addrinfo *addressInfo;
+/* returns 0 on EOF, error or timeout */
+static int station_read_all(int fd, void *buf, size_t len) {
+    char *at = buf;
+    while (len) {
+        ssize_t n = recv(fd, at, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        at += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* reads a frame of type with exactly len bytes of payload into buf
+ * returns 0 if it's anything else, or doesn't come */
+static int station_read_frame(int fd, int type, void *buf, size_t len) {
+    StationFrame frame;
+    return station_read_all(fd, &frame, sizeof(frame))
+            && ntohs(frame.type) == type && ntohl(frame.len) == len
+            && station_read_all(fd, buf, len);
+}
+
+/* what the dialler (who 0) or the acceptor (who 1) sends to prove it
+ * knows the secret: the HMAC of both nonces, marked with who's proving,
+ * so one side's proof is never the other's */
+static void station_proof(uint8_t nonces[2][STATION_NONCE], int who,
+        uint8_t out[HMAC_SIZE]) {
+    uint8_t message[1 + 2 * STATION_NONCE];
+    message[0] = who;
+    memcpy(message + 1, nonces, 2 * STATION_NONCE);
+    hmac_sha256(secret, strlen(secret), message, sizeof(message), out);
+}
 
-    error = getaddrinfo(hostname, NULL, NULL, &addressInfo);
-    if(error) {
-	return NULL;
+/* both ends send a nonce, then prove they know the secret over the two;
+ * the secret itself never goes over the wire. Whoever dialled proves
+ * first, and the acceptor checks it before sending anything that
+ * depends on the secret, so a stranger who connects learns nothing.
+ * returns 0 if they aren't one of us, or don't say so within
+ * STATION_HELLO_TIMEOUT */
+static int station_hello(int fd, int dialled) {
+    int us = dialled ? 0 : 1;
+    uint8_t nonces[2][STATION_NONCE];
+    char out[sizeof(StationFrame) + HMAC_SIZE];
+    uint8_t proof[HMAC_SIZE], theirs[HMAC_SIZE];
+    if (getrandom(nonces[us], STATION_NONCE, 0) != STATION_NONCE) {
+        log_msg(LOG_LEVEL_ERROR, "Can't make a station nonce: %s",
+                strerror(errno));
+        return 0;
     }
-    return &(((struct sockaddr_in*)(addressInfo->ai_addr))->sin_addr);
+    struct timeval limit = {STATION_HELLO_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    station_put_frame(out, FRAME_HELLO, 0, STATION_NONCE);
+    memcpy(out + sizeof(StationFrame), nonces[us], STATION_NONCE);
+    if (!station_write_all(fd, out, sizeof(StationFrame) + STATION_NONCE)
+            || !station_read_frame(fd, FRAME_HELLO, nonces[!us],
+                STATION_NONCE)) {
+        return 0;
+    }
+    station_put_frame(out, FRAME_PROOF, 0, HMAC_SIZE);
+    station_proof(nonces, us, (uint8_t*) out + sizeof(StationFrame));
+    if (dialled && !station_write_all(fd, out, sizeof(out))) {
+        return 0;
+    }
+    station_proof(nonces, !us, proof);
+    if (!station_read_frame(fd, FRAME_PROOF, theirs, HMAC_SIZE)
+            || !hmac_equal(proof, theirs)) {
+        return 0;
+    }
+    if (!dialled && !station_write_all(fd, out, sizeof(out))) {
+        return 0;
+    }
+    limit.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    return 1;
 }
 
-/* returns the file descriptor opened
- * if port is 0, an ephemeral port will be used and assigned to port
- * prints the port to stdout as per spec
- */
-int open_listen(int *port, char *interface) {
-    int fd;
-    struct sockaddr_in serverAddr;
-    int optVal;
+void station_send(Conn *conn, struct iovec *iov, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; ++i) {
+        len += iov[i].iov_len;
+    }
+    if (len == 0) {
+        return;
+    }
+    long frames = (len + STATION_FRAME_MAX - 1) / STATION_FRAME_MAX;
+    size_t bytes = len + frames * sizeof(StationFrame);
+    int slots = __atomic_load_n(&slotCount, __ATOMIC_ACQUIRE);
+    for (int l = 0; l < slots; ++l) {
+        StationLink *link = &links[l];
+        if (__atomic_load_n(&link->state, __ATOMIC_RELAXED) != LINK_UP) {
+            continue;
+        }
+        pthread_mutex_lock(&link->lock);
+        if (link->state != LINK_UP
+                || link->queued + bytes > (size_t) tunable_get(&queueMax)) {
+            if (link->state == LINK_UP) {
+                link->dropped += frames;
+            }
+            pthread_mutex_unlock(&link->lock);
+            continue;
+        }
+        if (link->queued + bytes > link->queueCap) {
+            size_t cap = link->queueCap ? 2 * link->queueCap : 65536;
+            while (cap < link->queued + bytes) {
+                cap *= 2;
+            }
+            link->queue = realloc(link->queue, cap);
+            link->queueCap = cap;
+        }
+        char *at = link->queue + link->queued;
+        size_t left = len, off = 0;
+        int i = 0;
+        while (left) {
+            size_t n = left < STATION_FRAME_MAX ? left : STATION_FRAME_MAX;
+            station_put_frame(at, FRAME_DATA, conn->fd, n);
+            at += sizeof(StationFrame);
+            left -= n;
+            while (n) {
+                size_t take = iov[i].iov_len - off;
+                if (take > n) {
+                    take = n;
+                }
+                memcpy(at, (char*) iov[i].iov_base + off, take);
+                at += take;
+                off += take;
+                n -= take;
+                if (off == iov[i].iov_len) {
+                    ++i;
+                    off = 0;
+                }
+            }
+        }
+        if (link->queued == 0) {
+            pthread_cond_signal(&link->wake);
+        }
+        link->queued += bytes;
+        link->framesOut += frames;
+        pthread_mutex_unlock(&link->lock);
+    }
+}
 
-    // Create IPv4 TCP socket
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(fd < 0) {
-        perror("Error creating socket");
-        exit(1);
+/* sends whatever's queued, all at once, until the link goes down */
+static void *station_writer(void *arg) {
+    StationLink *link = (StationLink*) arg;
+    char *batch = NULL;
+    size_t batchCap = 0;
+    int ok = 1;
+    pthread_mutex_lock(&link->lock);
+    while (ok) {
+        while (link->queued == 0 && link->state == LINK_UP) {
+            pthread_cond_wait(&link->wake, &link->lock);
+        }
+        if (link->state != LINK_UP) {
+            break;
+        }
+        // take the lot, leaving our empty buffer for the next lot
+        char *full = link->queue;
+        size_t len = link->queued, fullCap = link->queueCap;
+        link->queue = batch;
+        link->queueCap = batchCap;
+        link->queued = 0;
+        batch = full;
+        batchCap = fullCap;
+        pthread_mutex_unlock(&link->lock);
+        ok = station_write_all(link->fd, batch, len);
+        pthread_mutex_lock(&link->lock);
+        if (ok) {
+            link->bytesOut += len;
+            ++link->writes;
+        }
     }
+    pthread_mutex_unlock(&link->lock);
+    if (!ok) {
+        shutdown(link->fd, SHUT_RDWR); // so the reader gives up too
+    }
+    free(batch);
+    return NULL;
+}
 
-    // Allow address (IP addr + port num) to be reused immediately
-    optVal = 1;
-    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
-        perror("Error setting socket option");
-        exit(1);
+/* takes frames off the link until it drops */
+static void station_read(StationLink *link) {
+    char *buf = malloc(STATION_READ_BUF);
+    size_t have = 0;
+    while (1) {
+        ssize_t n = recv(link->fd, buf + have, STATION_READ_BUF - have, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        have += n;
+        size_t at = 0;
+        while (have - at >= sizeof(StationFrame)) {
+            StationFrame frame;
+            memcpy(&frame, buf + at, sizeof(frame));
+            size_t len = ntohl(frame.len);
+            if (len > STATION_FRAME_MAX || ntohs(frame.type) != FRAME_DATA) {
+                log_msg(LOG_LEVEL_WARN, "Station %s sent a bad frame",
+                        link->name);
+                free(buf);
+                return;
+            }
+            if (have - at < sizeof(frame) + len) {
+                break;
+            }
+            // all we do with them so far is count them
+            __atomic_store_n(&link->framesIn, link->framesIn + 1,
+                    __ATOMIC_RELAXED);
+            __atomic_store_n(&link->bytesIn, link->bytesIn + len,
+                    __ATOMIC_RELAXED);
+            at += sizeof(frame) + len;
+        }
+        memmove(buf, buf + at, have - at);
+        have -= at;
     }
+    free(buf);
+}
+
+/* serves a link that's said hello (link->fd) until it drops; the caller
+ * closes it */
+static void station_run(StationLink *link) {
+    pthread_mutex_lock(&link->lock);
+    link->queued = 0;
+    link->framesOut = link->framesIn = link->bytesIn = 0;
+    link->bytesOut = link->writes = link->dropped = 0;
+    link->upAt = histo_now();
+    __atomic_store_n(&link->state, LINK_UP, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&link->lock);
+    __atomic_fetch_add(&stationLinks, 1, __ATOMIC_RELAXED);
+    log_msg(LOG_LEVEL_INFO, "Linked with station %s", link->name);
 
-    // Set up address structure for the server address
-    // Request port (incl. ephemeral), request interface if specified
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(*port);
-    struct in_addr *t = name_to_ip_addr(interface);
-    if (interface == NULL) {
-        serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    pthread_t writer;
+    pthread_create(&writer, NULL, station_writer, link);
+    station_read(link);
+    __atomic_fetch_sub(&stationLinks, 1, __ATOMIC_RELAXED);
+    station_set_state(link, LINK_DOWN);
+    shutdown(link->fd, SHUT_RDWR); // in case the writer's mid-send
+    pthread_join(writer, NULL);
+    log_msg(LOG_LEVEL_INFO, "Lost station %s", link->name);
+}
+
+/* connects to link's host and port; returns the socket, or -1 */
+static int station_dial(StationLink *link) {
+    struct addrinfo hints, *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(link->host, link->port, &hints, &found);
+    if (error) {
+        log_msg(LOG_LEVEL_WARN, "Can't resolve station %s: %s", link->name,
+                gai_strerror(error));
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, found->ai_addr, found->ai_addrlen)) {
+        log_msg(LOG_LEVEL_INFO, "Can't connect to station %s: %s",
+                link->name, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+/* keeps an outgoing link up for good */
+static void *station_dialler(void *arg) {
+    StationLink *link = (StationLink*) arg;
+    int wait = STATION_REDIAL_MIN;
+    while (1) {
+        station_set_state(link, LINK_CONNECTING);
+        link->fd = station_dial(link);
+        if (link->fd >= 0) {
+            int optVal = 1;
+            setsockopt(link->fd, SOL_SOCKET, SO_KEEPALIVE, &optVal,
+                    sizeof(optVal));
+            if (station_hello(link->fd, 1)) {
+                station_run(link);
+                wait = STATION_REDIAL_MIN;
+            } else {
+                log_msg(LOG_LEVEL_WARN, "Station %s didn't authenticate",
+                        link->name);
+            }
+            close(link->fd);
+        }
+        station_set_state(link, LINK_DOWN);
+        sleep(wait);
+        wait = wait * 2 > STATION_REDIAL_MAX ? STATION_REDIAL_MAX : wait * 2;
+    }
+    return NULL;
+}
+
+/* says hello to someone who dialled us, and only then gives them a
+ * slot to be served in */
+static void *station_accepted(void *arg) {
+    StationGuest *guest = (StationGuest*) arg;
+    int ok = station_hello(guest->fd, 0);
+    __atomic_fetch_sub(&pending, 1, __ATOMIC_RELAXED);
+    StationLink *link = ok ? station_slot() : NULL;
+    if (!ok) {
+        log_msg(LOG_LEVEL_WARN, "Station %s didn't authenticate",
+                guest->name);
+    } else if (link == NULL) {
+        log_msg(LOG_LEVEL_WARN, "Too many stations: hung up on %s",
+                guest->name);
     } else {
-        if (t == NULL) {
-            error(5);
+        strcpy(link->name, guest->name);
+        link->outgoing = 0;
+        link->fd = guest->fd;
+        station_run(link);
+        pthread_mutex_lock(&tableLock);
+        station_set_state(link, LINK_FREE);
+        pthread_mutex_unlock(&tableLock);
+    }
+    close(guest->fd);
+    free(guest);
+    return NULL;
+}
+
+static void *station_listener(void *arg) {
+    int sock = *(int*) arg;
+    free(arg);
+    struct sockaddr_in from;
+    socklen_t len;
+    while (1) {
+        len = sizeof(from);
+        int fd = accept(sock, (struct sockaddr*) &from, &len);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_msg(LOG_LEVEL_ERROR, "Error accepting a station: %s",
+                        strerror(errno));
+                sleep(1); // e.g. out of fds: let some go first
+            }
+            continue;
         }
-        serverAddr.sin_addr = *t;
+        // no slot until they've said hello: strangers who never do can't
+        // crowd real stations out of the table
+        StationGuest *guest = malloc(sizeof(StationGuest));
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+        snprintf(guest->name, sizeof(guest->name), "%s:%d", ip,
+                ntohs(from.sin_port));
+        guest->fd = fd;
+        int optVal = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &optVal, sizeof(optVal));
+        __atomic_fetch_add(&pending, 1, __ATOMIC_RELAXED);
+        pthread_t thread;
+        pthread_create(&thread, NULL, station_accepted, guest);
+        pthread_detach(thread);
     }
+    return NULL;
+}
 
-    // Bind socket to this address
-    if(bind(fd, (struct sockaddr*)&serverAddr, 
-            sizeof(struct sockaddr_in)) < 0) {
-        perror("Error binding socket to port");
+void station_listen(int port, char *interface) {
+    struct addrinfo hints, *found = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (interface != NULL) {
+        if (getaddrinfo(interface, NULL, &hints, &found)) {
+            fprintf(stderr, "Bad interface\n");
+            exit(5);
+        }
+        addr.sin_addr = ((struct sockaddr_in*) found->ai_addr)->sin_addr;
+        freeaddrinfo(found);
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Error creating station socket");
         exit(1);
     }
-
-    // Indicate we're ready to accept connections on that socket
-    // SOMAXCONN is max num of connection requests to be queued by the
-    // OS (default 128)
-    if(listen(fd, SOMAXCONN) < 0) {
-        perror("Error listening");
+    int optVal = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int))) {
+        perror("Error setting socket option");
         exit(1);
     }
-
-    // read and print assigned port using getaddrinfo
-    struct sockaddr_in info;
-    socklen_t len = sizeof(info);
-    // populate the info struct
-    if (getsockname(fd, (struct sockaddr*) &info, &len)) {
-        perror("Error getting socket info");
+    // after a handover the old thomas may not have let go of it yet
+    for (int tries = 0; bind(sock, (struct sockaddr*) &addr, sizeof(addr));
+            ++tries) {
+        if (errno != EADDRINUSE || tries == STATION_BIND_WAIT) {
+            perror("Error binding station port");
+            exit(1);
+        }
+        sleep(1);
+    }
+    if (listen(sock, SOMAXCONN)) {
+        perror("Error listening on station port");
         exit(1);
     }
-    *port = ntohs(info.sin_port);
-    printf("Listening on port %d on interface %s\n", *port, 
-            interface ? interface : "INADDR_ANY");
+    printf("Listening for stations on port %d\n", port);
+    int *arg = malloc(sizeof(int));
+    *arg = sock;
+    pthread_t thread;
+    pthread_create(&thread, NULL, station_listener, arg);
+    pthread_detach(thread);
+}
 
-    return fd;
+int station_connect(const char *peer) {
+    const char *colon = strrchr(peer, ':');
+    if (colon == NULL || colon == peer || colon[1] == '\0'
+            || strlen(peer) >= sizeof(links[0].name)) {
+        return 0;
+    }
+    StationLink *link = station_slot();
+    if (link == NULL) {
+        return 0;
+    }
+    strcpy(link->name, peer);
+    link->outgoing = 1;
+    link->host = strndup(peer, colon - peer);
+    link->port = strdup(colon + 1);
+    pthread_t thread;
+    pthread_create(&thread, NULL, station_dialler, link);
+    pthread_detach(thread);
+    return 1;
 }
 
-int main(int argc, char **argv) {
-    Data *data = parse_args(argc, argv);
-    int mainSocket = open_listen(&data->port, data->interface); // returns fd
-    mainSocket;
-    sleep(10);
-    return 0;
+void station_report(FILE *out) {
+    int slots = __atomic_load_n(&slotCount, __ATOMIC_ACQUIRE);
+    int shown = 0;
+    uint64_t now = histo_now();
+    for (int i = 0; i < slots; ++i) {
+        StationLink *link = &links[i];
+        pthread_mutex_lock(&link->lock);
+        StationLink copy = *link;
+        pthread_mutex_unlock(&link->lock);
+        if (copy.state == LINK_FREE) {
+            continue;
+        }
+        ++shown;
+        fprintf(out, "station %s (%s): %s", copy.name,
+                copy.outgoing ? "dialled" : "accepted",
+                stateNames[copy.state]);
+        if (copy.state != LINK_UP) {
+            fprintf(out, "\n");
+            continue;
+        }
+        double up = (now - copy.upAt) / 1e9;
+        double rateOver = up > 1 ? up : 1;
+        fprintf(out, " for %.0fs, out %ld frames %ld B in %ld writes"
+                " (%.0f B/s), in %ld frames %ld B (%.0f B/s),"
+                " queued %zu B, dropped %ld\n", up, copy.framesOut,
+                copy.bytesOut, copy.writes, copy.bytesOut / rateOver,
+                copy.framesIn, copy.bytesIn, copy.bytesIn / rateOver,
+                copy.queued, copy.dropped);
+    }
+    int hellos = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+    if (hellos) {
+        fprintf(out, "%d accepted, still saying hello\n", hellos);
+    } else if (!shown) {
+        fprintf(out, "no stations\n");
+    }
 }
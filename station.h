@@ -0,0 +1,98 @@
+#ifndef STATION_H_
+#define STATION_H_
+/* vim: set filetype=c : */
+
+/* Peer links between thomases, which the original station was for.
+ * Every link is one long-lived TCP connection, either made by us (-c,
+ * redialled whenever it drops) or accepted on the station port (-t).
+ * Both ends open with a HELLO frame carrying a random nonce, then prove
+ * they know the authfile's secret with a PROOF frame: its HMAC over both
+ * nonces, so the secret itself is never sent. The dialler proves first;
+ * anyone who doesn't is hung up on without a proof of ours, and takes
+ * none of the STATION_MAX_LINKS slots while they're trying.
+ *
+ * Once it's up, a link carries every echo our users get, to be counted
+ * at the other end: one DATA frame per echo, with the user's fd as its
+ * stream so one link multiplexes all of them. Forwarding only appends
+ * frames to the link's queue under its lock; the link's writer thread
+ * takes the whole queue at once and sends it with one write, so a busy
+ * link batches many small echoes into each write. A link whose queue
+ * reaches station_queue bytes drops frames (counted) rather than slow
+ * users down. "peers" on the control socket shows each link.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "conn.h"
+
+#define STATION_MAX_LINKS 32
+#define STATION_FRAME_MAX 65536 // payload bytes; longer echoes are split
+#define STATION_HELLO_TIMEOUT 5 // seconds to say hello in
+#define STATION_REDIAL_MIN 1 // seconds between tries, doubling
+#define STATION_REDIAL_MAX 30
+#define STATION_DEFAULT_QUEUE (4 << 20)
+
+/* on the wire, in network order, before each frame's payload */
+typedef struct {
+    uint32_t len; // of the payload
+    uint32_t stream; // DATA: whose echo it is
+    uint16_t type;
+    uint16_t unused;
+} StationFrame;
+
+typedef enum {
+    FRAME_HELLO = 1, // a nonce: the first frame each way
+    FRAME_DATA,
+    FRAME_PROOF // the secret's HMAC over both nonces: the second
+} StationFrameType;
+
+typedef enum {
+    LINK_FREE, // an unused slot
+    LINK_DOWN, // ours, waiting to redial
+    LINK_CONNECTING, // ours, connecting or saying hello
+    LINK_UP
+} StationLinkState;
+
+typedef struct {
+    char name[64]; // host:port, as given or as it came from
+    int outgoing; // we dial it; else it dialled us
+    int state; // a StationLinkState, atomic
+    int fd;
+    char *host, *port; // outgoing
+    pthread_mutex_t lock; // the queue, and state changes
+    pthread_cond_t wake; // for the writer: something queued, or down
+    char *queue; // frames waiting for the writer
+    size_t queued, queueCap;
+    uint64_t upAt; // histo_now() when the hello was done
+    long framesOut, framesIn, bytesIn; // bytesIn/framesIn: reader only
+    long bytesOut, writes; // sent by the writer, in how many writes
+    long dropped; // frames, for a full queue
+} StationLink;
+
+/* how many links are up (atomic): with none, forwarding is one load */
+extern int stationLinks;
+
+/* reads the secret from the first line of authfile, as the original
+ * station did; returns NULL if there isn't one */
+char* station_read_secret(const char* authPath);
+/* registers the tunables, and remembers the secret links must share */
+void station_init(char* secret);
+/* listens for other stations on port (bound on interface, or all) */
+void station_listen(int port, char* interface);
+/* dials peer ("host:port") now and whenever the link drops
+ * returns 0 if it isn't host:port */
+int station_connect(const char* peer);
+/* sends conn's echo to every link that's up */
+void station_send(Conn* conn, struct iovec* iov, int count);
+static inline void station_forward(Conn* conn, struct iovec* iov,
+        int count) {
+    if (__atomic_load_n(&stationLinks, __ATOMIC_RELAXED)) {
+        station_send(conn, iov, count);
+    }
+}
+/* a line per link: state, throughput and queue depth */
+void station_report(FILE* out);
+
+#endif
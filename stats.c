@@ -0,0 +1,129 @@
+#include <string.h>
+#include <unistd.h>
+#include "stats.h"
+
+static unsigned int nextSlot = 0;
+static __thread int mySlot = -1;
+
+void stats_init(ProgStats *ps) {
+    memset(ps, 0, sizeof(*ps));
+    // a couple of slots per CPU keeps collisions between threads rare
+    long want = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    ps->slots = 1;
+    while (ps->slots < want && ps->slots < STATS_MAX_SLOTS) {
+        ps->slots *= 2;
+    }
+}
+
+StatsSlot *stats_slot(ProgStats *ps) {
+    if (mySlot < 0) {
+        mySlot = __atomic_fetch_add(&nextSlot, 1, __ATOMIC_RELAXED);
+    }
+    return &ps->slot[mySlot & (ps->slots - 1)];
+}
+
+/* sums one counter over every slot */
+static long stats_sum(ProgStats *ps, StatField field) {
+    long total = 0;
+    for (int i = 0; i < ps->slots; ++i) {
+        total += __atomic_load_n(&ps->slot[i].counter[field],
+                __ATOMIC_ACQUIRE);
+    }
+    return total;
+}
+
+/* closes first: see stats.h */
+static long stats_current(ProgStats *ps) {
+    long closed = stats_sum(ps, STAT_CLOSED);
+    return stats_sum(ps, STAT_OPENED) - closed;
+}
+
+void stats_user_in(ProgStats *ps) {
+    __atomic_fetch_add(&stats_slot(ps)->counter[STAT_OPENED], 1,
+            __ATOMIC_RELEASE);
+    // only ever written when a new high is set, so it stays shared
+    long now = stats_current(ps);
+    long peak = __atomic_load_n(&ps->peakUsers, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&ps->peakUsers, &peak,
+            now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void stats_user_out(ProgStats *ps) {
+    __atomic_fetch_add(&stats_slot(ps)->counter[STAT_CLOSED], 1,
+            __ATOMIC_RELEASE);
+}
+
+void stats_restore(ProgStats *ps, StatsSnapshot *snap) {
+    // closed first, as ever, so nobody sees a negative number of users
+    stats_add(ps, STAT_CLOSED, snap->accepted - snap->currentUsers);
+    stats_add(ps, STAT_OPENED, snap->accepted - snap->currentUsers);
+    stats_add(ps, STAT_BYTES_IN, snap->bytesIn);
+    stats_add(ps, STAT_BYTES_OUT, snap->bytesOut);
+    stats_add(ps, STAT_READ_ERRORS, snap->readErrors);
+    stats_add(ps, STAT_WRITE_ERRORS, snap->writeErrors);
+    stats_add(ps, STAT_TIMEOUT_IDLE, snap->timeoutIdle);
+    stats_add(ps, STAT_TIMEOUT_READ, snap->timeoutRead);
+    stats_add(ps, STAT_TIMEOUT_LIFETIME, snap->timeoutLifetime);
+    stats_add(ps, STAT_OUTPUT_PAUSES, snap->outputPauses);
+    stats_add(ps, STAT_LINES, snap->lines);
+    stats_add(ps, STAT_LONG_LINES, snap->longLines);
+    stats_add(ps, STAT_THROTTLE_CONN_BYTES, snap->throttleConnBytes);
+    stats_add(ps, STAT_THROTTLE_CONN_MSGS, snap->throttleConnMsgs);
+    stats_add(ps, STAT_THROTTLE_IP_BYTES, snap->throttleIpBytes);
+    stats_add(ps, STAT_THROTTLE_IP_MSGS, snap->throttleIpMsgs);
+    stats_add(ps, STAT_FAIR_YIELDS, snap->fairYields);
+    stats_add(ps, STAT_REJECT_USERS, snap->rejectUsers);
+    stats_add(ps, STAT_REJECT_RATE, snap->rejectRate);
+    stats_add(ps, STAT_REJECT_LATENCY, snap->rejectLatency);
+    stats_add(ps, STAT_REJECT_QUEUE, snap->rejectQueue);
+    stats_add(ps, STAT_ACCEPT_PAUSES, snap->acceptPauses);
+    stats_add(ps, STAT_DATAGRAMS_IN, snap->datagramsIn);
+    stats_add(ps, STAT_DATAGRAMS_OUT, snap->datagramsOut);
+    stats_add(ps, STAT_DATAGRAM_DROPS, snap->datagramDrops);
+    stats_add(ps, STAT_LOCAL_USERS, snap->localUsers);
+    stats_add(ps, STAT_RING_USERS, snap->ringUsers);
+    stats_add(ps, STAT_RING_WAKEUPS, snap->ringWakeups);
+    long peak = __atomic_load_n(&ps->peakUsers, __ATOMIC_RELAXED);
+    while (snap->peakUsers > peak && !__atomic_compare_exchange_n(
+            &ps->peakUsers, &peak, snap->peakUsers, 1, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED)) {
+    }
+}
+
+void stats_snapshot(ProgStats *ps, StatsSnapshot *snap) {
+    long closed = stats_sum(ps, STAT_CLOSED);
+    snap->accepted = stats_sum(ps, STAT_OPENED);
+    snap->currentUsers = snap->accepted - closed;
+    snap->bytesIn = stats_sum(ps, STAT_BYTES_IN);
+    snap->bytesOut = stats_sum(ps, STAT_BYTES_OUT);
+    snap->readErrors = stats_sum(ps, STAT_READ_ERRORS);
+    snap->writeErrors = stats_sum(ps, STAT_WRITE_ERRORS);
+    snap->timeoutIdle = stats_sum(ps, STAT_TIMEOUT_IDLE);
+    snap->timeoutRead = stats_sum(ps, STAT_TIMEOUT_READ);
+    snap->timeoutLifetime = stats_sum(ps, STAT_TIMEOUT_LIFETIME);
+    snap->outputPauses = stats_sum(ps, STAT_OUTPUT_PAUSES);
+    snap->lines = stats_sum(ps, STAT_LINES);
+    snap->longLines = stats_sum(ps, STAT_LONG_LINES);
+    snap->throttleConnBytes = stats_sum(ps, STAT_THROTTLE_CONN_BYTES);
+    snap->throttleConnMsgs = stats_sum(ps, STAT_THROTTLE_CONN_MSGS);
+    snap->throttleIpBytes = stats_sum(ps, STAT_THROTTLE_IP_BYTES);
+    snap->throttleIpMsgs = stats_sum(ps, STAT_THROTTLE_IP_MSGS);
+    snap->fairYields = stats_sum(ps, STAT_FAIR_YIELDS);
+    snap->rejectUsers = stats_sum(ps, STAT_REJECT_USERS);
+    snap->rejectRate = stats_sum(ps, STAT_REJECT_RATE);
+    snap->rejectLatency = stats_sum(ps, STAT_REJECT_LATENCY);
+    snap->rejectQueue = stats_sum(ps, STAT_REJECT_QUEUE);
+    snap->acceptPauses = stats_sum(ps, STAT_ACCEPT_PAUSES);
+    snap->datagramsIn = stats_sum(ps, STAT_DATAGRAMS_IN);
+    snap->datagramsOut = stats_sum(ps, STAT_DATAGRAMS_OUT);
+    snap->datagramDrops = stats_sum(ps, STAT_DATAGRAM_DROPS);
+    snap->localUsers = stats_sum(ps, STAT_LOCAL_USERS);
+    snap->ringUsers = stats_sum(ps, STAT_RING_USERS);
+    snap->ringWakeups = stats_sum(ps, STAT_RING_WAKEUPS);
+    snap->peakUsers = __atomic_load_n(&ps->peakUsers, __ATOMIC_RELAXED);
+    // the peak is set just after the open is counted
+    if (snap->peakUsers < snap->currentUsers) {
+        snap->peakUsers = snap->currentUsers;
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef STATS_H_
+#define STATS_H_
+/* vim: set filetype=c : */
+
+/* Program-wide counters without a lock on the data path.
+ * Every thread adds into one of a set of cache-line sized slots (picked
+ * once per thread), so connects and disconnects on different cores
+ * don't fight over one line. Readers add the slots up.
+ *
+ * currentUsers isn't stored: it's opened - closed. Snapshots read every
+ * slot's closed count before any opened count, and a connection is
+ * always opened before it's closed, so they never see a close without
+ * its open.
+ */
+
+#define STATS_MAX_SLOTS 64
+#define CACHE_LINE 64
+
+/* what each slot counts */
+typedef enum {
+    STAT_OPENED, // connections counted in (== total accepts)
+    STAT_CLOSED,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_READ_ERRORS,
+    STAT_WRITE_ERRORS,
+    STAT_TIMEOUT_IDLE, // users cut off by each of the timeouts
+    STAT_TIMEOUT_READ,
+    STAT_TIMEOUT_LIFETIME,
+    STAT_OUTPUT_PAUSES, // reading stopped for a user with too much queued
+    STAT_LINES, // line mode: lines echoed
+    STAT_LONG_LINES, // and lines thrown away for being too long
+    STAT_THROTTLE_CONN_BYTES, // users made to wait by each rate limit
+    STAT_THROTTLE_CONN_MSGS,
+    STAT_THROTTLE_IP_BYTES,
+    STAT_THROTTLE_IP_MSGS,
+    STAT_FAIR_YIELDS, // pool workers handed to a waiting user mid-session
+    STAT_REJECT_USERS, // new users turned away by each admission limit
+    STAT_REJECT_RATE,
+    STAT_REJECT_LATENCY,
+    STAT_REJECT_QUEUE,
+    STAT_ACCEPT_PAUSES, // times an acceptor stopped accepting for a while
+    STAT_DATAGRAMS_IN, // -u: datagrams received
+    STAT_DATAGRAMS_OUT, // and echoed
+    STAT_DATAGRAM_DROPS, // and not: too big, or not taken by the kernel
+    STAT_LOCAL_USERS, // -U: users accepted over the AF_UNIX listener
+    STAT_RING_USERS, // -R: clients given shared-memory rings
+    STAT_RING_WAKEUPS, // eventfd writes to wake a ring client
+    STAT_COUNT
+} StatField;
+
+typedef struct {
+    long counter[STAT_COUNT];
+} __attribute__((aligned(CACHE_LINE))) StatsSlot;
+
+// important
+typedef struct {
+    StatsSlot slot[STATS_MAX_SLOTS];
+    int slots; // how many are in use, a power of two
+    long peakUsers; // most users connected at once
+} ProgStats;
+
+/* a summed-up copy for readers */
+typedef struct {
+    long currentUsers;
+    long accepted;
+    long bytesIn;
+    long bytesOut;
+    long readErrors;
+    long writeErrors;
+    long peakUsers;
+    long timeoutIdle, timeoutRead, timeoutLifetime;
+    long outputPauses;
+    long lines, longLines;
+    long throttleConnBytes, throttleConnMsgs;
+    long throttleIpBytes, throttleIpMsgs;
+    long fairYields;
+    long rejectUsers, rejectRate, rejectLatency, rejectQueue;
+    long acceptPauses;
+    long datagramsIn, datagramsOut, datagramDrops;
+    long localUsers, ringUsers, ringWakeups;
+} StatsSnapshot;
+
+/* zeroes ps and sizes its slots to the number of CPUs */
+void stats_init(ProgStats *ps);
+/* the calling thread's slot */
+StatsSlot *stats_slot(ProgStats *ps);
+/* counts a user in (updating the peak) or out */
+void stats_user_in(ProgStats *ps);
+void stats_user_out(ProgStats *ps);
+/* adds everything up; never blocks writers */
+void stats_snapshot(ProgStats *ps, StatsSnapshot *snap);
+/* carries over another process's counts (a handover) before any users
+ * arrive: its current users are left out, to be counted back in as
+ * they're adopted */
+void stats_restore(ProgStats *ps, StatsSnapshot *snap);
+
+/* the data path's way in: one relaxed add to this thread's slot */
+static inline void stats_add(ProgStats *ps, StatField field, long n) {
+    __atomic_fetch_add(&stats_slot(ps)->counter[field], n,
+            __ATOMIC_RELAXED);
+}
+
+#endif
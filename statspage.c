@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "statspage.h"
+#include "histo.h"
+#include "logger.h"
+#include "station.h"
+#include "udp.h"
+#include "shmring.h"
+#include "tunables.h"
+
+static long intervalMs = STATSPAGE_DEFAULT_MS;
+static char *pagePath = NULL;
+static ino_t pageInode;
+
+typedef struct {
+    StatsPage *page;
+    ProgStats *progStats;
+    int *admins;
+} StatsPageArgs;
+
+static int64_t statspage_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* gathers everything first, so the seqlock is held for a memcpy */
+static void statspage_publish(StatsPageArgs *args) {
+    static Histogram echo; // big: not on the stack
+    StatsPage fresh;
+    StatsSnapshot snap;
+    memcpy(&fresh, args->page, sizeof(fresh));
+    stats_snapshot(args->progStats, &snap);
+    histo_merge(HISTO_ECHO, &echo);
+    fresh.publishedAt = statspage_clock();
+    ++fresh.publishes;
+    fresh.currentUsers = snap.currentUsers;
+    fresh.peakUsers = snap.peakUsers;
+    fresh.accepted = snap.accepted;
+    fresh.bytesIn = snap.bytesIn;
+    fresh.bytesOut = snap.bytesOut;
+    fresh.readErrors = snap.readErrors;
+    fresh.writeErrors = snap.writeErrors;
+    fresh.timeoutIdle = snap.timeoutIdle;
+    fresh.timeoutRead = snap.timeoutRead;
+    fresh.timeoutLifetime = snap.timeoutLifetime;
+    fresh.outputPauses = snap.outputPauses;
+    fresh.lines = snap.lines;
+    fresh.longLines = snap.longLines;
+    fresh.admins = __atomic_load_n(args->admins, __ATOMIC_RELAXED);
+    fresh.logDrops = log_drops();
+    fresh.stationLinks = __atomic_load_n(&stationLinks, __ATOMIC_RELAXED);
+    fresh.echoCount = echo.count;
+    fresh.echoP50 = histo_percentile(&echo, 0.5);
+    fresh.echoP99 = histo_percentile(&echo, 0.99);
+    fresh.echoP999 = histo_percentile(&echo, 0.999);
+    fresh.echoMax = echo.max;
+    fresh.throttleConnBytes = snap.throttleConnBytes;
+    fresh.throttleConnMsgs = snap.throttleConnMsgs;
+    fresh.throttleIpBytes = snap.throttleIpBytes;
+    fresh.throttleIpMsgs = snap.throttleIpMsgs;
+    fresh.fairYields = snap.fairYields;
+    fresh.rejectUsers = snap.rejectUsers;
+    fresh.rejectRate = snap.rejectRate;
+    fresh.rejectLatency = snap.rejectLatency;
+    fresh.rejectQueue = snap.rejectQueue;
+    fresh.acceptPauses = snap.acceptPauses;
+    fresh.datagramsIn = snap.datagramsIn;
+    fresh.datagramsOut = snap.datagramsOut;
+    fresh.datagramDrops = snap.datagramDrops;
+    fresh.datagramRate = udp_rate();
+    fresh.localUsers = snap.localUsers;
+    fresh.ringUsers = snap.ringUsers;
+    fresh.ringWakeups = snap.ringWakeups;
+    fresh.ringClients = shmring_clients();
+
+    // the header never changes, and seq is ours: copy from the fields on
+    StatsPage *page = args->page;
+    size_t header = offsetof(StatsPage, pid);
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*) page + header, (char*) &fresh + header,
+            sizeof(fresh) - header);
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void *statspage_thread(void *arg) {
+    StatsPageArgs *args = (StatsPageArgs*) arg;
+    while (1) {
+        statspage_publish(args);
+        long ms = tunable_get(&intervalMs);
+        struct timespec nap = {ms / 1000, (ms % 1000) * 1000000};
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+void statspage_start(const char *path, ProgStats *progStats, int *admins) {
+    // made aside and renamed into place, so readers never see half a
+    // page, and an old thomas still writing to the last one is harmless
+    size_t len = strlen(path) + 16;
+    char *made = malloc(len);
+    snprintf(made, len, "%s.%d", path, (int) getpid());
+    int fd = open(made, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Error creating stats page");
+        exit(1);
+    }
+    size_t size = (sizeof(StatsPage) + 4095) & ~(size_t) 4095;
+    if (ftruncate(fd, size)) {
+        perror("Error sizing stats page");
+        exit(1);
+    }
+    StatsPage *page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (page == MAP_FAILED) {
+        perror("Error mapping stats page");
+        exit(1);
+    }
+    struct stat madeStat;
+    fstat(fd, &madeStat);
+    pageInode = madeStat.st_ino;
+    close(fd);
+    page->magic = STATSPAGE_MAGIC;
+    page->version = STATSPAGE_VERSION;
+    page->size = sizeof(StatsPage);
+    page->pid = getpid();
+    page->startedAt = statspage_clock();
+    tunable_register("stats_page_ms", &intervalMs, 10, 60000,
+            "milliseconds between updates of the -m stats page");
+
+    StatsPageArgs *args = malloc(sizeof(StatsPageArgs));
+    args->page = page;
+    args->progStats = progStats;
+    args->admins = admins;
+    statspage_publish(args);
+    if (rename(made, path)) {
+        perror("Error moving stats page into place");
+        exit(1);
+    }
+    free(made);
+    pagePath = strdup(path);
+    printf("Publishing stats to %s\n", path);
+    pthread_t thread;
+    pthread_create(&thread, NULL, statspage_thread, args);
+    pthread_detach(thread);
+}
+
+void statspage_remove(void) {
+    struct stat now;
+    if (pagePath != NULL && !stat(pagePath, &now)
+            && now.st_ino == pageInode) {
+        unlink(pagePath);
+    }
+}
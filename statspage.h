@@ -0,0 +1,87 @@
+#ifndef STATSPAGE_H_
+#define STATSPAGE_H_
+/* vim: set filetype=c : */
+
+/* The stats page (-m): the numbers "stats" gives, published to a file
+ * that monitoring maps and reads without talking to us at all.
+ * A thread copies a fresh snapshot into the mapping every
+ * stats_page_ms, inside a seqlock: seq is odd while it's writing, so a
+ * reader copies the page out and keeps it only if seq was the same even
+ * number before and after (statspage_read). thomas-stats is such a
+ * reader.
+ *
+ * The layout is versioned. Fields are only ever added at the end, with
+ * size growing to match; anything else bumps STATSPAGE_VERSION. A new
+ * thomas (after a handover, say) publishes to a new file renamed over
+ * the old one, so readers should reopen the path now and then.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "stats.h"
+
+#define STATSPAGE_MAGIC 0x746174736d6f6874ULL // "thomstat" on x86
+#define STATSPAGE_VERSION 1
+#define STATSPAGE_DEFAULT_MS 100
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size; // bytes of this struct that the writer fills in
+    uint64_t seq; // odd while it's being written
+    int64_t pid;
+    int64_t startedAt; // CLOCK_REALTIME, in ns
+    int64_t publishedAt;
+    int64_t publishes;
+    // ProgStats
+    int64_t currentUsers;
+    int64_t peakUsers;
+    int64_t accepted;
+    int64_t bytesIn, bytesOut;
+    int64_t readErrors, writeErrors;
+    int64_t timeoutIdle, timeoutRead, timeoutLifetime;
+    int64_t outputPauses;
+    int64_t lines, longLines;
+    // AdminStats
+    int64_t admins; // ever connected
+    // the hot paths'
+    int64_t logDrops;
+    int64_t stationLinks;
+    int64_t echoCount; // echo latency, in ns, since the last histo reset
+    int64_t echoP50, echoP99, echoP999, echoMax;
+    int64_t throttleConnBytes, throttleConnMsgs;
+    int64_t throttleIpBytes, throttleIpMsgs;
+    int64_t fairYields;
+    int64_t rejectUsers, rejectRate, rejectLatency, rejectQueue;
+    int64_t acceptPauses;
+    int64_t datagramsIn, datagramsOut, datagramDrops;
+    int64_t datagramRate; // received over the last whole second
+    int64_t localUsers, ringUsers, ringWakeups;
+    int64_t ringClients; // attached now
+} StatsPage;
+
+/* starts publishing to path every stats_page_ms; exits the program if
+ * it can't make the file */
+void statspage_start(const char* path, ProgStats* progStats, int* admins);
+/* deletes the file at exit, unless another thomas has replaced it */
+void statspage_remove(void);
+
+/* copies page to out if it's a page we understand and holds still long
+ * enough: returns 1 if out is consistent, 0 to try again shortly, -1
+ * if it isn't a stats page, or not a version we know; fields past
+ * page->size are left zero */
+static inline int statspage_read(const StatsPage* page, StatsPage* out) {
+    if (page->magic != STATSPAGE_MAGIC
+            || page->version != STATSPAGE_VERSION) {
+        return -1;
+    }
+    uint64_t before = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+        return 0;
+    }
+    memcpy(out, page, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&page->seq, __ATOMIC_RELAXED) == before;
+}
+
+#endif
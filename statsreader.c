@@ -0,0 +1,149 @@
+/*
+** thomas-stats: prints the stats page a thomas publishes with -m
+** Maps the file read-only and copies out a consistent snapshot under
+** its seqlock, so it costs the thomas being watched nothing: no
+** connection, no command, not even a context switch. One "name value"
+** line per number, for monitoring to scrape.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "statspage.h"
+
+const char usage_msg[] =
+"Usage: ./thomas-stats [-w seconds] stats-page\n"
+"-w seconds           print a snapshot this often, rather than once\n"
+"";
+
+#define READ_TRIES 1000 // before deciding the writer died mid-update
+
+static size_t mappedSize = 0;
+
+typedef struct {
+    const char *name;
+    size_t offset;
+} PageField;
+
+#define FIELD(name) {#name, offsetof(StatsPage, name)}
+static const PageField fields[] = {
+    FIELD(pid), FIELD(startedAt), FIELD(publishedAt), FIELD(publishes),
+    FIELD(currentUsers), FIELD(peakUsers), FIELD(accepted),
+    FIELD(bytesIn), FIELD(bytesOut), FIELD(readErrors), FIELD(writeErrors),
+    FIELD(timeoutIdle), FIELD(timeoutRead), FIELD(timeoutLifetime),
+    FIELD(outputPauses), FIELD(lines), FIELD(longLines), FIELD(admins),
+    FIELD(logDrops), FIELD(stationLinks), FIELD(echoCount),
+    FIELD(echoP50), FIELD(echoP99), FIELD(echoP999), FIELD(echoMax),
+    FIELD(throttleConnBytes), FIELD(throttleConnMsgs),
+    FIELD(throttleIpBytes), FIELD(throttleIpMsgs), FIELD(fairYields),
+    FIELD(rejectUsers), FIELD(rejectRate), FIELD(rejectLatency),
+    FIELD(rejectQueue), FIELD(acceptPauses), FIELD(datagramsIn),
+    FIELD(datagramsOut), FIELD(datagramDrops), FIELD(datagramRate),
+    FIELD(localUsers), FIELD(ringUsers), FIELD(ringWakeups),
+    FIELD(ringClients),
+    {NULL, 0}
+};
+
+/* the page at path, mapped; exits if it can't be */
+static const StatsPage *map_page(const char *path, ino_t *inode) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info)) {
+        perror(path);
+        exit(1);
+    }
+    // whole pages, so even an older thomas's covers all our fields
+    size_t size = info.st_size;
+    if (size < sizeof(StatsPage)) {
+        fprintf(stderr, "%s isn't a stats page\n", path);
+        exit(1);
+    }
+    void *page = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        perror("Mapping the stats page");
+        exit(1);
+    }
+    close(fd);
+    mappedSize = size;
+    *inode = info.st_ino;
+    return page;
+}
+
+/* prints one snapshot; returns 0 if there isn't a consistent one */
+static int print_page(const StatsPage *page) {
+    StatsPage snap;
+    int got = 0;
+    for (int i = 0; i < READ_TRIES && !got; ++i) {
+        got = statspage_read(page, &snap);
+        if (got < 0) {
+            fprintf(stderr, "Not a stats page we understand (version %u)\n",
+                    page->version);
+            exit(1);
+        }
+        if (!got) {
+            struct timespec nap = {0, 1000};
+            nanosleep(&nap, NULL);
+        }
+    }
+    if (!got) {
+        return 0;
+    }
+    for (const PageField *f = fields; f->name != NULL; ++f) {
+        int64_t value = 0;
+        if (f->offset < snap.size) {
+            memcpy(&value, (char*) &snap + f->offset, sizeof(value));
+        }
+        printf("%s %lld\n", f->name, (long long) value);
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    double interval = 0;
+    int c;
+    while ((c = getopt(argc, argv, "w:")) != -1) {
+        switch (c) {
+            case 'w':
+                interval = atof(optarg);
+                if (interval <= 0) {
+                    fprintf(stderr, "Invalid argument to -w: %s\n", optarg);
+                    fprintf(stderr, usage_msg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, usage_msg);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, usage_msg);
+        exit(1);
+    }
+    const char *path = argv[optind];
+    ino_t inode;
+    const StatsPage *page = map_page(path, &inode);
+    while (1) {
+        if (!print_page(page)) {
+            fprintf(stderr, "The stats page never held still\n");
+            exit(1);
+        }
+        if (interval == 0) {
+            return 0;
+        }
+        printf("\n");
+        fflush(stdout);
+        usleep(interval * 1e6);
+        // a new thomas (after a handover) puts a new page in its place
+        struct stat now;
+        if (!stat(path, &now) && now.st_ino != inode) {
+            munmap((void*) page, mappedSize);
+            page = map_page(path, &inode);
+        }
+    }
+}
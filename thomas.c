@@ -6,6 +6,7 @@
 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -17,41 +18,107 @@
 #include <signal.h>
 #include "user.h"
 #include "admin.h"
+#include "capitalise.h"
+#include "statspage.h"
+#include "transform.h"
+#include "placement.h"
 
 const char usage_msg[] =
-"Usage: ./thomas [-p port] [-i interface] -l logfile -a authfile [-s socket]\n"
+"Usage: ./thomas [-p port] [-i interface] [-l logfile] -a authfile [-s socket]\n"
+"                [-e engine] [-w loops] [-S shards] [-n]\n"
+"                [-P workers] [-K stack KB] [-Q queue depth] [-H]\n"
+"                [-L max line] [-t station port] [-c host:port]...\n"
+"                [-m stats page] [-u datagram port] [-U user socket]\n"
+"                [-R ring socket] [-X stages] [-A placement]\n"
 "-p port              if unspecified, defaults to ephemeral\n"
 "-i interface         if unspecified, defaults to 127.0.0.1\n"
-"-l logfile           the file to write logs to\n"
-"-a authfile          the file to read authstring from\n"
+"-l logfile           the file to write logs to, else stdout; SIGHUP reopens it\n"
+"-a authfile          the file to read authstring from: the secret shared\n"
+"                     with other stations; needed for -t and -c\n"
 "-s socket path       if unspecified, defaults to ./control-socket\n"
+"-e engine            threads (default: one per user), epoll, uring or pool\n"
+"-w loops             epoll/uring loop threads, defaults to one per CPU\n"
+"-S shards            SO_REUSEPORT listeners, each with its own accept loop\n"
+"-n                   log client addresses numerically, with no reverse DNS\n"
+"-P workers           pool engine: worker threads, defaults to 64\n"
+"-K stack KB          pool engine: each worker's stack, defaults to 256\n"
+"-Q queue depth       pool engine: users queued per worker, defaults to 64\n"
+"-H                   take over the listeners and users of the thomas at the\n"
+"                     control socket, which then exits (-p, -i, -S, -u and\n"
+"                     -U are ignored); not with the uring engine\n"
+"-L max line          echo whole lines only, each up to this many bytes\n"
+"                     with its newline; not with the uring engine\n"
+"-t station port      listen for other stations on this port\n"
+"-c host:port         link to the station there, forwarding every echo to it;\n"
+"                     may be given more than once\n"
+"-m stats page        keep a file updated with our stats, for thomas-stats\n"
+"-u datagram port     also echo UDP datagrams on this port, a socket per shard\n"
+"-U user socket path  also take users over a unix socket here, as one more shard\n"
+"-R ring socket path  serve local clients shared-memory rings, attached here\n"
+"-X stages            the echo pipeline, e.g. printable,upper,count; defaults\n"
+"                     to upper (see transform on the control socket)\n"
+"-A placement         pin serving threads: cpus:0-3,8 (one CPU each, in\n"
+"                     turn) or nodes[:0,1] (a NUMA node per shard)\n"
 "";
 
 typedef struct {
     int port; // may be 0 if ephemeral requested
     char *interface;
-    char *logPath; // unused
-    char *authPath; // unused
+    char *logPath; // NULL for stdout
+    char *authPath;
+    char *secret; // from authPath, if we're linking with other stations
     char *controlPath;
+    char *statsPath; // -m: NULL unless we're publishing a stats page
+    int numericHosts; // skip reverse DNS entirely
+    int takeOver; // -H: get our users from the old thomas at controlPath
+    long lineMax; // -L: line mode, with lines up to this long; 0 for off
+    int stationPort; // -t: 0 if we don't take links from other stations
+    int udpPort; // -u: 0 if we don't echo datagrams
+    char *userSocketPath; // -U: NULL unless local users have a socket
+    char *ringPath; // -R: NULL unless we're serving rings
+    char *stages; // -X: NULL for the default pipeline
+    char *placement; // -A: NULL to leave threads to the scheduler
+    char *peers[STATION_MAX_LINKS]; // -c: stations we link to
+    int peerCount;
+    UserConfig user;
 } ProgramArgs;
 
 #define DEFAULT_CONTROL_SOCKET "./control-socket";
 
 char *controlPath; // NULL or defined after opening it
+char *userSocketPath; // likewise, for -U
+char *ringPath; // and -R
 int controlSock; // 0 or defined after opening it
 
 /* creates and populates the ProgramArgs struct
  * exits the program on invalid args */
 ProgramArgs parse_args(int argc, char **argv) {
     ProgramArgs pa;
-    pa.interface = pa.logPath = pa.authPath = NULL;
+    pa.interface = pa.logPath = pa.authPath = pa.statsPath = NULL;
     pa.controlPath = DEFAULT_CONTROL_SOCKET;
+    pa.port = 0;
+    pa.numericHosts = 0;
+    pa.takeOver = 0;
+    pa.lineMax = 0;
+    pa.stationPort = pa.peerCount = 0;
+    pa.udpPort = 0;
+    pa.userSocketPath = pa.ringPath = pa.stages = pa.placement = NULL;
+    pa.secret = NULL;
+    pa.user.engine = ENGINE_THREADS;
+    pa.user.loops = sysconf(_SC_NPROCESSORS_ONLN);
+    if (pa.user.loops < 1) {
+        pa.user.loops = 1;
+    }
+    pa.user.shards = 1;
+    pa.user.poolWorkers = POOL_DEFAULT_WORKERS;
+    pa.user.poolStackKb = POOL_DEFAULT_STACK_KB;
+    pa.user.poolDepth = POOL_DEFAULT_DEPTH;
     int c;
     extern char *optarg;
     extern int optind, optopt;
     long int tmp;
     int errors = 0;
-    while ((c = getopt(argc, argv, "p:i:l:a:s:")) != -1) {
+    while ((c = getopt(argc, argv, "p:i:l:a:s:e:w:S:nP:K:Q:HL:t:c:m:u:U:R:X:A:")) != -1) {
         switch (c) {
             case 'p':
                 tmp = strtol(optarg, NULL, 10);
@@ -65,27 +132,138 @@ ProgramArgs parse_args(int argc, char **argv) {
                 pa.interface = optarg; // validated when we try to bind
                 break;
             case 'l':
-                pa.logPath = optarg; // not used
+                pa.logPath = optarg;
                 break;
             case 'a':
-                pa.authPath = optarg; // not used
+                pa.authPath = optarg;
                 break;
             case 's':
                 pa.controlPath = optarg; // validated when we try to bind
                 break;
+            case 'm':
+                pa.statsPath = optarg; // validated when we make it
+                break;
+            case 'U':
+                pa.userSocketPath = optarg; // validated when we try to bind
+                break;
+            case 'R':
+                pa.ringPath = optarg; // likewise
+                break;
+            case 'X':
+                pa.stages = optarg; // validated once transforms are set up
+                break;
+            case 'A':
+                pa.placement = optarg; // likewise, once we know the nodes
+                break;
+            case 'e':
+                tmp = user_parse_engine(optarg);
+                if (tmp < 0) {
+                    fprintf(stderr, "Invalid argument to -e: %s\n", optarg);
+                    ++errors;
+                }
+                pa.user.engine = tmp;
+                break;
+            case 'w':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp <= 0 || tmp > 1024) {
+                    fprintf(stderr, "Invalid argument to -w: %s\n", optarg);
+                    ++errors;
+                }
+                pa.user.loops = tmp;
+                break;
+            case 'n':
+                pa.numericHosts = 1;
+                break;
+            case 'S':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp <= 0 || tmp > MAX_SHARDS) {
+                    fprintf(stderr, "Invalid argument to -S: %s\n", optarg);
+                    ++errors;
+                }
+                pa.user.shards = tmp;
+                break;
+            case 'H':
+                pa.takeOver = 1;
+                break;
+            case 'P':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp <= 0 || tmp > 4096) {
+                    fprintf(stderr, "Invalid argument to -P: %s\n", optarg);
+                    ++errors;
+                }
+                pa.user.poolWorkers = tmp;
+                break;
+            case 'K':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp < 64 || tmp > 65536) {
+                    fprintf(stderr, "Invalid argument to -K: %s\n", optarg);
+                    ++errors;
+                }
+                pa.user.poolStackKb = tmp;
+                break;
+            case 'Q':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp <= 0 || tmp > 65536) {
+                    fprintf(stderr, "Invalid argument to -Q: %s\n", optarg);
+                    ++errors;
+                }
+                pa.user.poolDepth = tmp;
+                break;
+            case 'L':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp < 2 || tmp > 1048576) {
+                    fprintf(stderr, "Invalid argument to -L: %s\n", optarg);
+                    ++errors;
+                }
+                pa.lineMax = tmp;
+                break;
+            case 't':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp <= 0 || tmp >= 65535) {
+                    fprintf(stderr, "Invalid argument to -t: %s\n", optarg);
+                    ++errors;
+                }
+                pa.stationPort = tmp;
+                break;
+            case 'u':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp <= 0 || tmp >= 65535) {
+                    fprintf(stderr, "Invalid argument to -u: %s\n", optarg);
+                    ++errors;
+                }
+                pa.udpPort = tmp;
+                break;
+            case 'c':
+                if (strrchr(optarg, ':') == NULL
+                        || pa.peerCount == STATION_MAX_LINKS) {
+                    fprintf(stderr, "Invalid argument to -c: %s\n", optarg);
+                    ++errors;
+                } else {
+                    pa.peers[pa.peerCount++] = optarg;
+                }
+                break;
             case '?':
                 fprintf(stderr, "Unknown option -%c\n", optopt);
         }
     }
-    /* these options are un-implemented, so not currently required */
-    /* if (pa.logPath == NULL) { */
-    /*     fprintf(stderr, "Log path must be set\n"); */
-    /*     ++errors; */
-    /* } */
-    /* if (pa.authPath == NULL) { */
-    /*     fprintf(stderr, "Authfile path must be set\n"); */
-    /*     ++errors; */
-    /* } */
+    // only stations need to prove who they are
+    if (pa.stationPort || pa.peerCount) {
+        if (pa.authPath == NULL) {
+            fprintf(stderr, "Authfile path must be set\n");
+            ++errors;
+        } else if ((pa.secret = station_read_secret(pa.authPath)) == NULL) {
+            fprintf(stderr, "Invalid name/auth\n");
+            ++errors;
+        }
+    }
+    if (pa.takeOver && pa.user.engine == ENGINE_URING) {
+        fprintf(stderr, "The uring engine can't take over users\n");
+        ++errors;
+    }
+    if (pa.lineMax && pa.user.engine == ENGINE_URING) {
+        fprintf(stderr, "The uring engine can't do line mode\n");
+        ++errors;
+    }
     if (errors) {
         fprintf(stderr, usage_msg);
         exit(1);
@@ -95,30 +273,19 @@ ProgramArgs parse_args(int argc, char **argv) {
 
 void *client_thread(void *arg);
 
-/* takes a text buffer and its len, and returns the capitalised version */
-char *capitalise(char *buffer, int len)
-{
-    int i;
-
-    for(i = 0; i < len; i++) {
-        buffer[i] = (char)toupper((int)buffer[i]);
-    }
-    return buffer;
-}
-
-ProgStats init_prog_stats(void) {
-    ProgStats ps;
-    memset(&ps, 0, sizeof(ps));
-    return ps;
-}
-
-/* delete the control socket we were using
+/* delete the control socket we were using, and any for local users
  * if it hasn't yet been opened, do nothing */
 void cleanup(void) {
     // if we close this, it cancels accept(): Software caused connection abort
     // fortunately, it doesn't seem to be required for unlink()
     //close(controlSock);
-    if (controlPath != NULL) unlink(controlPath);
+    // after a handover the socket files are the new thomas's
+    if (!handover_given()) {
+        if (controlPath != NULL) unlink(controlPath);
+        if (userSocketPath != NULL) unlink(userSocketPath);
+        if (ringPath != NULL) unlink(ringPath);
+    }
+    statspage_remove();
 }
 void handle_sigint(int sig) {
     cleanup();
@@ -131,28 +298,173 @@ void configure_sigint(void) {
     if (sigaction(SIGINT, &sa, 0)) {
         perror("Configuring SIGINT");
     }
+    // an admin hanging up mid-reply shouldn't take us down with it
+    signal(SIGPIPE, SIG_IGN);
+}
+void handle_sighup(int sig) {
+    log_reopen();
+}
+/* SIGHUP reopens the log, e.g. after logrotate has moved it */
+void configure_sighup(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sighup;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGHUP, &sa, 0)) {
+        perror("Configuring SIGHUP");
+    }
+}
+
+/* -H: gets the old thomas's listeners, users and counts, and starts
+ * serving them; the old one exits once it has let go */
+void take_over(ProgramArgs *pa, ProgStats *progStats) {
+    static Handover h; // big: not on the stack
+    handover_take(pa->controlPath, &h);
+    pa->user.shards = h.listeners;
+    for (int i = 0; i < h.listeners; ++i) {
+        user_begin_processing(h.listenerFd[i], progStats, &pa->user);
+        user_restore_shard(i, h.listener[i].accepted,
+                h.listener[i].currentUsers);
+    }
+    for (int i = 0; i < h.datagrams; ++i) {
+        udp_begin(h.datagramFd[i], progStats);
+    }
+    stats_restore(progStats, &h.stats);
+    for (int i = 0; i < h.conns; ++i) {
+        HandoverRecord *rec = &h.conn[i];
+        Conn conn;
+        conn_init(&conn, h.connFd[i], rec->shard, &rec->peer,
+                rec->acceptedAt);
+        conn.bytesIn = rec->bytesIn;
+        conn.bytesOut = rec->bytesOut;
+        conn.lastReadAt = rec->lastReadAt;
+        if (rec->carryLen > 0 && rec->carryLen <= TRANSFORM_CARRY_MAX) {
+            conn.carry.len = rec->carryLen;
+            memcpy(conn.carry.bytes, rec->carry, rec->carryLen);
+        }
+        line_start(&conn.lines);
+        char *pending = h.connPending[i];
+        if (rec->pending) {
+            outq_push(&conn.out, pending, rec->pending);
+        }
+        if (conn.lines.buf != NULL) {
+            line_restore(&conn.lines, pending + rec->pending, rec->partial,
+                    rec->skipping);
+        } else if (rec->partial) {
+            // we're not framing lines: it's just more to echo
+            outq_push(&conn.out, pending + rec->pending, transform_apply(
+                    pending + rec->pending, rec->partial));
+        }
+        free(pending);
+        user_adopt(&conn);
+    }
+    free(h.conn);
+    free(h.connFd);
+    free(h.connPending);
+
+    for (int i = 0; i < h.listeners; ++i) {
+        static struct sockaddr_un local; // its path outlives us
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(local);
+        if (getsockname(h.listenerFd[i], (struct sockaddr*) &local, &len)) {
+            continue;
+        }
+        if (local.sun_family == AF_UNIX) {
+            // -U: ours to unlink now
+            pa->userSocketPath = local.sun_path;
+        } else if (!pa->port) {
+            memcpy(&addr, &local, sizeof(addr));
+            pa->port = ntohs(addr.sin_port);
+        }
+    }
 }
 
 int main(int argc, char *argv[])
 {
     ProgramArgs pa = parse_args(argc, argv);
-    ProgStats progStats = init_prog_stats();
-    controlPath = NULL;
+    static ProgStats progStats; // big and cache-aligned: not on the stack
+    stats_init(&progStats);
+    histo_init();
+    transform_init();
+    const char *error;
+    if (pa.stages != NULL && (error = transform_configure(pa.stages))) {
+        fprintf(stderr, "Invalid argument to -X: %s\n", error);
+        exit(1);
+    }
+    placement_init();
+    if (pa.placement != NULL
+            && (error = placement_configure(pa.placement))) {
+        fprintf(stderr, "Invalid argument to -A: %s\n", error);
+        exit(1);
+    }
+    controlPath = userSocketPath = ringPath = NULL;
     controlSock = 0;
+    log_start(pa.logPath);
+    configure_sighup();
+    handover_init();
+    timeout_init();
+    outq_init();
+    throttle_init();
+    admission_init();
+    station_init(pa.secret);
+    if (pa.lineMax) {
+        lines_init(pa.lineMax);
+    }
 
     // user netcode
-    int fdServer;
-    fdServer = user_open_listen(&pa.port, pa.interface); // sets port if ephemeral
+    resolver_start(pa.numericHosts);
+    if (pa.takeOver) {
+        take_over(&pa, &progStats);
+    } else {
+        // the first listener sets port if ephemeral; any other shards
+        // reuse it
+        int fdServer, tcpShards = pa.user.shards;
+        if (pa.userSocketPath != NULL) {
+            ++pa.user.shards; // it gets its share of the loops
+        }
+        for (int i = 0; i < tcpShards; ++i) {
+            fdServer = user_open_listen(&pa.port, pa.interface,
+                    tcpShards > 1);
+            user_begin_processing(fdServer, &progStats, &pa.user);
+        }
+        if (pa.userSocketPath != NULL) {
+            fdServer = user_open_unix(pa.userSocketPath);
+            user_begin_processing(fdServer, &progStats, &pa.user);
+        }
+        for (int i = 0; pa.udpPort && i < tcpShards; ++i) {
+            udp_begin(user_open_datagram(&pa.udpPort, pa.interface,
+                    tcpShards > 1), &progStats);
+        }
+    }
     printf("port after open listen is %d\n", pa.port);
-    user_begin_processing(fdServer, &progStats);
+    printf("Capitalising with the %s kernel\n", capitalise_kernel_name());
+
+    // other stations
+    if (pa.stationPort) {
+        station_listen(pa.stationPort, pa.interface);
+    }
+    for (int i = 0; i < pa.peerCount; ++i) {
+        if (!station_connect(pa.peers[i])) {
+            fprintf(stderr, "Can't link to station %s\n", pa.peers[i]);
+            exit(1);
+        }
+    }
 
     // admin sockcode
     controlSock = make_control_socket(pa.controlPath);
     controlPath = pa.controlPath;
+    userSocketPath = pa.userSocketPath;
     atexit(cleanup); // now that we've got a socket to close and unlink
     configure_sigint();
     AdminStats adminStats; // so it's in the main scope
     admin_begin_processing(controlSock, &adminStats, &progStats);
+    if (pa.statsPath != NULL) {
+        statspage_start(pa.statsPath, &progStats, &adminStats.counter);
+    }
+    if (pa.ringPath != NULL) {
+        shmring_listen(pa.ringPath, &progStats);
+        ringPath = pa.ringPath;
+    }
 
     while(1) sleep(10); // one thread mastering user, one thread mastering admin
 
@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include "throttle.h"
+#include "tunables.h"
+#include "slab.h"
+
+typedef struct ThrottleIp {
+    struct in_addr addr;
+    int users; // holding on to it, under its stripe's lock
+    TokenBucket bytes, msgs;
+    struct ThrottleIp *next;
+} ThrottleIp;
+
+static long connByteRate = 0, connMsgRate = 0;
+static long ipByteRate = 0, ipMsgRate = 0;
+static long burstMs = THROTTLE_DEFAULT_BURST_MS;
+static long quantum = THROTTLE_DEFAULT_QUANTUM;
+
+static ThrottleIp *ipSlots[THROTTLE_IP_SLOTS];
+static struct {
+    pthread_mutex_t lock;
+} __attribute__((aligned(CACHE_LINE))) ipStripes[THROTTLE_IP_STRIPES];
+static SlabPool ipSlab = SLAB_POOL("address throttles", sizeof(ThrottleIp));
+
+void throttle_init(void) {
+    for (int i = 0; i < THROTTLE_IP_STRIPES; ++i) {
+        pthread_mutex_init(&ipStripes[i].lock, NULL);
+    }
+    tunable_register("conn_byte_rate", &connByteRate, 0, 1L << 40,
+            "bytes per second each user may send; 0 for no limit");
+    tunable_register("conn_msg_rate", &connMsgRate, 0, 1L << 30,
+            "reads per second each user may have; 0 for no limit");
+    tunable_register("ip_byte_rate", &ipByteRate, 0, 1L << 40,
+            "bytes per second the users from one address may send together");
+    tunable_register("ip_msg_rate", &ipMsgRate, 0, 1L << 30,
+            "reads per second the users from one address may have together");
+    tunable_register("throttle_burst_ms", &burstMs, 1, 60000,
+            "how much of its rate a limit lets through at once, in ms");
+    tunable_register("fair_quantum", &quantum, 0, 1L << 30,
+            "pool engine: bytes a user gets per turn while others wait");
+}
+
+size_t throttle_quantum(void) {
+    return tunable_get(&quantum);
+}
+
+uint64_t throttle_take(TokenBucket *b, long rate, double n, uint64_t now) {
+    double depth = rate * tunable_get(&burstMs) / 1000.0;
+    if (depth < 1) {
+        depth = 1;
+    }
+    if (b->at == 0) {
+        b->tokens = depth;
+    } else if (now > b->at) {
+        b->tokens += (now - b->at) * (double) rate / 1e9;
+        if (b->tokens > depth) {
+            b->tokens = depth;
+        }
+    }
+    b->at = now;
+    b->tokens -= n;
+    return b->tokens >= 0 ? 0 : (uint64_t) (-b->tokens * 1e9 / rate);
+}
+
+/* the stripe lock for an address's chain */
+static pthread_mutex_t *ip_lock(unsigned slot) {
+    return &ipStripes[slot % THROTTLE_IP_STRIPES].lock;
+}
+
+static unsigned ip_slot(struct in_addr addr) {
+    // Fibonacci hashing: neighbouring addresses land far apart
+    return (addr.s_addr * 2654435769u) >> 22;
+}
+
+/* addr's buckets, made if nobody from there has any yet */
+static ThrottleIp *ip_get(struct in_addr addr) {
+    unsigned slot = ip_slot(addr);
+    pthread_mutex_lock(ip_lock(slot));
+    ThrottleIp *ip = ipSlots[slot];
+    while (ip != NULL && ip->addr.s_addr != addr.s_addr) {
+        ip = ip->next;
+    }
+    if (ip == NULL) {
+        ip = slab_zalloc(&ipSlab);
+        ip->addr = addr;
+        ip->next = ipSlots[slot];
+        ipSlots[slot] = ip;
+    }
+    ++ip->users;
+    pthread_mutex_unlock(ip_lock(slot));
+    return ip;
+}
+
+void throttle_stop(Throttle *t) {
+    ThrottleIp *ip = t->ip;
+    if (ip == NULL) {
+        return;
+    }
+    t->ip = NULL;
+    unsigned slot = ip_slot(ip->addr);
+    pthread_mutex_lock(ip_lock(slot));
+    if (--ip->users == 0) {
+        ThrottleIp **link = &ipSlots[slot];
+        while (*link != ip) {
+            link = &(*link)->next;
+        }
+        *link = ip->next;
+        slab_free(&ipSlab, ip);
+    }
+    pthread_mutex_unlock(ip_lock(slot));
+}
+
+uint64_t throttle_charge(Throttle *t, struct in_addr addr, ProgStats *ps,
+        size_t n, uint64_t now) {
+    long rates[4] = {tunable_get(&connByteRate), tunable_get(&connMsgRate),
+            tunable_get(&ipByteRate), tunable_get(&ipMsgRate)};
+    if (!(rates[0] | rates[1] | rates[2] | rates[3])) {
+        t->until = 0;
+        return 0;
+    }
+    static const StatField fields[4] = {STAT_THROTTLE_CONN_BYTES,
+            STAT_THROTTLE_CONN_MSGS, STAT_THROTTLE_IP_BYTES,
+            STAT_THROTTLE_IP_MSGS};
+    uint64_t debt[4] = {0, 0, 0, 0};
+    TokenBucket *own[2] = {&t->bytes, &t->msgs};
+    double cost[2] = {n, 1};
+    for (int i = 0; i < 2; ++i) {
+        if (rates[i]) {
+            debt[i] = throttle_take(own[i], rates[i], cost[i], now);
+        } else {
+            own[i]->at = 0; // full again if it's turned back on
+        }
+    }
+    if (rates[2] || rates[3]) {
+        if (t->ip == NULL) {
+            t->ip = ip_get(addr);
+        }
+        ThrottleIp *ip = t->ip;
+        TokenBucket *shared[2] = {&ip->bytes, &ip->msgs};
+        pthread_mutex_t *lock = ip_lock(ip_slot(addr));
+        pthread_mutex_lock(lock);
+        for (int i = 0; i < 2; ++i) {
+            if (rates[2 + i]) {
+                debt[2 + i] = throttle_take(shared[i], rates[2 + i], cost[i],
+                        now);
+            } else {
+                shared[i]->at = 0;
+            }
+        }
+        pthread_mutex_unlock(lock);
+    }
+    uint64_t wait = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (debt[i]) {
+            stats_add(ps, fields[i], 1);
+            if (debt[i] > wait) {
+                wait = debt[i];
+            }
+        }
+    }
+    t->until = wait ? now + wait : 0;
+    return t->until;
+}
@@ -0,0 +1,65 @@
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+/* vim: set filetype=c : */
+
+/* Rate limits on users, so one heavy client can't take the cores from
+ * everyone else. Token buckets, each refilled at its tunable's rate and
+ * holding up to throttle_burst_ms of it:
+ *  conn_byte_rate, conn_msg_rate  bytes and reads per second, per user
+ *  ip_byte_rate, ip_msg_rate      the same, shared by every user from
+ *                                 one address
+ * 0 (the default) turns a limit off; "set" changes them while we run.
+ *
+ * Each read is charged after the fact, so a bucket can go into debt;
+ * the user isn't read from again until every bucket they draw on is
+ * back out of it. The engines wait in their own ways: the blocking
+ * ones sleep, the event loops stop watching the socket for a while.
+ * Each time a limit makes someone wait is counted, per limit.
+ *
+ * Per-address buckets live in a hash table striped like the connection
+ * registry, made on a user's first charge while an IP limit is on and
+ * freed when the last user from that address leaves.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "stats.h"
+
+#define THROTTLE_IP_SLOTS 1024 // hash chains
+#define THROTTLE_IP_STRIPES 64 // locks, each covering every 64th chain
+#define THROTTLE_DEFAULT_BURST_MS 1000
+#define THROTTLE_DEFAULT_QUANTUM 65536
+
+typedef struct {
+    double tokens;
+    uint64_t at; // histo_now() of the last refill; 0 for never: full
+} TokenBucket;
+
+struct ThrottleIp;
+
+/* what each user has, in its Conn */
+typedef struct {
+    TokenBucket bytes, msgs;
+    struct ThrottleIp *ip; // its address's buckets, once they're needed
+    uint64_t until; // histo_now() it may read again at; 0 if it may now
+} Throttle;
+
+/* registers the tunables */
+void throttle_init(void);
+/* charges one read of n bytes at now to t (and its address's buckets),
+ * counting in ps each limit that now makes it wait
+ * returns t->until: when it may read again, or 0 for straight away */
+uint64_t throttle_charge(Throttle* t, struct in_addr addr, ProgStats* ps,
+        size_t n, uint64_t now);
+/* refills b at rate for the time since it was last charged (up to
+ * throttle_burst_ms of it), then takes n
+ * returns how long it'll be in debt for, in ns */
+uint64_t throttle_take(TokenBucket* b, long rate, double n, uint64_t now);
+/* lets go of t's share of its address's buckets */
+void throttle_stop(Throttle* t);
+/* the pool engine's fair share: bytes a user may be echoed in one turn
+ * on a worker while other users wait for one; 0 for no limit */
+size_t throttle_quantum(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include <unistd.h>
+#include <sys/socket.h>
+#include "timeout.h"
+#include "tunables.h"
+#include "histo.h"
+#include "handover.h"
+#include "logger.h"
+
+#define NS_PER_S 1000000000ULL
+
+static long idleTimeout = 0, readTimeout = 0, lifetimeTimeout = 0;
+
+static const char *kindNames[] = {"none", "idle", "read", "lifetime"};
+
+void timeout_init(void) {
+    tunable_register("idle_timeout", &idleTimeout, 0, 86400,
+            "seconds a user may send nothing before we hang up; 0 for never");
+    tunable_register("read_timeout", &readTimeout, 0, 86400,
+            "seconds a new user has to send something; 0 for never");
+    tunable_register("lifetime_timeout", &lifetimeTimeout, 0, 86400 * 7,
+            "seconds anyone may stay connected; 0 for ever");
+}
+
+void timeout_wheel_init(TimerWheel *wheel) {
+    timer_wheel_init(wheel, TIMEOUT_TICK_MS * 1000000ULL, histo_now());
+}
+
+/* the soonest of conn's deadlines, and which it is; 0 if none */
+static uint64_t timeout_deadline(Conn *conn, TimeoutKind *kind) {
+    uint64_t deadline = 0;
+    long idle = tunable_get(&idleTimeout);
+    long read = tunable_get(&readTimeout);
+    long lifetime = tunable_get(&lifetimeTimeout);
+    *kind = TIMEOUT_NONE;
+    if (lifetime) {
+        deadline = conn->acceptedAt + lifetime * NS_PER_S;
+        *kind = TIMEOUT_LIFETIME;
+    }
+    if (read && __atomic_load_n(&conn->bytesIn, __ATOMIC_RELAXED) == 0) {
+        uint64_t at = conn->acceptedAt + read * NS_PER_S;
+        if (!deadline || at < deadline) {
+            deadline = at;
+            *kind = TIMEOUT_READ;
+        }
+    }
+    if (idle) {
+        uint64_t at = __atomic_load_n(&conn->lastReadAt, __ATOMIC_RELAXED)
+                + idle * NS_PER_S;
+        if (!deadline || at < deadline) {
+            deadline = at;
+            *kind = TIMEOUT_IDLE;
+        }
+    }
+    return deadline;
+}
+
+TimeoutKind timeout_check(Conn *conn, uint64_t now) {
+    TimeoutKind kind;
+    uint64_t deadline = timeout_deadline(conn, &kind);
+    return deadline && deadline <= now ? kind : TIMEOUT_NONE;
+}
+
+void timeout_arm(TimerWheel *wheel, Conn *conn) {
+    TimeoutKind kind;
+    uint64_t deadline = timeout_deadline(conn, &kind);
+    if (!deadline) {
+        deadline = histo_now() + TIMEOUT_RECHECK_S * NS_PER_S;
+    }
+    timer_arm(wheel, &conn->timer, deadline);
+}
+
+void timeout_expired(ProgStats *ps, Conn *conn, TimeoutKind kind) {
+    static const StatField fields[] = {0, STAT_TIMEOUT_IDLE,
+            STAT_TIMEOUT_READ, STAT_TIMEOUT_LIFETIME};
+    stats_add(ps, fields[kind], 1);
+    log_msg(LOG_LEVEL_INFO, "Timed out (%s) on fd %d", kindNames[kind],
+            conn->fd);
+}
+
+// the blocking engines' watchdog
+static pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;
+static TimerWheel watchWheel;
+static int watchStarted = 0;
+static ProgStats *watchStats;
+
+/* ticks the shared wheel; an expired user's socket is shut down, and
+ * its thread finds EOF and closes it as usual
+ * the lock keeps every conn here alive: they unwatch before closing */
+static void* timeout_watchdog(void *arg) {
+    handover_join();
+    while (1) {
+        handover_checkpoint();
+        usleep(TIMEOUT_TICK_MS * 1000);
+        uint64_t now = histo_now();
+        pthread_mutex_lock(&watchLock);
+        Timer *timer = timer_advance(&watchWheel, now);
+        while (timer != NULL) {
+            Timer *next = timer->next;
+            Conn *conn = timeout_conn(timer);
+            TimeoutKind kind = timeout_check(conn, now);
+            if (kind == TIMEOUT_NONE) {
+                timeout_arm(&watchWheel, conn);
+            } else {
+                timeout_expired(watchStats, conn, kind);
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+            timer = next;
+        }
+        pthread_mutex_unlock(&watchLock);
+    }
+    return NULL;
+}
+
+void timeout_watch(Conn *conn, ProgStats *ps) {
+    pthread_mutex_lock(&watchLock);
+    if (!watchStarted) {
+        watchStarted = 1;
+        watchStats = ps;
+        timeout_wheel_init(&watchWheel);
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, timeout_watchdog, NULL);
+        pthread_detach(threadId);
+    }
+    timeout_arm(&watchWheel, conn);
+    pthread_mutex_unlock(&watchLock);
+}
+
+void timeout_unwatch(Conn *conn) {
+    pthread_mutex_lock(&watchLock);
+    timer_cancel(&watchWheel, &conn->timer);
+    pthread_mutex_unlock(&watchLock);
+}
@@ -0,0 +1,56 @@
+#ifndef TIMEOUT_H_
+#define TIMEOUT_H_
+/* vim: set filetype=c : */
+
+/* When users get cut off. Three tunables, in seconds, 0 for never:
+ *  idle_timeout      nothing read from them for this long
+ *  read_timeout      nothing read at all this long after connecting
+ *  lifetime_timeout  connected this long, whatever they're doing
+ *
+ * Each connection has one Timer, on its engine's TimerWheel, set for
+ * the soonest of its deadlines. Reads only note the time: the timer is
+ * looked at when it goes off, and either the connection has expired or
+ * the timer is set again for the new soonest deadline.
+ *
+ * The event-loop engines keep a wheel per loop. The blocking engines
+ * (threads, pool) share one, run by a watchdog thread that shuts down
+ * the sockets of expired users, which wakes their threads.
+ */
+
+#include <stddef.h>
+#include "shared.h"
+#include "conn.h"
+#include "timer.h"
+
+#define TIMEOUT_TICK_MS 100
+#define TIMEOUT_RECHECK_S 10 // no deadline: look again in case one's set
+
+typedef enum {
+    TIMEOUT_NONE,
+    TIMEOUT_IDLE,
+    TIMEOUT_READ,
+    TIMEOUT_LIFETIME
+} TimeoutKind;
+
+/* registers the tunables */
+void timeout_init(void);
+/* a wheel with TIMEOUT_TICK_MS ticks, starting now */
+void timeout_wheel_init(TimerWheel* wheel);
+/* what conn has run out of by now, if anything */
+TimeoutKind timeout_check(Conn* conn, uint64_t now);
+/* sets conn's timer for its soonest deadline, or cancels it if it has
+ * none */
+void timeout_arm(TimerWheel* wheel, Conn* conn);
+/* counts the expiry in ps and logs it */
+void timeout_expired(ProgStats* ps, Conn* conn, TimeoutKind kind);
+/* the Conn a timer belongs to */
+static inline Conn* timeout_conn(Timer* timer) {
+    return (Conn*) ((char*) timer - offsetof(Conn, timer));
+}
+
+/* the blocking engines' watchdog: starts its thread on first use */
+void timeout_watch(Conn* conn, ProgStats* ps);
+/* call before closing conn's fd */
+void timeout_unwatch(Conn* conn);
+
+#endif
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "timer.h"
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t tickNs, uint64_t nowNs) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tickNs = tickNs;
+    wheel->now = nowNs / tickNs;
+}
+
+/* files timer under the coarsest level whose slots still tell its tick
+ * apart from now; anything too far out waits in the last slot it can */
+static void timer_insert(TimerWheel *wheel, Timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1
+            && delta >= (uint64_t) 1 << (TIMER_BITS * (level + 1))) {
+        ++level;
+    }
+    uint64_t at = timer->expires;
+    if (delta >= (uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) {
+        at = wheel->now + ((uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+    Timer **head = &wheel->slot[level]
+            [(at >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void timer_unlink(Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+    timer->next = NULL;
+}
+
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t whenNs) {
+    if (timer_armed(timer)) {
+        timer_unlink(timer);
+    } else {
+        ++wheel->armed;
+    }
+    timer->expires = (whenNs + wheel->tickNs - 1) / wheel->tickNs;
+    // the current tick's slot has been done: the soonest is the next
+    if (timer->expires <= wheel->now) {
+        timer->expires = wheel->now + 1;
+    }
+    timer_insert(wheel, timer);
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (timer_armed(timer)) {
+        timer_unlink(timer);
+        --wheel->armed;
+    }
+}
+
+/* refiles everything in one slot of a coarser level */
+static void timer_cascade(TimerWheel *wheel, int level) {
+    int index = (wheel->now >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+    Timer *timer = wheel->slot[level][index];
+    wheel->slot[level][index] = NULL;
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        timer_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+Timer* timer_advance(TimerWheel *wheel, uint64_t nowNs) {
+    uint64_t target = nowNs / wheel->tickNs;
+    Timer *expired = NULL;
+    while (wheel->now < target) {
+        if (wheel->armed == 0) {
+            wheel->now = target; // nothing to step through
+            break;
+        }
+        ++wheel->now;
+        // at the end of each lap of a level, bring the next slot up down
+        for (int level = 1; level < TIMER_LEVELS; ++level) {
+            if (wheel->now & (((uint64_t) 1 << (TIMER_BITS * level)) - 1)) {
+                break;
+            }
+            timer_cascade(wheel, level);
+        }
+        Timer **head = &wheel->slot[0][wheel->now & (TIMER_SLOTS - 1)];
+        while (*head != NULL) {
+            Timer *timer = *head;
+            timer_unlink(timer);
+            if (timer->expires > wheel->now) {
+                timer_insert(wheel, timer); // parked at the horizon
+                continue;
+            }
+            --wheel->armed;
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+    return expired;
+}
@@ -0,0 +1,47 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+/* vim: set filetype=c : */
+
+/* A hierarchical timing wheel: arming and cancelling are O(1) however
+ * many timers there are. Time moves in ticks; level 0 has a slot per
+ * tick for the next TIMER_SLOTS ticks, and each level above has slots
+ * TIMER_SLOTS times as wide. When a level-0 lap ends, the next slot up
+ * is cascaded down into the finer levels.
+ *
+ * Not thread-safe: each wheel belongs to one thread, or to a lock.
+ */
+
+#include <stdint.h>
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4 // 2^24 ticks: 19 days at 100ms
+
+typedef struct Timer {
+    uint64_t expires; // in ticks
+    struct Timer *next;
+    struct Timer **pprev; // NULL while not armed
+} Timer;
+
+typedef struct {
+    uint64_t tickNs;
+    uint64_t now; // the last tick processed
+    long armed;
+    Timer *slot[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+/* an empty wheel whose ticks are tickNs long, starting at nowNs */
+void timer_wheel_init(TimerWheel* wheel, uint64_t tickNs, uint64_t nowNs);
+/* (re)arms timer to expire at whenNs, rounded up to a tick */
+void timer_arm(TimerWheel* wheel, Timer* timer, uint64_t whenNs);
+/* disarms timer; fine if it isn't armed */
+void timer_cancel(TimerWheel* wheel, Timer* timer);
+static inline int timer_armed(Timer* timer) {
+    return timer->pprev != NULL;
+}
+/* moves time on to nowNs, returning every timer that expired on the way
+ * as a list through next; they're disarmed, and the caller may rearm
+ * them */
+Timer* timer_advance(TimerWheel* wheel, uint64_t nowNs);
+
+#endif
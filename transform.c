@@ -0,0 +1,443 @@
+#include <stdint.h>
+#include "transform.h"
+#include "capitalise.h"
+#include "histo.h"
+#include "tunables.h"
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRANSFORM_X86 1
+#endif
+
+typedef enum { STAGE_MAP, STAGE_COUNT, STAGE_CRC, STAGE_UTF8 } StageKind;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    StageKind kind;
+    int (*map)(int c); // STAGE_MAP: what c becomes, or -1 to drop it
+} TransformStage;
+
+static int map_upper(int c) {
+    return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
+static int map_lower(int c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+static int map_swap(int c) {
+    return map_upper(c) != c ? map_upper(c) : map_lower(c);
+}
+static int map_rot13(int c) {
+    if (c >= 'a' && c <= 'z') {
+        return 'a' + (c - 'a' + 13) % 26;
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return 'A' + (c - 'A' + 13) % 26;
+    }
+    return c;
+}
+static int map_printable(int c) {
+    return c >= 0x20 && c != 0x7f ? c
+            : c == '\t' || c == '\r' || c == '\n' ? c : -1;
+}
+static int map_ascii(int c) {
+    return c < 0x80 ? c : -1;
+}
+
+static const TransformStage stageTable[] = {
+    {"upper", "a..z to A..Z", STAGE_MAP, map_upper},
+    {"lower", "A..Z to a..z", STAGE_MAP, map_lower},
+    {"swap", "swaps the case of letters", STAGE_MAP, map_swap},
+    {"rot13", "rotates letters by 13", STAGE_MAP, map_rot13},
+    {"printable", "drops control bytes other than tab, CR and LF",
+            STAGE_MAP, map_printable},
+    {"ascii", "drops bytes over 0x7f", STAGE_MAP, map_ascii},
+    {"count", "counts bytes and lines going past", STAGE_COUNT, NULL},
+    {"crc32c", "adds up each buffer's CRC-32C", STAGE_CRC, NULL},
+    {"utf8upper", "upper-cases UTF-8 text, ASCII or not", STAGE_UTF8, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+typedef enum {
+    STEP_MAP, STEP_UPPER, STEP_COUNT, STEP_CRC, STEP_UTF8
+} StepKind;
+
+/* one pass over each block: a fused run of maps, or a stage that looks */
+typedef struct {
+    StepKind kind;
+    int stage; // the first stage it covers, for those that look
+    int drops; // whether map drops anything
+    unsigned char map[256]; // what each byte becomes
+    unsigned char keep[256]; // 0 if it's dropped instead
+    char name[TRANSFORM_SPEC_MAX]; // its stages, joined with '+'
+    // transform_timing only; atomic
+    long calls, bytes, ns;
+} __attribute__((aligned(CACHE_LINE))) TransformStep;
+
+/* what a stage that looks has seen; atomic */
+typedef struct {
+    long bytes, lines; // count
+    long buffers, sum; // crc32c: each buffer's crc, added up
+} __attribute__((aligned(CACHE_LINE))) StageTally;
+
+typedef struct TransformPlan {
+    char spec[TRANSFORM_SPEC_MAX];
+    int stages;
+    int utf8; // whether blocks and buffers must end on whole sequences
+    const TransformStage *stage[TRANSFORM_MAX_STAGES];
+    StageTally tally[TRANSFORM_MAX_STAGES];
+    int fusedSteps, singleSteps;
+    TransformStep fused[TRANSFORM_MAX_STAGES];
+    TransformStep single[TRANSFORM_MAX_STAGES];
+    struct TransformPlan *older;
+} TransformPlan;
+
+// swapped whole by transform_configure; old plans are kept rather than
+// freed, as the data path may still be using one and admins change them
+// rarely
+static TransformPlan *current = NULL;
+static pthread_mutex_t configureLock = PTHREAD_MUTEX_INITIALIZER;
+static long timing = 0, fuse = 1;
+static pthread_once_t utf8Once = PTHREAD_ONCE_INIT;
+
+static uint32_t crcTable[256];
+static int crcHardware = 0;
+
+/* the reflected Castagnoli polynomial, a byte at a time */
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int b = 0; b < 8; ++b) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crcTable[i] = crc;
+    }
+#ifdef TRANSFORM_X86
+    __builtin_cpu_init();
+    crcHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc_scalar(uint32_t crc, const unsigned char *p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        crc = crcTable[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef TRANSFORM_X86
+/* 8 bytes per crc32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t n) {
+    size_t i = 0;
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        wide = __builtin_ia32_crc32di(wide, v);
+    }
+    crc = wide;
+#endif
+    for (; i < n; ++i) {
+        crc = __builtin_ia32_crc32qi(crc, p[i]);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc_update(uint32_t crc, const char *p, size_t n) {
+#ifdef TRANSFORM_X86
+    if (crcHardware) {
+        return crc_sse42(crc, (const unsigned char*) p, n);
+    }
+#endif
+    return crc_scalar(crc, (const unsigned char*) p, n);
+}
+
+/* the step for stages [first, last) of plan: a run of maps fused into
+ * one table, or a single stage that looks */
+static void step_make(TransformPlan *plan, TransformStep *step, int first,
+        int last) {
+    memset(step, 0, sizeof(*step));
+    step->stage = first;
+    for (int s = first; s < last; ++s) {
+        if (s > first) {
+            strcat(step->name, "+");
+        }
+        strcat(step->name, plan->stage[s]->name);
+    }
+    if (plan->stage[first]->kind == STAGE_COUNT) {
+        step->kind = STEP_COUNT;
+        return;
+    }
+    if (plan->stage[first]->kind == STAGE_CRC) {
+        step->kind = STEP_CRC;
+        return;
+    }
+    if (plan->stage[first]->kind == STAGE_UTF8) {
+        step->kind = STEP_UTF8;
+        return;
+    }
+    int upper = 1;
+    for (int c = 0; c < 256; ++c) {
+        int v = c;
+        for (int s = first; s < last && v >= 0; ++s) {
+            v = plan->stage[s]->map(v);
+        }
+        step->map[c] = v < 0 ? 0 : v;
+        step->keep[c] = v >= 0;
+        step->drops |= v < 0;
+        upper &= v == map_upper(c);
+    }
+    step->kind = upper ? STEP_UPPER : STEP_MAP;
+}
+
+/* fused: each run of maps as one step; single: a step per stage */
+static void plan_steps(TransformPlan *plan) {
+    plan->fusedSteps = plan->singleSteps = 0;
+    for (int s = 0; s < plan->stages; ) {
+        int end = s + 1;
+        while (plan->stage[s]->kind == STAGE_MAP && end < plan->stages
+                && plan->stage[end]->kind == STAGE_MAP) {
+            ++end;
+        }
+        step_make(plan, &plan->fused[plan->fusedSteps++], s, end);
+        s = end;
+    }
+    for (int s = 0; s < plan->stages; ++s) {
+        step_make(plan, &plan->single[plan->singleSteps++], s, s + 1);
+    }
+}
+
+const char *transform_configure(const char *spec) {
+    static __thread char error[TRANSFORM_SPEC_MAX + 64];
+    if (strlen(spec) >= TRANSFORM_SPEC_MAX) {
+        return "pipeline too long";
+    }
+    TransformPlan *plan = calloc(1, sizeof(TransformPlan));
+    strcpy(plan->spec, spec);
+    char names[TRANSFORM_SPEC_MAX], *save = NULL;
+    // "none" leaves no stages: everything goes back as it came
+    strcpy(names, strcmp(spec, "none") ? spec : "");
+    for (char *name = strtok_r(names, ",", &save); name != NULL;
+            name = strtok_r(NULL, ",", &save)) {
+        const TransformStage *stage = stageTable;
+        while (stage->name != NULL && strcmp(stage->name, name)) {
+            ++stage;
+        }
+        if (stage->name == NULL) {
+            snprintf(error, sizeof(error), "no stage called %s", name);
+            free(plan);
+            return error;
+        }
+        if (plan->stages == TRANSFORM_MAX_STAGES) {
+            free(plan);
+            return "too many stages";
+        }
+        plan->stage[plan->stages++] = stage;
+        plan->utf8 |= stage->kind == STAGE_UTF8;
+    }
+    if (plan->utf8) {
+        pthread_once(&utf8Once, utf8_init); // only paid for if it's used
+    }
+    plan_steps(plan);
+    pthread_mutex_lock(&configureLock);
+    plan->older = current;
+    __atomic_store_n(&current, plan, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&configureLock);
+    return NULL;
+}
+
+void transform_init(void) {
+    tunable_register("transform_timing", &timing, 0, 1,
+            "1 to time each step of the echo pipeline (see transform)");
+    tunable_register("transform_fuse", &fuse, 0, 1,
+            "0 to run each pipeline stage as a pass of its own");
+    crc_init();
+    transform_configure(TRANSFORM_DEFAULT);
+}
+
+/* the fused table, a byte at a time; the output never overtakes the
+ * input, so it's done in place */
+static size_t step_map(TransformStep *step, char *buffer, size_t len) {
+    unsigned char *p = (unsigned char*) buffer;
+    if (!step->drops) {
+        for (size_t i = 0; i < len; ++i) {
+            p[i] = step->map[p[i]];
+        }
+        return len;
+    }
+    size_t out = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = p[i];
+        p[out] = step->map[c];
+        out += step->keep[c];
+    }
+    return out;
+}
+
+/* runs one step over a block, keeping what it sees in tally (local to
+ * this call); returns the block's new length */
+static size_t step_run(TransformStep *step, char *block, size_t len,
+        StageTally *tally, uint32_t *crc) {
+    switch (step->kind) {
+        case STEP_UPPER:
+            capitalise(block, len);
+            return len;
+        case STEP_MAP:
+            return step_map(step, block, len);
+        case STEP_COUNT:
+            tally->bytes += len;
+            for (char *nl = block; (nl = memchr(nl, '\n',
+                    block + len - nl)) != NULL; ++nl) {
+                ++tally->lines;
+            }
+            return len;
+        case STEP_CRC:
+            *crc = crc_update(*crc, block, len);
+            return len;
+        case STEP_UTF8:
+            return utf8_upper(block, len);
+    }
+    return len;
+}
+
+size_t transform_apply(char *buffer, size_t len) {
+    TransformPlan *plan = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    int timed = tunable_get(&timing);
+    int steps = tunable_get(&fuse) ? plan->fusedSteps : plan->singleSteps;
+    TransformStep *step = tunable_get(&fuse) ? plan->fused : plan->single;
+    if (steps == 1 && step->kind == STEP_UPPER && !timed) {
+        capitalise(buffer, len); // the default, as it's always been
+        return len;
+    }
+    if (steps == 0) {
+        return len;
+    }
+    StageTally tally[TRANSFORM_MAX_STAGES];
+    uint32_t crc[TRANSFORM_MAX_STAGES];
+    uint64_t ns[TRANSFORM_MAX_STAGES];
+    size_t taken[TRANSFORM_MAX_STAGES]; // less than len after a drop
+    for (int s = 0; s < steps; ++s) {
+        tally[s].bytes = tally[s].lines = 0;
+        crc[s] = ~0U;
+        ns[s] = taken[s] = 0;
+    }
+    size_t out = 0;
+    for (size_t at = 0, n; at < len; at += n) {
+        char *block = buffer + at;
+        n = len - at < TRANSFORM_BLOCK ? len - at : TRANSFORM_BLOCK;
+        if (plan->utf8 && at + n < len) {
+            n = utf8_whole(block, n); // no sequence split between blocks
+        }
+        size_t blockLen = n;
+        for (int s = 0; s < steps; ++s) {
+            uint64_t start = timed ? histo_now() : 0;
+            taken[s] += blockLen;
+            blockLen = step_run(&step[s], block, blockLen, &tally[s],
+                    &crc[s]);
+            if (timed) {
+                ns[s] += histo_now() - start;
+            }
+        }
+        if (out != at) {
+            memmove(buffer + out, block, blockLen); // something was dropped
+        }
+        out += blockLen;
+    }
+    // one atomic add per step per buffer, not per block
+    for (int s = 0; s < steps; ++s) {
+        StageTally *total = &plan->tally[step[s].stage];
+        if (step[s].kind == STEP_COUNT) {
+            __atomic_fetch_add(&total->bytes, tally[s].bytes,
+                    __ATOMIC_RELAXED);
+            __atomic_fetch_add(&total->lines, tally[s].lines,
+                    __ATOMIC_RELAXED);
+        } else if (step[s].kind == STEP_CRC) {
+            __atomic_fetch_add(&total->sum, (long) ~crc[s],
+                    __ATOMIC_RELAXED);
+            __atomic_fetch_add(&total->buffers, 1, __ATOMIC_RELAXED);
+        }
+        if (timed) {
+            __atomic_fetch_add(&step[s].calls, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&step[s].bytes, taken[s], __ATOMIC_RELAXED);
+            __atomic_fetch_add(&step[s].ns, ns[s], __ATOMIC_RELAXED);
+        }
+    }
+    return out;
+}
+
+char *transform_stream(TransformCarry *carry, char *buffer, size_t *len) {
+    TransformPlan *plan = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    char *start = buffer - carry->len;
+    memcpy(start, carry->bytes, carry->len);
+    size_t n = *len + carry->len;
+    carry->len = 0;
+    if (plan->utf8) {
+        size_t whole = utf8_whole(start, n);
+        carry->len = n - whole;
+        memcpy(carry->bytes, start + whole, carry->len);
+        n = whole;
+    }
+    *len = transform_apply(start, n);
+    return start;
+}
+
+int transform_rest(TransformCarry *carry, struct iovec *iov) {
+    if (carry->len == 0) {
+        return 0;
+    }
+    iov->iov_base = carry->bytes;
+    iov->iov_len = carry->len;
+    carry->len = 0;
+    return 1;
+}
+
+/* a line per step that's been timed */
+static void report_steps(FILE *out, const char *what, TransformStep *step,
+        int steps) {
+    for (int s = 0; s < steps; ++s) {
+        long calls = __atomic_load_n(&step[s].calls, __ATOMIC_RELAXED);
+        long bytes = __atomic_load_n(&step[s].bytes, __ATOMIC_RELAXED);
+        long ns = __atomic_load_n(&step[s].ns, __ATOMIC_RELAXED);
+        if (calls) {
+            fprintf(out, "%s step %s: %ld buffers, %ld bytes in, "
+                    "%.1fns each, %.3fns/byte\n", what, step[s].name, calls,
+                    bytes, (double) ns / calls,
+                    bytes ? (double) ns / bytes : 0.0);
+        }
+    }
+}
+
+void transform_report(FILE *out) {
+    TransformPlan *plan = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    fprintf(out, "pipeline: %s (%d stages in %d passes%s%s)\n", plan->spec,
+            plan->stages, tunable_get(&fuse) ? plan->fusedSteps
+            : plan->singleSteps, tunable_get(&fuse) ? ", fused" : "",
+            tunable_get(&timing) ? ", timed" : "");
+    for (int s = 0; s < plan->stages; ++s) {
+        StageTally *t = &plan->tally[s];
+        if (plan->stage[s]->kind == STAGE_COUNT) {
+            fprintf(out, "stage %d count: %ld bytes, %ld lines\n", s,
+                    __atomic_load_n(&t->bytes, __ATOMIC_RELAXED),
+                    __atomic_load_n(&t->lines, __ATOMIC_RELAXED));
+        } else if (plan->stage[s]->kind == STAGE_CRC) {
+            fprintf(out, "stage %d crc32c: %ld buffers, sum %08lx\n", s,
+                    __atomic_load_n(&t->buffers, __ATOMIC_RELAXED),
+                    __atomic_load_n(&t->sum, __ATOMIC_RELAXED)
+                    & 0xffffffffL);
+        } else if (plan->stage[s]->kind == STAGE_UTF8) {
+            fprintf(out, "stage %d utf8upper: tables from %s, %zu bytes\n",
+                    s, utf8_source(), utf8_table_bytes());
+        }
+    }
+    report_steps(out, "fused", plan->fused, plan->fusedSteps);
+    report_steps(out, "single", plan->single, plan->singleSteps);
+    fprintf(out, "stages:");
+    for (const TransformStage *stage = stageTable; stage->name != NULL;
+            ++stage) {
+        fprintf(out, " %s", stage->name);
+    }
+    fprintf(out, "\n");
+}
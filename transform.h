@@ -0,0 +1,62 @@
+#ifndef TRANSFORM_H_
+#define TRANSFORM_H_
+/* vim: set filetype=c : */
+
+/* The echo pipeline: what's done to every buffer before it goes back,
+ * set with -X or "transform" on the control socket as stage names in
+ * order, comma-separated. The default is "upper", which is capitalise().
+ *
+ * Stages that change bytes (upper, lower, swap, rot13, printable,
+ * ascii) are fused when the pipeline is set: any run of them composes
+ * into one table giving each byte's replacement, or that it's dropped,
+ * which is applied in a single branchless pass. A run that comes out as
+ * plain upper-casing uses the vector capitalise() kernel instead.
+ * Stages that only look (count, crc32c) need the bytes as they are at
+ * their place in the pipeline, so buffers go through in TRANSFORM_BLOCK
+ * chunks, every step taking each chunk while it's still in L1.
+ *
+ * utf8upper upper-cases UTF-8 (utf8.h). A sequence cut off by the end of
+ * one read waits in the connection's TransformCarry for the rest, so
+ * buffers that go through transform_stream() need TRANSFORM_CARRY_MAX
+ * bytes of headroom in front for it to be put back.
+ *
+ * "set transform_timing 1" times each step. "set transform_fuse 0" runs
+ * every stage as a step of its own, to see each one's cost and what
+ * fusing saves.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "shared.h"
+
+#define TRANSFORM_MAX_STAGES 16
+#define TRANSFORM_SPEC_MAX 256
+#define TRANSFORM_BLOCK 4096 // bytes each step takes at a time
+#define TRANSFORM_DEFAULT "upper"
+#define TRANSFORM_CARRY_MAX 3 // most of a UTF-8 sequence a read can cut off
+
+/* the start of a sequence, waiting for the next read to finish it */
+typedef struct {
+    unsigned char len;
+    char bytes[TRANSFORM_CARRY_MAX];
+} TransformCarry;
+
+/* registers the tunables and sets the default pipeline */
+void transform_init(void);
+/* replaces the pipeline with spec, e.g. "printable,upper,count"
+ * returns NULL on success, or what was wrong with spec */
+const char *transform_configure(const char* spec);
+/* transform_apply() for one of a connection's reads: puts carry back in
+ * front of buffer, holds back any sequence the read cut off, and returns
+ * where the result starts, setting *len to its length */
+char *transform_stream(TransformCarry* carry, char* buffer, size_t* len);
+/* at EOF: what carry still holds, as it is, for the last reply; empties
+ * carry, leaving iov pointing into it
+ * returns how many of iov it used (0 or 1) */
+int transform_rest(TransformCarry* carry, struct iovec* iov);
+/* the pipeline, each stage's tallies, and each step's timing
+ * (transform_apply() itself is in shared.h, with capitalise()) */
+void transform_report(FILE* out);
+
+#endif
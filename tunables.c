@@ -0,0 +1,52 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tunables.h"
+
+static Tunable tunables[TUNABLES_MAX];
+static int tunableCount = 0;
+static pthread_mutex_t tunablesLock = PTHREAD_MUTEX_INITIALIZER;
+
+void tunable_register(const char *name, long *value, long min, long max,
+        const char *help) {
+    pthread_mutex_lock(&tunablesLock);
+    if (tunableCount == TUNABLES_MAX) {
+        fprintf(stderr, "Too many tunables\n");
+        exit(1);
+    }
+    Tunable *t = &tunables[tunableCount++];
+    t->name = name;
+    t->value = value;
+    t->min = min;
+    t->max = max;
+    t->help = help;
+    pthread_mutex_unlock(&tunablesLock);
+}
+
+int tunable_set(const char *name, long value) {
+    int result = -1;
+    pthread_mutex_lock(&tunablesLock);
+    for (int i = 0; i < tunableCount; ++i) {
+        if (!strcmp(tunables[i].name, name)) {
+            if (value < tunables[i].min || value > tunables[i].max) {
+                result = -2;
+            } else {
+                __atomic_store_n(tunables[i].value, value, __ATOMIC_RELAXED);
+                result = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tunablesLock);
+    return result;
+}
+
+void tunable_report(FILE *out) {
+    pthread_mutex_lock(&tunablesLock);
+    for (int i = 0; i < tunableCount; ++i) {
+        Tunable *t = &tunables[i];
+        fprintf(out, "%s = %ld [%ld..%ld] %s\n", t->name,
+                tunable_get(t->value), t->min, t->max, t->help);
+    }
+    pthread_mutex_unlock(&tunablesLock);
+}
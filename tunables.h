@@ -0,0 +1,35 @@
+#ifndef TUNABLES_H_
+#define TUNABLES_H_
+/* vim: set filetype=c : */
+
+/* Named knobs that admins can read and change while we run, with
+ * "set <name> <value>" on the control socket. Each is a long owned by
+ * the module that registers it; the data path reads it with
+ * tunable_get() and never takes a lock for it.
+ */
+
+#include <stdio.h>
+
+#define TUNABLES_MAX 64
+
+typedef struct {
+    const char *name;
+    long *value;
+    long min, max;
+    const char *help;
+} Tunable;
+
+/* makes *value settable under name, within [min, max]
+ * call at startup; the registry only ever grows */
+void tunable_register(const char *name, long *value, long min, long max,
+        const char *help);
+/* returns 0 on success, -1 for an unknown name, -2 if out of range */
+int tunable_set(const char *name, long value);
+/* a line per tunable: name, value, range and help */
+void tunable_report(FILE *out);
+
+static inline long tunable_get(long *value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+#endif
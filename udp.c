@@ -0,0 +1,176 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "udp.h"
+#include "histo.h"
+#include "logger.h"
+#include "handover.h"
+
+typedef struct {
+    int fd;
+    pthread_t thread;
+    ProgStats *ps;
+    // written by its thread only, read racily by admins
+    long datagrams;
+    uint64_t second; // of histo_now(): when thisSecond is counting
+    long thisSecond, lastSecond;
+} UdpSocket;
+
+static UdpSocket sockets[UDP_MAX_SOCKETS];
+static int socketCount = 0;
+
+/* counts n datagrams into s's per-second figures */
+static void udp_count(UdpSocket *s, int n, uint64_t now) {
+    uint64_t second = now / 1000000000;
+    if (second != s->second) {
+        long last = second == s->second + 1 ? s->thisSecond : 0;
+        __atomic_store_n(&s->lastSecond, last, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->thisSecond, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->second, second, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&s->thisSecond, s->thisSecond + n, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->datagrams, s->datagrams + n, __ATOMIC_RELAXED);
+}
+
+/* sends the first count replies, one sendmmsg at a time
+ * returns how many the kernel took; a reply it won't take is skipped */
+static int udp_send(UdpSocket *s, struct mmsghdr *out, int count,
+        long *bytes) {
+    int sent = 0, next = 0;
+    while (next < count) {
+        int n = sendmmsg(s->fd, out + next, count - next, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            log_msg(LOG_LEVEL_WARN, "Error sending datagram: %s",
+                    strerror(errno));
+            ++next; // sendmmsg stops at the first failure: skip it
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            *bytes += out[next + i].msg_len;
+        }
+        sent += n;
+        next += n;
+    }
+    return sent;
+}
+
+/* echoes datagrams on one socket, a batch at a time, forever */
+static void *udp_thread(void *arg) {
+    UdpSocket *s = (UdpSocket*) arg;
+    ProgStats *ps = s->ps;
+    char *buffer = malloc(UDP_BATCH * UDP_DATAGRAM_MAX);
+    struct mmsghdr in[UDP_BATCH], out[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in from[UDP_BATCH];
+
+    handover_join();
+    while (1) {
+        handover_checkpoint();
+        memset(in, 0, sizeof(in));
+        for (int i = 0; i < UDP_BATCH; ++i) {
+            iov[i].iov_base = buffer + i * UDP_DATAGRAM_MAX;
+            iov[i].iov_len = UDP_DATAGRAM_MAX;
+            in[i].msg_hdr.msg_name = &from[i];
+            in[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            in[i].msg_hdr.msg_iov = &iov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+        }
+        // waits for the first, then takes whatever else has arrived
+        int n = recvmmsg(s->fd, in, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno != EINTR) {
+                stats_add(ps, STAT_READ_ERRORS, 1);
+                log_msg(LOG_LEVEL_WARN, "Error receiving datagrams: %s",
+                        strerror(errno));
+            }
+            continue;
+        }
+        uint64_t readAt = histo_now();
+        long bytesIn = 0, bytesOut = 0;
+        int replies = 0;
+        for (int i = 0; i < n; ++i) {
+            bytesIn += in[i].msg_len;
+            if (in[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                continue; // we haven't got all of it to send back
+            }
+            iov[i].iov_len = transform_apply(iov[i].iov_base,
+                    in[i].msg_len);
+            out[replies].msg_hdr = in[i].msg_hdr;
+            out[replies].msg_hdr.msg_flags = 0;
+            ++replies;
+        }
+        int sent = udp_send(s, out, replies, &bytesOut);
+        uint64_t sentAt = histo_now();
+        for (int i = 0; i < sent; ++i) {
+            histo_record(HISTO_ECHO, sentAt - readAt);
+        }
+        stats_add(ps, STAT_DATAGRAMS_IN, n);
+        stats_add(ps, STAT_DATAGRAMS_OUT, sent);
+        stats_add(ps, STAT_DATAGRAM_DROPS, n - sent);
+        stats_add(ps, STAT_BYTES_IN, bytesIn);
+        stats_add(ps, STAT_BYTES_OUT, bytesOut);
+        udp_count(s, n, readAt);
+    }
+    free(buffer);
+    return NULL;
+}
+
+void udp_begin(int fd, ProgStats *ps) {
+    if (socketCount == UDP_MAX_SOCKETS) {
+        fprintf(stderr, "Too many datagram sockets\n");
+        exit(1);
+    }
+    UdpSocket *s = &sockets[socketCount];
+    s->fd = fd;
+    s->ps = ps;
+    if (pthread_create(&s->thread, NULL, udp_thread, (void*) s)) {
+        fprintf(stderr, "Error starting datagram thread\n");
+        exit(1);
+    }
+    pthread_detach(s->thread);
+    ++socketCount;
+}
+
+int udp_socket_count(void) {
+    return socketCount;
+}
+
+int udp_socket_fd(int i) {
+    return sockets[i].fd;
+}
+
+/* what s counted in the last whole second, if it's still recent */
+static long udp_socket_rate(UdpSocket *s, uint64_t second) {
+    uint64_t at = __atomic_load_n(&s->second, __ATOMIC_ACQUIRE);
+    if (at == second) {
+        return __atomic_load_n(&s->lastSecond, __ATOMIC_RELAXED);
+    }
+    if (at + 1 == second) {
+        return __atomic_load_n(&s->thisSecond, __ATOMIC_RELAXED);
+    }
+    return 0; // nothing since
+}
+
+long udp_rate(void) {
+    uint64_t second = histo_now() / 1000000000;
+    long rate = 0;
+    for (int i = 0; i < socketCount; ++i) {
+        rate += udp_socket_rate(&sockets[i], second);
+    }
+    return rate;
+}
+
+void udp_report(FILE *out) {
+    uint64_t second = histo_now() / 1000000000;
+    for (int i = 0; i < socketCount; ++i) {
+        UdpSocket *s = &sockets[i];
+        fprintf(out, "datagram socket %d: fd %d, %ld received, %ld/s\n", i,
+                s->fd, __atomic_load_n(&s->datagrams, __ATOMIC_RELAXED),
+                udp_socket_rate(s, second));
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef UDP_H_
+#define UDP_H_
+/* vim: set filetype=c : */
+
+/* Datagram echo (-u): for clients whose messages each fit in a packet
+ * and don't need a connection. Every datagram is capitalised and sent
+ * straight back to whoever sent it.
+ *
+ * One thread per socket, taking up to UDP_BATCH datagrams per
+ * recvmmsg (blocking only for the first) and sending the replies with
+ * one sendmmsg, so a busy socket costs two syscalls per batch rather
+ * than two per packet. With -S there's a socket (and thread) per shard,
+ * all SO_REUSEPORT on the same port, for the kernel to spread senders
+ * over. Datagrams too big for a buffer, and replies the kernel won't
+ * take, are dropped and counted. The sockets go along in a handover.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "shared.h"
+
+#define UDP_BATCH 64 // datagrams per recvmmsg/sendmmsg
+#define UDP_DATAGRAM_MAX 4096 // bigger ones are dropped
+#define UDP_MAX_SOCKETS 256 // MAX_SHARDS
+
+/* starts a thread echoing datagrams on fd, a bound UDP socket */
+void udp_begin(int fd, ProgStats* ps);
+/* the sockets, for a handover */
+int udp_socket_count(void);
+int udp_socket_fd(int i);
+/* datagrams received over the last whole second, on every socket */
+long udp_rate(void);
+/* a line per socket */
+void udp_report(FILE* out);
+
+#endif
@@ -0,0 +1,671 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include "uring.h"
+#include "resolver.h"
+#include "logger.h"
+#include "slab.h"
+#include "station.h"
+#include "admission.h"
+#include "placement.h"
+
+#ifdef HAVE_URING
+
+/* what a completion is for: packed into the low bits of user_data */
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_TICK 4
+#define OP_CANCEL 5 // nothing to do when it completes
+#define OP_MASK 7
+
+#define SEND_NONE -1
+#define SEND_WELCOME -2
+#define SEND_CARRY -3 // at EOF, a UTF-8 sequence that never finished
+
+static const char welcome[] = "Welcome...\n";
+
+struct UringConn {
+    Conn base;
+    int recvArmed; // the multishot recv is still live
+    int sending; // buffer id in flight, SEND_WELCOME, SEND_CARRY or
+                 // SEND_NONE
+    unsigned welcomeOff;
+    int queueHead, queueTail; // buffer ids waiting to be sent, or -1
+    size_t queued; // bytes waiting, including what's being sent
+    int paused; // queued passed output_hwm: recv cancelled until it drains
+    int closing; // no more reading: flush what's queued then close
+    int starving; // on the loop's starved list
+    UringConn *starvedNext;
+    int throttled; // on the loop's throttled list: recv cancelled
+    UringConn *throttledNext;
+};
+
+static SlabPool connSlab = SLAB_POOL("uring conns", sizeof(UringConn));
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned toSubmit, unsigned minComplete,
+        unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+            flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+        unsigned nrArgs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/* maps the rings of a freshly set up io_uring into loop
+ * returns 0 on failure */
+static int uring_map(UringLoop *loop, struct io_uring_params *p) {
+    size_t sqSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    size_t cqSize = p->cq_off.cqes
+            + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, loop->ringFd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return 0;
+    }
+    char *cq = sq;
+    if (!(p->features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, loop->ringFd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return 0;
+        }
+    }
+    loop->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            loop->ringFd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        return 0;
+    }
+    loop->sqHead = (unsigned*) (sq + p->sq_off.head);
+    loop->sqTail = (unsigned*) (sq + p->sq_off.tail);
+    loop->sqMask = (unsigned*) (sq + p->sq_off.ring_mask);
+    loop->sqArray = (unsigned*) (sq + p->sq_off.array);
+    loop->sqEntries = p->sq_entries;
+    loop->sqLocalTail = *loop->sqTail;
+    loop->cqHead = (unsigned*) (cq + p->cq_off.head);
+    loop->cqTail = (unsigned*) (cq + p->cq_off.tail);
+    loop->cqMask = (unsigned*) (cq + p->cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe*) (cq + p->cq_off.cqes);
+    return 1;
+}
+
+/* hands a receive buffer (back) to the kernel */
+static void uring_recycle(UringLoop *loop, int bid) {
+    struct io_uring_buf *buf =
+            &loop->bufRing->bufs[loop->bufTail & (URING_BUFFERS - 1)];
+    buf->addr = (unsigned long) (loop->bufBase + bid * URING_BUFFER_SIZE
+            + URING_HEADROOM);
+    buf->len = URING_BUFFER_SIZE - URING_HEADROOM;
+    buf->bid = bid;
+    ++loop->bufTail;
+    __atomic_store_n(&loop->bufRing->tail, loop->bufTail, __ATOMIC_RELEASE);
+}
+
+/* registers the provided buffer ring (group 0) and fills it
+ * returns 0 if the kernel doesn't do buffer rings */
+static int uring_setup_buffers(UringLoop *loop) {
+    loop->bufRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->bufRing == MAP_FAILED) {
+        return 0;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) loop->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (uring_register(loop->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        munmap(loop->bufRing, URING_BUFFERS * sizeof(struct io_uring_buf));
+        return 0;
+    }
+    loop->bufBase = placement_alloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE,
+            loop->node);
+    loop->bufTail = 0;
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+        uring_recycle(loop, i);
+    }
+    return 1;
+}
+
+/* sets up a ring with everything the engine needs
+ * returns 0 (having cleaned up) if the kernel can't */
+static int uring_loop_init(UringLoop *loop) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    loop->ringFd = uring_setup(URING_ENTRIES, &p);
+    if (loop->ringFd < 0) {
+        return 0;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) || !uring_map(loop, &p)
+            || !uring_setup_buffers(loop)) {
+        close(loop->ringFd);
+        return 0;
+    }
+    loop->starved = NULL;
+    loop->throttled = NULL;
+    loop->acceptPaused = 0;
+    timeout_wheel_init(&loop->wheel);
+    loop->tick.tv_sec = 0;
+    loop->tick.tv_nsec = TIMEOUT_TICK_MS * 1000000L;
+    return 1;
+}
+
+int uring_supported(void) {
+    UringLoop *probe = calloc(1, sizeof(UringLoop));
+    int ok = uring_loop_init(probe);
+    if (ok) {
+        // the mappings go with the fd; the rest is small enough to leak
+        close(probe->ringFd);
+    }
+    free(probe);
+    return ok;
+}
+
+/* publishes prepared submissions and waits for at least wait completions */
+static void uring_submit(UringLoop *loop, unsigned wait) {
+    unsigned toSubmit = loop->sqLocalTail - *loop->sqTail;
+    __atomic_store_n(loop->sqTail, loop->sqLocalTail, __ATOMIC_RELEASE);
+    while (uring_enter(loop->ringFd, toSubmit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("Error entering io_uring");
+            exit(1);
+        }
+        // anything the kernel did take has been consumed from the sq
+        toSubmit = loop->sqLocalTail
+                - __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* a zeroed sqe to fill in, submitting early if the queue is full */
+static struct io_uring_sqe *uring_get_sqe(UringLoop *loop) {
+    while (loop->sqLocalTail - __atomic_load_n(loop->sqHead,
+            __ATOMIC_ACQUIRE) >= loop->sqEntries) {
+        uring_submit(loop, 0);
+    }
+    unsigned index = loop->sqLocalTail & *loop->sqMask;
+    struct io_uring_sqe *sqe = &loop->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sqArray[index] = index;
+    ++loop->sqLocalTail;
+    return sqe;
+}
+
+static void uring_arm_accept(UringLoop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->shard->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/* stops the multishot accept: it completes with -ECANCELED */
+static void uring_cancel_accept(UringLoop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = OP_ACCEPT;
+    sqe->user_data = OP_CANCEL;
+}
+
+/* wakes us after a tick whether or not there's anything else to do */
+static void uring_arm_tick(UringLoop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &loop->tick;
+    sqe->len = 1;
+    sqe->user_data = OP_TICK;
+}
+
+static void uring_arm_recv(UringLoop *loop, UringConn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->base.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uintptr_t) conn | OP_RECV;
+    conn->recvArmed = 1;
+}
+
+/* knocks out conn's multishot recv: it completes with -ECANCELED */
+static void uring_cancel_recv(UringLoop *loop, UringConn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) conn | OP_RECV;
+    sqe->user_data = OP_CANCEL;
+}
+
+/* sends the rest of whatever conn->sending refers to */
+static void uring_arm_send(UringLoop *loop, UringConn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->base.fd;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) conn | OP_SEND;
+    if (conn->sending == SEND_WELCOME) {
+        sqe->addr = (uintptr_t) (welcome + conn->welcomeOff);
+        sqe->len = sizeof(welcome) - 1 - conn->welcomeOff;
+    } else if (conn->sending == SEND_CARRY) {
+        sqe->addr = (uintptr_t) conn->base.carry.bytes;
+        sqe->len = conn->base.carry.len;
+    } else {
+        int bid = conn->sending;
+        sqe->addr = (uintptr_t) (loop->bufBase + bid * URING_BUFFER_SIZE
+                + loop->bufOff[bid]);
+        sqe->len = loop->bufLen[bid] - loop->bufOff[bid];
+    }
+}
+
+/* starts sending the next queued buffer, if there is one; once they've
+ * all gone after EOF, whatever's left in the carry goes as it is */
+static void uring_send_next(UringLoop *loop, UringConn *conn) {
+    conn->sending = conn->queueHead;
+    if (conn->sending == SEND_NONE) {
+        if (conn->closing && conn->base.carry.len) {
+            conn->sending = SEND_CARRY;
+            uring_arm_send(loop, conn);
+        }
+        return;
+    }
+    conn->queueHead = loop->bufNext[conn->sending];
+    if (conn->queueHead == SEND_NONE) {
+        conn->queueTail = SEND_NONE;
+    }
+    uring_arm_send(loop, conn);
+}
+
+/* queues len bytes from off in a received buffer to go back out, in
+ * order */
+static void uring_queue_send(UringLoop *loop, UringConn *conn, int bid,
+        unsigned off, unsigned len) {
+    loop->bufLen[bid] = off + len;
+    loop->bufOff[bid] = off;
+    loop->bufNext[bid] = SEND_NONE;
+    if (conn->queueTail == SEND_NONE) {
+        conn->queueHead = bid;
+    } else {
+        loop->bufNext[conn->queueTail] = bid;
+    }
+    conn->queueTail = bid;
+    conn->queued += len;
+    if (!conn->paused && conn->queued >= outq_hwm()) {
+        // they're not keeping up: stop taking buffers for them
+        conn->paused = 1;
+        stats_add(loop->shard->progStats, STAT_OUTPUT_PAUSES, 1);
+        if (conn->recvArmed) {
+            uring_cancel_recv(loop, conn);
+        }
+    }
+    if (conn->sending == SEND_NONE) {
+        uring_send_next(loop, conn);
+    }
+}
+
+/* whether conn wants its recv armed again */
+static int uring_wants_recv(UringConn *conn) {
+    return !conn->recvArmed && !conn->closing && !conn->paused
+            && !conn->starving && !conn->throttled;
+}
+
+/* frees conn once the kernel holds nothing of it and nothing is queued */
+static void uring_maybe_close(UringLoop *loop, UringConn *conn) {
+    if (!conn->closing || conn->recvArmed || conn->sending != SEND_NONE
+            || conn->starving || conn->throttled) {
+        return;
+    }
+    timer_cancel(&loop->wheel, &conn->base.timer);
+    conn_unregister(&conn->base);
+    throttle_stop(&conn->base.throttle);
+    close(conn->base.fd);
+    log_msg(LOG_LEVEL_INFO, "Done");
+    user_count_out(loop->shard);
+    histo_record(HISTO_LIFETIME, histo_now() - conn->base.acceptedAt);
+    slab_free(&connSlab, conn);
+}
+
+/* stops reading from conn; anything still queued gets sent first
+ * unless the connection is broken, in which case it's dropped */
+static void uring_start_closing(UringLoop *loop, UringConn *conn,
+        int broken) {
+    conn->closing = 1;
+    if (broken) {
+        while (conn->queueHead != SEND_NONE) {
+            int bid = conn->queueHead;
+            conn->queueHead = loop->bufNext[bid];
+            uring_recycle(loop, bid);
+        }
+        conn->queueTail = SEND_NONE;
+        conn->base.carry.len = 0;
+        // knocks the multishot recv out, if it's still armed
+        shutdown(conn->base.fd, SHUT_RDWR);
+    } else if (conn->sending == SEND_NONE) {
+        uring_send_next(loop, conn); // the carry, if there's one
+    }
+}
+
+/* a new client off the multishot accept */
+static void uring_on_accept(UringLoop *loop, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !loop->acceptPaused) {
+        uring_arm_accept(loop);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            log_msg(LOG_LEVEL_ERROR, "Error accepting connection: %s",
+                    strerror(-cqe->res));
+        }
+        return;
+    }
+    uint64_t acceptedAt = histo_now();
+    // it's in by the time we hear of it: the most we can do is stop
+    // accepting any more, until a tick finds us back under the limits
+    AdmitVerdict verdict = admission_check(user_current(), 0);
+    if (verdict != ADMIT_OK) {
+        admission_reject(cqe->res, verdict, loop->shard->progStats);
+        if (admission_pausing() && !loop->acceptPaused) {
+            loop->acceptPaused = 1;
+            stats_add(loop->shard->progStats, STAT_ACCEPT_PAUSES, 1);
+            uring_cancel_accept(loop);
+        }
+        return;
+    }
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrSize = sizeof(fromAddr);
+    if (getpeername(cqe->res, (struct sockaddr*) &fromAddr, &fromAddrSize)) {
+        close(cqe->res);
+        return;
+    }
+    if (conn_local_peer(&fromAddr)) {
+        stats_add(loop->shard->progStats, STAT_LOCAL_USERS, 1);
+    }
+    resolver_log_accept(&fromAddr, loop->shard->id);
+    user_count_in(loop->shard);
+
+    UringConn *conn = slab_zalloc(&connSlab);
+    conn_init(&conn->base, cqe->res, loop->shard->id, &fromAddr, acceptedAt);
+    conn_register(&conn->base);
+    timeout_arm(&loop->wheel, &conn->base);
+    conn->queueHead = conn->queueTail = SEND_NONE;
+    conn->sending = SEND_WELCOME;
+    uring_arm_send(loop, conn);
+    uring_arm_recv(loop, conn);
+}
+
+static void uring_on_recv(UringLoop *loop, UringConn *conn,
+        struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recvArmed = 0;
+    }
+    if (cqe->res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        stats_add(loop->shard->progStats, STAT_BYTES_IN, cqe->res);
+        conn_add_in(&conn->base, cqe->res);
+        conn_note_read(&conn->base, histo_now());
+        if (conn->closing) {
+            uring_recycle(loop, bid); // broken: nowhere to send it
+            uring_maybe_close(loop, conn);
+            return;
+        }
+        uint64_t readAt = loop->bufReadAt[bid] = histo_now();
+        char *base = loop->bufBase + bid * URING_BUFFER_SIZE;
+        size_t len = cqe->res;
+        struct iovec echo = {transform_stream(&conn->base.carry,
+                base + URING_HEADROOM, &len), len};
+        station_forward(&conn->base, &echo, 1);
+        if (echo.iov_len) {
+            uring_queue_send(loop, conn, bid, (char*) echo.iov_base - base,
+                    echo.iov_len);
+        } else {
+            uring_recycle(loop, bid); // the pipeline dropped all of it
+        }
+        if (throttle_charge(&conn->base.throttle, conn->base.peer.sin_addr,
+                loop->shard->progStats, cqe->res, readAt)
+                && !conn->throttled) {
+            // a tick after it runs out starts us reading again
+            conn->throttled = 1;
+            conn->throttledNext = loop->throttled;
+            loop->throttled = conn;
+            if (conn->recvArmed) {
+                uring_cancel_recv(loop, conn);
+            }
+        }
+        if (uring_wants_recv(conn)) {
+            uring_arm_recv(loop, conn);
+        }
+    } else if (cqe->res == -ENOBUFS) {
+        // every buffer is waiting to be sent; pick up again when one is
+        if (!conn->recvArmed && !conn->closing) {
+            conn->starving = 1;
+            conn->starvedNext = loop->starved;
+            loop->starved = conn;
+        }
+    } else if (cqe->res == -ECANCELED && !conn->closing) {
+        // paused; or paused and let go again before this arrived
+        if (uring_wants_recv(conn)) {
+            uring_arm_recv(loop, conn);
+        }
+    } else if (!conn->recvArmed) {
+        // EOF, or an error
+        if (cqe->res < 0) {
+            stats_add(loop->shard->progStats, STAT_READ_ERRORS, 1);
+        }
+        if (cqe->res < 0 && cqe->res != -ECONNRESET) {
+            log_msg(LOG_LEVEL_WARN, "Error reading from socket: %s",
+                    strerror(-cqe->res));
+        }
+        uring_start_closing(loop, conn, cqe->res < 0);
+    }
+    uring_maybe_close(loop, conn);
+}
+
+static void uring_on_send(UringLoop *loop, UringConn *conn,
+        struct io_uring_cqe *cqe) {
+    int bid = conn->sending;
+    if (cqe->res < 0) {
+        stats_add(loop->shard->progStats, STAT_WRITE_ERRORS, 1);
+        if (bid >= 0) {
+            uring_recycle(loop, bid);
+        }
+        conn->sending = SEND_NONE;
+        uring_start_closing(loop, conn, 1);
+        uring_maybe_close(loop, conn);
+        return;
+    }
+    if (bid == SEND_WELCOME) {
+        conn->welcomeOff += cqe->res;
+        if (conn->welcomeOff < sizeof(welcome) - 1) {
+            uring_arm_send(loop, conn);
+            return;
+        }
+        histo_record(HISTO_ACCEPT_WELCOME, histo_now() - conn->base.acceptedAt);
+    } else if (bid == SEND_CARRY) {
+        TransformCarry *carry = &conn->base.carry;
+        stats_add(loop->shard->progStats, STAT_BYTES_OUT, cqe->res);
+        conn_add_out(&conn->base, cqe->res);
+        carry->len -= cqe->res;
+        memmove(carry->bytes, carry->bytes + cqe->res, carry->len);
+        if (carry->len) {
+            uring_arm_send(loop, conn);
+            return;
+        }
+    } else {
+        stats_add(loop->shard->progStats, STAT_BYTES_OUT, cqe->res);
+        conn_add_out(&conn->base, cqe->res);
+        loop->bufOff[bid] += cqe->res;
+        conn->queued -= cqe->res;
+        if (loop->bufOff[bid] < loop->bufLen[bid]) {
+            uring_arm_send(loop, conn); // short send: the rest, in order
+            return;
+        }
+        histo_record(HISTO_ECHO, histo_now() - loop->bufReadAt[bid]);
+        uring_recycle(loop, bid);
+        if (conn->paused && conn->queued <= outq_lwm()) {
+            conn->paused = 0;
+            if (uring_wants_recv(conn)) {
+                uring_arm_recv(loop, conn);
+            }
+        }
+    }
+    uring_send_next(loop, conn);
+    uring_maybe_close(loop, conn);
+}
+
+/* rearms anyone who ran dry now that there are buffers again */
+static void uring_feed_starved(UringLoop *loop) {
+    while (loop->starved != NULL) {
+        UringConn *conn = loop->starved;
+        loop->starved = conn->starvedNext;
+        conn->starving = 0;
+        if (conn->closing) {
+            uring_maybe_close(loop, conn);
+        } else if (uring_wants_recv(conn)) {
+            uring_arm_recv(loop, conn);
+        }
+    }
+}
+
+/* rearms whoever's waited out their rate limit */
+static void uring_resume(UringLoop *loop, uint64_t now) {
+    UringConn **link = &loop->throttled;
+    while (*link != NULL) {
+        UringConn *conn = *link;
+        if (conn->base.throttle.until > now && !conn->closing) {
+            link = &conn->throttledNext;
+            continue;
+        }
+        *link = conn->throttledNext;
+        conn->throttled = 0;
+        if (conn->closing) {
+            uring_maybe_close(loop, conn);
+        } else if (uring_wants_recv(conn)) {
+            uring_arm_recv(loop, conn);
+        }
+    }
+}
+
+/* closes whoever's run out of time; rearms the rest, and the tick */
+static void uring_on_tick(UringLoop *loop) {
+    uint64_t now = histo_now();
+    uring_resume(loop, now);
+    if (loop->acceptPaused && (!admission_pausing()
+            || admission_check(user_current(), 0) == ADMIT_OK)) {
+        loop->acceptPaused = 0;
+        uring_arm_accept(loop);
+    }
+    Timer *timer = timer_advance(&loop->wheel, now);
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        UringConn *conn = (UringConn*) timeout_conn(timer);
+        TimeoutKind kind = timeout_check(&conn->base, now);
+        if (conn->closing) {
+            // on its way out anyway
+        } else if (kind == TIMEOUT_NONE) {
+            timeout_arm(&loop->wheel, &conn->base);
+        } else {
+            timeout_expired(loop->shard->progStats, &conn->base, kind);
+            uring_start_closing(loop, conn, 1);
+            uring_maybe_close(loop, conn);
+        }
+        timer = next;
+    }
+    uring_arm_tick(loop);
+}
+
+/* reaps completions and submits whatever they lead to, forever */
+void* uring_thread(void* arg) {
+    UringLoop *loop = (UringLoop*) arg;
+    uring_arm_accept(loop);
+    uring_arm_tick(loop);
+    while (1) {
+        uring_submit(loop, 1);
+        unsigned head = *loop->cqHead;
+        unsigned tail = __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE);
+        int hadSends = 0;
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &loop->cqes[head & *loop->cqMask];
+            UringConn *conn = (UringConn*) (uintptr_t)
+                    (cqe->user_data & ~(uint64_t) OP_MASK);
+            switch (cqe->user_data & OP_MASK) {
+                case OP_ACCEPT:
+                    uring_on_accept(loop, cqe);
+                    break;
+                case OP_RECV:
+                    uring_on_recv(loop, conn, cqe);
+                    break;
+                case OP_SEND:
+                    uring_on_send(loop, conn, cqe);
+                    hadSends = 1;
+                    break;
+                case OP_TICK:
+                    uring_on_tick(loop);
+                    break;
+                case OP_CANCEL:
+                    break;
+            }
+        }
+        __atomic_store_n(loop->cqHead, head, __ATOMIC_RELEASE);
+        if (hadSends) {
+            uring_feed_starved(loop);
+        }
+    }
+    return NULL;
+}
+
+UringGroup* uring_group_create(int count, UserShard* shard) {
+    UringGroup *group = malloc(sizeof(UringGroup));
+    group->count = count;
+    group->loops = calloc(count, sizeof(UringLoop));
+    for (int i = 0; i < count; ++i) {
+        UringLoop *loop = &group->loops[i];
+        loop->id = i;
+        loop->shard = shard;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        int slot = placement_prepare(&attr, "io_uring loop", shard->id, i);
+        loop->node = placement_node(slot); // its buffers go there too
+        if (!uring_loop_init(loop)) {
+            perror("Error setting up io_uring");
+            exit(1);
+        }
+        if (pthread_create(&loop->thread, &attr, uring_thread, (void*) loop)) {
+            fprintf(stderr, "Error starting io_uring thread\n");
+            exit(1);
+        }
+        placement_started(slot, loop->thread);
+        pthread_attr_destroy(&attr);
+        pthread_detach(loop->thread);
+    }
+    return group;
+}
+
+#else
+
+int uring_supported(void) {
+    return 0;
+}
+
+UringGroup* uring_group_create(int count, UserShard* shard) {
+    fprintf(stderr, "Built without io_uring support\n");
+    exit(1);
+}
+
+void* uring_thread(void* arg) {
+    return NULL;
+}
+
+#endif
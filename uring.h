@@ -0,0 +1,96 @@
+#ifndef URING_H_
+#define URING_H_
+/* vim: set filetype=c : */
+
+/* The io_uring engine, driven through the raw syscalls (no liburing).
+ * Each loop thread owns a ring which does everything for its shard:
+ * a multishot accept on the listener, a multishot recv per client
+ * drawing from a provided buffer ring, and sends queued up behind it.
+ * New submissions are batched into one io_uring_enter per pass over the
+ * completion queue.
+ * A client with output_hwm bytes waiting to go back has its recv
+ * cancelled until half of that's gone.
+ *
+ * It's compiled in when the system headers are new enough; otherwise,
+ * or if the running kernel refuses it, uring_supported() says no and
+ * the caller falls back to the epoll engine.
+ */
+
+#include <pthread.h>
+#include "shared.h"
+#include "histo.h"
+#include "conn.h"
+#include "timeout.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT // the newest thing we rely on
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
+#define URING_ENTRIES 1024 // submission queue size; cq is double
+#define URING_BUFFERS 512 // provided receive buffers per ring (power of 2)
+#define URING_BUFFER_SIZE 4096
+#define URING_HEADROOM 8 // in front of what's received, for its carry
+
+typedef struct UringConn UringConn;
+
+#ifdef HAVE_URING
+/* one ring and the thread that reaps it */
+typedef struct {
+    int ringFd;
+    int id;
+    pthread_t thread;
+    UserShard* shard; // whose listener we accept from
+
+    // submission queue: shared with the kernel
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail; // prepared, not yet published
+    struct io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // provided buffers the kernel picks receive buffers from
+    struct io_uring_buf_ring *bufRing;
+    char *bufBase;
+    int node; // placement's node for bufBase, or -1 for this thread's
+    unsigned short bufTail;
+    // queued sends are chained through their buffer ids
+    int bufNext[URING_BUFFERS];
+    unsigned bufLen[URING_BUFFERS], bufOff[URING_BUFFERS];
+    uint64_t bufReadAt[URING_BUFFERS]; // when its data was received
+
+    UringConn *starved; // clients whose recv ran out of buffers
+    UringConn *throttled; // waiting out a rate limit, until a tick
+    int acceptPaused; // over an admission limit: accept cancelled
+
+    // connection timeouts, advanced by a ticking IORING_OP_TIMEOUT
+    TimerWheel wheel;
+    struct __kernel_timespec tick;
+} UringLoop;
+#else
+typedef struct {
+    int id;
+} UringLoop;
+#endif
+
+/* the loops serving one shard */
+typedef struct {
+    int count;
+    UringLoop* loops;
+} UringGroup;
+
+/* whether this kernel (and build) can run the engine */
+int uring_supported(void);
+/* sets up count rings accepting from shard's listener and starts their
+ * threads; exits the program on failure */
+UringGroup* uring_group_create(int count, UserShard* shard);
+/* body of a ring thread; arg is its UringLoop */
+void* uring_thread(void*);
+
+#endif
@@ -1,4 +1,13 @@
 #include "user.h"
+#include "admin.h"
+
+static UserShard shards[MAX_SHARDS];
+static int shardCount = 0;
+static WorkerPool *pool = NULL; // pool engine only: every shard shares it
+static UserMasterThreadArgs *masters[MAX_SHARDS]; // each shard's engine
+static int uringInUse = 0;
+// the blocking engines' per-user state
+static SlabPool argsSlab = SLAB_POOL("blocking conns", sizeof(UserThreadArgs));
 
 /* takes a hostname or IP, returns IP as an in_addr */
 struct in_addr *name_to_ip_addr(char *hostname)
@@ -13,17 +22,16 @@ struct in_addr *name_to_ip_addr(char *hostname)
     return &(((struct sockaddr_in*)(addressInfo->ai_addr))->sin_addr);
 }
 
-/* returns the file descriptor opened
+/* returns a socket of the given type bound to port on interface
  * if port is 0, an ephemeral port will be used and assigned to port
- * prints the port to stdout as per spec
  */
-int user_open_listen(int *port, char *interface) {
+static int user_bind(int type, int *port, char *interface, int reusePort) {
     int fd;
     struct sockaddr_in serverAddr;
     int optVal;
 
-    // Create IPv4 TCP socket
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    // Create IPv4 socket: TCP for users, UDP for datagrams
+    fd = socket(AF_INET, type, 0);
     if(fd < 0) {
         perror("Error creating socket");
         exit(1);
@@ -35,6 +43,12 @@ int user_open_listen(int *port, char *interface) {
         perror("Error setting socket option");
         exit(1);
     }
+    // Let every shard bind the same address; the kernel balances between them
+    if(reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optVal, 
+            sizeof(int)) < 0) {
+        perror("Error setting SO_REUSEPORT");
+        exit(1);
+    }
 
     // Set up address structure for the server address
     // Request port (incl. ephemeral), request interface if specified
@@ -58,15 +72,7 @@ int user_open_listen(int *port, char *interface) {
         exit(1);
     }
 
-    // Indicate we're ready to accept connections on that socket
-    // SOMAXCONN is max num of connection requests to be queued by the
-    // OS (default 128)
-    if(listen(fd, SOMAXCONN) < 0) {
-        perror("Error listening");
-        exit(1);
-    }
-
-    // read and print assigned port using getaddrinfo
+    // read the assigned port back
     struct sockaddr_in info;
     socklen_t len = sizeof(info);
     // populate the info struct
@@ -75,110 +81,550 @@ int user_open_listen(int *port, char *interface) {
         exit(1);
     }
     *port = ntohs(info.sin_port);
+    return fd;
+}
+
+/* returns the file descriptor opened
+ * if port is 0, an ephemeral port will be used and assigned to port
+ * prints the port to stdout as per spec
+ */
+int user_open_listen(int *port, char *interface, int reusePort) {
+    int fd = user_bind(SOCK_STREAM, port, interface, reusePort);
+
+    // Indicate we're ready to accept connections on that socket
+    // SOMAXCONN is max num of connection requests to be queued by the
+    // OS (default 128)
+    if(listen(fd, SOMAXCONN) < 0) {
+        perror("Error listening");
+        exit(1);
+    }
+
     printf("Listening on port %d on interface %s\n", *port, 
             interface ? interface : "INADDR_ANY");
 
     return fd;
 }
 
+/* the same for datagram echo: a bound UDP socket, for udp_begin */
+int user_open_datagram(int *port, char *interface, int reusePort) {
+    int fd = user_bind(SOCK_DGRAM, port, interface, reusePort);
+    printf("Echoing datagrams on port %d on interface %s\n", *port,
+            interface ? interface : "INADDR_ANY");
+    return fd;
+}
+
+/* a listener for local users (-U), on the control socket's binding code;
+ * it's served like any other shard */
+int user_open_unix(char *path) {
+    int fd = bind_unix_socket(path, "user socket");
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("Error listening");
+        exit(1);
+    }
+    return fd;
+}
+
 /* handles a single incoming connection 
  * arg is an instance of UserThreadArgs on the heap */
 void* user_client_thread(void* arg)
+{
+    user_serve(arg);
+    pthread_exit(NULL);	// Redundant
+    return NULL;
+}
+
+/* sends all of count buffers; if a handover's SIGUSR1 interrupts, what's
+ * left goes on out instead, for user_send_queued to send once we've been
+ * to a checkpoint (a client that's stopped reading mustn't hold it up)
+ * returns how much was sent, or -1 on error */
+static ssize_t user_send_all(int fd, OutQueue *out, struct iovec *iov,
+        int count) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    size_t sent = 0;
+    while (msg.msg_iovlen) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                outq_push_iov(out, msg.msg_iov, msg.msg_iovlen, 0);
+                break;
+            }
+            return -1;
+        }
+        sent += n;
+        while (msg.msg_iovlen && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return sent;
+}
+
+/* sends whatever's queued for args, stopping at a checkpoint before each
+ * try: a handover takes the queue with the user
+ * returns 0 on error */
+static int user_send_queued(UserThreadArgs *args) {
+    ProgStats *ps = args->shard->progStats;
+    while (args->base.out.bytes) {
+        handover_checkpoint();
+        ssize_t n = outq_flush(&args->base.out, args->base.fd);
+        if (n < 0 && errno != EINTR) {
+            return 0;
+        }
+        if (n > 0) {
+            stats_add(ps, STAT_BYTES_OUT, n);
+            conn_add_out(&args->base, n);
+        }
+    }
+    return 1;
+}
+
+/* sends count buffers back, then (in line mode) lets go of the lines
+ * they were in, then sends anything a handover's poke left queued
+ * returns how much went straight out, or -1 on error */
+static ssize_t user_reply(UserThreadArgs *args, struct iovec *iov,
+        int count) {
+    ssize_t sent = user_send_all(args->base.fd, &args->base.out, iov, count);
+    if (args->base.lines.buf != NULL) {
+        line_release(&args->base.lines); // sent, or copied onto out
+    }
+    return sent < 0 || !user_send_queued(args) ? -1 : sent;
+}
+
+/* echoes what was just read: all of it, or in line mode, the lines it
+ * finished
+ * returns how much was sent, or -1 on error */
+static ssize_t user_echo(UserThreadArgs *args, char *buffer, size_t len) {
+    ProgStats *ps = args->shard->progStats;
+    LineReader *lines = &args->base.lines;
+    struct iovec iov[LINES_IOV];
+    if (lines->buf == NULL) {
+        iov[0].iov_base = transform_stream(&args->base.carry, buffer, &len);
+        iov[0].iov_len = len;
+        station_forward(&args->base, iov, 1);
+        return user_reply(args, iov, 1);
+    }
+    long lineCount, tooLong;
+    int count = line_take(lines, len, iov, &lineCount, &tooLong);
+    stats_add(ps, STAT_LINES, lineCount);
+    stats_add(ps, STAT_LONG_LINES, tooLong);
+    station_forward(&args->base, iov, count);
+    return user_reply(args, iov, count);
+}
+
+/* pool engine: hands the worker to a user waiting for one, putting args
+ * back on the pool behind them; does nothing if nobody's waiting (or
+ * there's no room)
+ * returns 1 if args went back, and is no longer ours to touch */
+static int user_requeue(UserThreadArgs *args) {
+    if (pool == NULL
+            || __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) <= 0) {
+        return 0;
+    }
+    ProgStats *ps = args->shard->progStats;
+    handover_leave();
+    if (pool_submit(pool, user_serve, args)) {
+        handover_join();
+        return 0;
+    }
+    stats_add(ps, STAT_FAIR_YIELDS, 1);
+    return 1;
+}
+
+/* waits out a rate limit; in the pool, the worker first goes to anyone
+ * waiting for one, and the user waits in the queue instead
+ * returns 0 if args went back to the pool */
+static int user_hold(UserThreadArgs *args) {
+    if (!args->requeued) {
+        args->requeued = 1;
+        if (user_requeue(args)) {
+            return 0;
+        }
+    }
+    uint64_t until = args->base.throttle.until, now;
+    while ((now = histo_now()) < until) {
+        handover_checkpoint();
+        uint64_t nap = until - now;
+        if (nap > TIMEOUT_TICK_MS * 1000000ULL) {
+            nap = TIMEOUT_TICK_MS * 1000000ULL; // timeouts, handovers
+        }
+        struct timespec ts = {nap / 1000000000, nap % 1000000000};
+        nanosleep(&ts, NULL);
+    }
+    args->requeued = 0;
+    return 1;
+}
+
+/* the body of user_client_thread: reads and echoes until the user goes
+ * arg is an instance of UserThreadArgs from argsSlab, freed here
+ * the user was counted in and registered by whoever handed it over
+ * in the pool it may instead go back on the queue part way through, for
+ * fairness, and carry on where it left off when a worker picks it up */
+void user_serve(void* arg)
 {
     int fd;
-    char buffer[1024];
-    ssize_t numBytesRead;
+    // room in front for a sequence the last read cut off
+    char room[TRANSFORM_CARRY_MAX + 1024], *buffer = room + TRANSFORM_CARRY_MAX;
+    ssize_t numBytesRead, numBytesWritten;
+    struct iovec space[LINES_IOV];
+    size_t turn = 0, quantum = throttle_quantum(); // bytes this turn
 
     UserThreadArgs *myArgs = (UserThreadArgs*) arg;
-    pthread_mutex_lock(&myArgs->progStats->currentUsersLock);
-    myArgs->progStats->currentUsers++;
-    pthread_mutex_unlock(&myArgs->progStats->currentUsersLock);
-    fd = myArgs->fd;
+    ProgStats *ps = myArgs->shard->progStats;
+    fd = myArgs->base.fd;
+    handover_join();
+    numBytesRead = 0;
+    int sending = user_send_queued(myArgs);
+    if (!sending) {
+        stats_add(ps, STAT_WRITE_ERRORS, 1);
+    }
     // Repeatedly read from connected fd, capitalise text and send
     // it back
-    while((numBytesRead = read(fd, buffer, 1024)) > 0) {
-	capitalise(buffer, numBytesRead);
-	write(fd, buffer, numBytesRead);
+    while (sending) {
+        handover_checkpoint();
+        if (myArgs->base.throttle.until > histo_now() && !user_hold(myArgs)) {
+            return;
+        }
+        if (myArgs->base.lines.buf != NULL) {
+            numBytesRead = readv(fd, space,
+                    line_space(&myArgs->base.lines, space));
+        } else {
+            numBytesRead = read(fd, buffer, 1024);
+        }
+        if (numBytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (numBytesRead <= 0) {
+            break;
+        }
+        uint64_t readAt = histo_now();
+        stats_add(ps, STAT_BYTES_IN, numBytesRead);
+        conn_add_in(&myArgs->base, numBytesRead);
+        conn_note_read(&myArgs->base, readAt);
+        numBytesWritten = user_echo(myArgs, buffer, numBytesRead);
+        if (numBytesWritten < 0) {
+            stats_add(ps, STAT_WRITE_ERRORS, 1);
+            break;
+        }
+        stats_add(ps, STAT_BYTES_OUT, numBytesWritten);
+        conn_add_out(&myArgs->base, numBytesWritten);
+        histo_record(HISTO_ECHO, histo_now() - readAt);
+        turn += numBytesRead;
+        if (!throttle_charge(&myArgs->base.throttle,
+                myArgs->base.peer.sin_addr, ps, numBytesRead, readAt)
+                && quantum && turn >= quantum && user_requeue(myArgs)) {
+            return; // had our turn, and someone's waiting for one
+        }
     }
     // Get here if EOF (client disconnected) or error
+    int count;
+    if (sending && numBytesRead == 0
+            && ((count = line_rest(&myArgs->base.lines, space))
+            || (count = transform_rest(&myArgs->base.carry, space)))) {
+        // the last line never ended, or the input stopped part way
+        // through a UTF-8 sequence: it goes back as it is
+        numBytesWritten = user_reply(myArgs, space, count);
+        if (numBytesWritten < 0) {
+            stats_add(ps, STAT_WRITE_ERRORS, 1);
+        } else {
+            stats_add(ps, STAT_BYTES_OUT, numBytesWritten);
+            conn_add_out(&myArgs->base, numBytesWritten);
+        }
+    }
 
     if(numBytesRead < 0) {
-	perror("Error reading from socket");
-	exit(1);
+        // counted rather than fatal: one client's reset is its own problem
+        stats_add(ps, STAT_READ_ERRORS, 1);
+        log_msg(LOG_LEVEL_WARN, "Error reading from socket: %s",
+                strerror(errno));
     }
-    // print a message to server's stdout
-    printf("Done\n");
-    fflush(stdout);
+    log_msg(LOG_LEVEL_INFO, "Done");
     // Close the connection to the client
+    timeout_unwatch(&myArgs->base);
+    conn_unregister(&myArgs->base);
+    outq_clear(&myArgs->base.out);
+    line_stop(&myArgs->base.lines);
+    throttle_stop(&myArgs->base.throttle);
     close(fd);
 
     // decrement connected users
-    pthread_mutex_lock(&myArgs->progStats->currentUsersLock);
-    myArgs->progStats->currentUsers--;
-    pthread_mutex_unlock(&myArgs->progStats->currentUsersLock);
+    user_count_out(myArgs->shard);
+    histo_record(HISTO_LIFETIME, histo_now() - myArgs->base.acceptedAt);
+    handover_leave();
 
-    free(myArgs);
-    pthread_exit(NULL);	// Redundant
-    return NULL;
+    slab_free(&argsSlab, myArgs);
+}
+
+/* turns "threads", "epoll", "uring" or "pool" into a UserEngine,
+ * or returns -1 */
+int user_parse_engine(const char *name) {
+    if (!strcmp(name, "threads")) {
+        return ENGINE_THREADS;
+    }
+    if (!strcmp(name, "epoll")) {
+        return ENGINE_EPOLL;
+    }
+    if (!strcmp(name, "uring")) {
+        return ENGINE_URING;
+    }
+    if (!strcmp(name, "pool")) {
+        return ENGINE_POOL;
+    }
+    return -1;
+}
+
+/* count a user in or out, both in its shard and in ProgStats */
+void user_count_in(UserShard *shard) {
+    __atomic_fetch_add(&shard->accepted, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->currentUsers, 1, __ATOMIC_RELAXED);
+    stats_user_in(shard->progStats);
+}
+
+void user_count_out(UserShard *shard) {
+    __atomic_fetch_sub(&shard->currentUsers, 1, __ATOMIC_RELAXED);
+    stats_user_out(shard->progStats);
+}
+
+long user_current(void) {
+    long users = 0;
+    for (int i = 0; i < shardCount; ++i) {
+        users += __atomic_load_n(&shards[i].currentUsers, __ATOMIC_RELAXED);
+    }
+    return users;
+}
+
+/* whether another user may come in; see admission_check */
+static AdmitVerdict user_admission(void) {
+    long queued = 0;
+    if (pool != NULL) {
+        queued = __atomic_load_n(&pool->pending, __ATOMIC_RELAXED);
+    }
+    return admission_check(user_current(), queued);
+}
+
+/* writes a line per shard with its connection counts */
+void user_report_shards(FILE *out) {
+    for (int i = 0; i < shardCount; ++i) {
+        fprintf(out, "shard %d: %ld users now, %ld accepted\n", shards[i].id,
+                __atomic_load_n(&shards[i].currentUsers, __ATOMIC_RELAXED),
+                __atomic_load_n(&shards[i].accepted, __ATOMIC_RELAXED));
+    }
+}
+
+UserShard *user_shard(int id) {
+    return &shards[id];
+}
+
+int user_shard_count(void) {
+    return shardCount;
+}
+
+int user_handover_ok(void) {
+    return !uringInUse;
 }
 
-/* spawns a thread to do user_process_connections
+/* a handed-over shard has the old one's counts, less the users that
+ * will be counted back in as they're adopted */
+void user_restore_shard(int id, long accepted, long currentUsers) {
+    __atomic_fetch_add(&shards[id].accepted, accepted - currentUsers,
+            __ATOMIC_RELAXED);
+}
+
+/* writes the worker pool's state, if there is one; see pool_report */
+void user_report_pool(FILE *out, int perWorker) {
+    if (pool != NULL) {
+        pool_report(out, pool, perWorker);
+    }
+}
+
+/* registers a shard for fdServer and spawns a thread to do
+ * user_process_connections on it
+ * for the epoll engine, also starts the loop threads it will feed:
+ * the -w loops are split evenly between shards
+ * the uring engine's loops do their own accepting, so there's no master
+ * thread; if the kernel can't do io_uring we use epoll instead
+ * the pool engine's workers are made once and shared by every shard
  */
-void user_begin_processing(int fdServer, ProgStats *ps) {
+void user_begin_processing(int fdServer, ProgStats *ps, UserConfig *cfg) {
     pthread_t threadId;
+    if (shardCount == MAX_SHARDS) {
+        fprintf(stderr, "Too many shards\n");
+        exit(1);
+    }
+    UserShard *shard = &shards[shardCount];
+    shard->id = shardCount;
+    shard->fd = fdServer;
+    shard->accepted = 0;
+    shard->currentUsers = 0;
+    shard->progStats = ps;
+    ++shardCount;
+
     UserMasterThreadArgs *args = malloc(sizeof(UserMasterThreadArgs));
-    args->fd = fdServer;
-    args->progStats = ps;
-    pthread_create(&threadId, NULL, user_process_connections,
+    args->shard = shard;
+    args->engine = cfg->engine;
+    args->loops = NULL;
+    args->pool = NULL;
+    int loops = cfg->loops / cfg->shards;
+    if (loops < 1) {
+        loops = 1;
+    }
+    if (cfg->engine == ENGINE_URING && !uring_supported()) {
+        fprintf(stderr, "io_uring unavailable, using epoll instead\n");
+        cfg->engine = args->engine = ENGINE_EPOLL;
+    }
+    if (cfg->engine == ENGINE_URING) {
+        uring_group_create(loops, shard);
+        uringInUse = 1;
+        free(args);
+        return;
+    }
+    if (cfg->engine == ENGINE_EPOLL) {
+        args->loops = loop_group_create(loops, shard);
+    }
+    if (cfg->engine == ENGINE_POOL) {
+        if (pool == NULL) {
+            pool = pool_create(cfg->poolWorkers, cfg->poolStackKb,
+                    cfg->poolDepth);
+        }
+        args->pool = pool;
+    }
+    masters[shard->id] = args;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int slot = placement_prepare(&attr, "acceptor", shard->id, shard->id);
+    pthread_create(&threadId, &attr, user_process_connections,
             (void*) args);
+    placement_started(slot, threadId);
+    pthread_attr_destroy(&attr);
     return;
 }
 
-/* accepts new connections on the listen port and spawns threads to handle them */
+/* hands a connection, freshly accepted or handed over, to its shard's
+ * engine, which owns it from then on */
+static void user_dispatch(UserMasterThreadArgs *args, Conn *conn) {
+    pthread_t threadId;
+    if (args->engine == ENGINE_EPOLL) {
+        loop_group_adopt(args->loops, conn);
+        return;
+    }
+
+    // the thread must free this
+    UserThreadArgs *threadArgs = slab_alloc(&argsSlab);
+    threadArgs->base = *conn;
+    threadArgs->shard = args->shard;
+    threadArgs->requeued = 0;
+    // counted and listed now rather than by its thread, so a handover
+    // can't miss it while it's queued or starting up
+    user_count_in(args->shard);
+    conn_register(&threadArgs->base);
+    timeout_watch(&threadArgs->base, args->shard->progStats);
+
+    if (args->engine == ENGINE_POOL) {
+        // only another shard's acceptor can have beaten us to the room
+        while (pool_submit(args->pool, user_serve, threadArgs)) {
+            pool_wait_space(args->pool, -1);
+        }
+        return;
+    }
+
+    // Start a new thread to deal with client communication, where its
+    // shard lives
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    placement_prepare(&attr, "user", args->shard->id, -1);
+    pthread_create(&threadId, &attr, user_client_thread, 
+            (void*) threadArgs);
+    pthread_attr_destroy(&attr);
+    pthread_detach(threadId);
+}
+
+/* takes on a connection from a handover: no welcome, it's had one */
+void user_adopt(Conn *conn) {
+    UserMasterThreadArgs *args = masters[conn->shard];
+    if (args->engine != ENGINE_EPOLL) {
+        // the old one may have been running it non-blocking
+        int flags = fcntl(conn->fd, F_GETFL);
+        if (flags >= 0) {
+            fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+    log_msg(LOG_LEVEL_INFO, "Adopted connection on fd %d, shard %d",
+            conn->fd, conn->shard);
+    user_dispatch(args, conn);
+}
+
+/* accepts new connections on the listen port and hands them to the engine:
+ * a new thread each, one of the epoll loops, or the worker pool
+ * with the pool, we don't accept while its queues are full
+ * past an admission limit we turn newcomers away, or with admit_pause
+ * don't accept them until we're back under it */
 void *user_process_connections(void *arg)
 {
     UserMasterThreadArgs *args = (UserMasterThreadArgs*) arg;
-    int fdServer = args->fd;
+    int fdServer = args->shard->fd;
     int fd;
-    UserThreadArgs *threadArgs;
+    Conn conn;
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
-    int error;
-    char hostname[MAX_HOST_NAME_LEN];
-    pthread_t threadId;
+    uint64_t acceptedAt;
+    ProgStats *ps = args->shard->progStats;
+    AdmitVerdict verdict;
+    int paused = 0;
 
+    handover_join();
     while(1) {
+        handover_checkpoint();
+        if (args->engine == ENGINE_POOL
+                && !pool_wait_space(args->pool, ACCEPT_POOL_WAIT_MS)) {
+            continue; // to the checkpoint: a handover may be waiting on us
+        }
+        if (admission_pausing()) {
+            if (user_admission() != ADMIT_OK) {
+                if (!paused) {
+                    paused = 1;
+                    stats_add(ps, STAT_ACCEPT_PAUSES, 1);
+                }
+                usleep(ADMISSION_PAUSE_MS * 1000);
+                continue;
+            }
+        }
+        paused = 0;
         fromAddrSize = sizeof(struct sockaddr_in);
 	// Block, wait for new connection 
 	// (fromAddr will be populated with client address details)
         fd = accept(fdServer, (struct sockaddr*)&fromAddr, &fromAddrSize);
+        if (fd < 0 && errno == EINTR) {
+            continue;
+        }
         if(fd < 0) {
             perror("Error accepting connection");
             exit(1);
         }
-        threadArgs = malloc(sizeof(UserThreadArgs)); // thread must free this
-        threadArgs->fd = fd;
-        threadArgs->progStats = args->progStats;
-     
-	// Convert IP address into hostname
-        error = getnameinfo((struct sockaddr*)&fromAddr, fromAddrSize, hostname,
-                MAX_HOST_NAME_LEN, NULL, 0, 0);
-        if(error) {
-            fprintf(stderr, "Error getting hostname: %s\n", 
-                    gai_strerror(error));
-        } else {
-            printf("Accepted connection from %s (%s), port %d\n", 
-                    inet_ntoa(fromAddr.sin_addr), hostname,
-                    ntohs(fromAddr.sin_port));
-	    write(fd, "Welcome...\n", 11);
-        }
-
-	// Start a new thread to deal with client communication
-	// Pass the connected file descriptor as an argument to
-	// the thread (cast to void*)
-	pthread_create(&threadId, NULL, user_client_thread, 
-		(void*) threadArgs);
-	pthread_detach(threadId);
+        acceptedAt = histo_now();
+        if (conn_local_peer(&fromAddr)) {
+            stats_add(ps, STAT_LOCAL_USERS, 1);
+        }
+        if (!admission_pausing()
+                && (verdict = user_admission()) != ADMIT_OK) {
+            admission_reject(fd, verdict, ps);
+            continue;
+        }
+	// Greet first: the hostname is only for our log, and is looked up
+	// (or found in the cache) without holding up the accept loop
+	write(fd, "Welcome...\n", 11);
+        histo_record(HISTO_ACCEPT_WELCOME, histo_now() - acceptedAt);
+        resolver_log_accept(&fromAddr, args->shard->id);
+
+        conn_init(&conn, fd, args->shard->id, &fromAddr, acceptedAt);
+        line_start(&conn.lines);
+        user_dispatch(args, &conn);
     }
     return NULL;
 }
@@ -13,19 +13,55 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include "shared.h"
+#include "loop.h"
+#include "pool.h"
+#include "uring.h"
+#include "resolver.h"
+#include "histo.h"
+#include "conn.h"
+#include "logger.h"
+#include "handover.h"
+#include "timeout.h"
+#include "slab.h"
+#include "station.h"
+#include "admission.h"
+#include "placement.h"
 
-#define MAX_HOST_NAME_LEN 128
+#define MAX_SHARDS 256
+#define ACCEPT_POOL_WAIT_MS 100 // between checkpoints while the pool's full
+
+/* how accepted user connections get serviced */
+typedef enum {
+    ENGINE_THREADS, // a blocking thread per connection (the original)
+    ENGINE_EPOLL, // a fixed set of epoll loop threads
+    ENGINE_URING, // a fixed set of io_uring loop threads, accepting too
+    ENGINE_POOL // blocking, but on a fixed pool of worker threads
+} UserEngine;
+
+/* user-side settings picked on the command line */
+typedef struct {
+    UserEngine engine;
+    int loops; // epoll/uring engines: number of loop threads in total
+    int shards; // SO_REUSEPORT listeners, each with its own accept loop
+    int poolWorkers; // pool engine: threads shared by every shard
+    int poolStackKb;
+    int poolDepth; // tasks each worker's deque holds
+} UserConfig;
 
 typedef struct {
-    int fd;
-    ProgStats* progStats;
+    Conn base;
+    UserShard* shard;
+    int requeued; // pool engine: sent to the back while throttled
 } UserThreadArgs;
 
 typedef struct {
-    int fd; // net socket we're listening on
-    ProgStats* progStats;
+    UserShard* shard; // holds the net socket we're listening on
+    UserEngine engine;
+    LoopGroup* loops; // NULL unless engine is ENGINE_EPOLL
+    WorkerPool* pool; // NULL unless engine is ENGINE_POOL
 } UserMasterThreadArgs;
 
 /* takes a hostname or IP, returns IP as an in_addr */
@@ -34,13 +70,37 @@ struct in_addr *name_to_ip_addr(char*);
 /* returns the file descriptor opened
  * if port is 0, an ephemeral port will be used and assigned to port
  * prints the port to stdout as per spec
+ * if reusePort is set, further listeners may bind the same address
  */
-int user_open_listen(int*, char*);
+int user_open_listen(int*, char*, int reusePort);
+/* the same, but a UDP socket for datagram echo (-u), not listening */
+int user_open_datagram(int*, char*, int reusePort);
+/* a listening AF_UNIX stream socket at path, for local users (-U) */
+int user_open_unix(char* path);
 
 /* a single thread for a single user: tied to a file descriptor */
 void* user_client_thread(void*);
-/* spawns the master thread for users */
-void user_begin_processing(int fdServer, ProgStats *ps);
+/* serves one user to the end on the calling thread (a pool task) */
+void user_serve(void*);
+/* turns "threads", "epoll", "uring" or "pool" into a UserEngine,
+ * or returns -1 */
+int user_parse_engine(const char*);
+/* makes a new shard for fdServer and spawns its master thread
+ * (and the engine's threads); call once per listener */
+void user_begin_processing(int fdServer, ProgStats *ps, UserConfig *cfg);
+/* writes a line per shard with its connection counts */
+void user_report_shards(FILE*);
+/* writes the worker pool's state, if there is one; see pool_report */
+void user_report_pool(FILE*, int perWorker);
+/* for handovers: the shards, and whether our engine can give them up */
+UserShard* user_shard(int id);
+int user_shard_count(void);
+int user_handover_ok(void);
+/* for handovers: carries a shard's counts over from the old process */
+void user_restore_shard(int id, long accepted, long currentUsers);
+/* for handovers: serves a live connection from the old process; its
+ * shard must have been begun already */
+void user_adopt(Conn*);
 /* is the master thread for users */
 void* user_process_connections(void*);
 
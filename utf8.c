@@ -0,0 +1,254 @@
+#define _GNU_SOURCE // newlocale, towupper_l
+#include <locale.h>
+#include <wctype.h>
+#include <stdint.h>
+#include <string.h>
+#include "utf8.h"
+#include "capitalise.h"
+
+#define UTF8_TWO_BYTE 0x800 // code points below here take two bytes at most
+#define UTF8_MAX 0x110000
+
+typedef struct {
+    uint32_t lo, hi; // code points, inclusive
+    int32_t delta; // added to each to upper-case it
+    uint32_t stride; // 1, or 2 for every other one from lo
+} CaseRange;
+
+static int16_t twoByte[UTF8_TWO_BYTE - 0x80]; // deltas for U+0080..U+07FF
+static CaseRange ranges[UTF8_RANGES_MAX]; // U+0800 and up, in order
+static int rangeCount = 0;
+static const char *source = "none";
+static locale_t utf8Locale;
+
+/* the common scripts' lower case, for when there's no C.UTF-8 locale */
+static const CaseRange builtin[] = {
+    // Latin-1 and Latin Extended-A
+    {0x00b5, 0x00b5, 743, 1}, {0x00e0, 0x00f6, -32, 1},
+    {0x00f8, 0x00fe, -32, 1}, {0x00ff, 0x00ff, 121, 1},
+    {0x0101, 0x012f, -1, 2}, {0x0131, 0x0131, -232, 1},
+    {0x0133, 0x0137, -1, 2}, {0x013a, 0x0148, -1, 2},
+    {0x014b, 0x0177, -1, 2}, {0x017a, 0x017e, -1, 2},
+    {0x017f, 0x017f, -300, 1},
+    // Latin Extended-B
+    {0x0180, 0x0180, 195, 1}, {0x0183, 0x0185, -1, 2},
+    {0x0188, 0x0188, -1, 1}, {0x018c, 0x018c, -1, 1},
+    {0x0192, 0x0192, -1, 1}, {0x0199, 0x0199, -1, 1},
+    {0x01a1, 0x01a5, -1, 2}, {0x01a8, 0x01a8, -1, 1},
+    {0x01ad, 0x01ad, -1, 1}, {0x01b0, 0x01b0, -1, 1},
+    {0x01b4, 0x01b6, -1, 2}, {0x01b9, 0x01b9, -1, 1},
+    {0x01bd, 0x01bd, -1, 1}, {0x01bf, 0x01bf, 56, 1},
+    {0x01c6, 0x01c6, -2, 1}, {0x01c9, 0x01c9, -2, 1},
+    {0x01cc, 0x01cc, -2, 1}, {0x01ce, 0x01dc, -1, 2},
+    {0x01dd, 0x01dd, -79, 1}, {0x01df, 0x01ef, -1, 2},
+    {0x01f3, 0x01f3, -2, 1}, {0x01f5, 0x01f5, -1, 1},
+    {0x01f9, 0x021f, -1, 2}, {0x0223, 0x0233, -1, 2},
+    // Greek
+    {0x03ac, 0x03ac, -38, 1}, {0x03ad, 0x03af, -37, 1},
+    {0x03b1, 0x03c1, -32, 1}, {0x03c2, 0x03c2, -31, 1},
+    {0x03c3, 0x03cb, -32, 1}, {0x03cc, 0x03cc, -64, 1},
+    {0x03cd, 0x03ce, -63, 1}, {0x03d9, 0x03ef, -1, 2},
+    // Cyrillic
+    {0x0430, 0x044f, -32, 1}, {0x0450, 0x045f, -80, 1},
+    {0x0461, 0x0481, -1, 2}, {0x048b, 0x04bf, -1, 2},
+    {0x04c2, 0x04ce, -1, 2}, {0x04cf, 0x04cf, -15, 1},
+    {0x04d1, 0x052f, -1, 2},
+    // Armenian
+    {0x0561, 0x0586, -48, 1},
+    // Latin Extended Additional, Greek Extended
+    {0x1e01, 0x1e95, -1, 2}, {0x1ea1, 0x1eff, -1, 2},
+    {0x1f00, 0x1f07, 8, 1}, {0x1f10, 0x1f15, 8, 1},
+    {0x1f20, 0x1f27, 8, 1}, {0x1f30, 0x1f37, 8, 1},
+    {0x1f40, 0x1f45, 8, 1}, {0x1f60, 0x1f67, 8, 1},
+    // Roman numerals, circled letters, Glagolitic, Georgian, fullwidth,
+    // Deseret
+    {0x2170, 0x217f, -16, 1}, {0x24d0, 0x24e9, -26, 1},
+    {0x2c30, 0x2c5f, -48, 1}, {0x2d00, 0x2d25, -7264, 1},
+    {0xff41, 0xff5a, -32, 1}, {0x10428, 0x1044f, -40, 1},
+};
+
+static size_t utf8_len(uint32_t cp) {
+    return cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+}
+
+static uint32_t builtin_upper(uint32_t cp) {
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); ++i) {
+        const CaseRange *r = &builtin[i];
+        if (cp >= r->lo && cp <= r->hi && (cp - r->lo) % r->stride == 0) {
+            return cp + r->delta;
+        }
+    }
+    return cp;
+}
+
+static uint32_t locale_upper(uint32_t cp) {
+    return towupper_l(cp, utf8Locale);
+}
+
+/* adds cp's delta, extending the last range if it fits */
+static void utf8_add_range(uint32_t cp, int32_t delta) {
+    CaseRange *r = rangeCount ? &ranges[rangeCount - 1] : NULL;
+    if (r != NULL && r->delta == delta) {
+        if (r->lo == r->hi && cp - r->hi <= 2) {
+            r->stride = cp - r->hi;
+            r->hi = cp;
+            return;
+        }
+        if (cp - r->hi == r->stride) {
+            r->hi = cp;
+            return;
+        }
+    }
+    if (rangeCount < UTF8_RANGES_MAX) {
+        ranges[rangeCount++] = (CaseRange) {cp, cp, delta, 1};
+    }
+}
+
+void utf8_init(void) {
+    uint32_t (*upper)(uint32_t) = builtin_upper;
+    source = "builtin";
+    utf8Locale = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t) 0);
+    if (utf8Locale != (locale_t) 0 && towupper_l(0xe9, utf8Locale) == 0xc9) {
+        upper = locale_upper;
+        source = "C.UTF-8";
+    }
+    for (uint32_t cp = 0x80; cp < UTF8_MAX; ++cp) {
+        if (cp >= 0xd800 && cp < 0xe000) {
+            continue; // surrogates aren't characters
+        }
+        uint32_t up = upper(cp);
+        // done in place: no room for a capital that's longer
+        if (up == cp || up >= UTF8_MAX || utf8_len(up) > utf8_len(cp)) {
+            continue;
+        }
+        if (cp < UTF8_TWO_BYTE) {
+            twoByte[cp - 0x80] = up - cp;
+        } else {
+            utf8_add_range(cp, up - cp);
+        }
+    }
+}
+
+const char *utf8_source(void) {
+    return source;
+}
+
+size_t utf8_table_bytes(void) {
+    return sizeof(twoByte) + rangeCount * sizeof(CaseRange);
+}
+
+static uint32_t utf8_upper_of(uint32_t cp) {
+    if (cp < UTF8_TWO_BYTE) {
+        return cp + twoByte[cp - 0x80];
+    }
+    int lo = 0, hi = rangeCount - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const CaseRange *r = &ranges[mid];
+        if (cp < r->lo) {
+            hi = mid - 1;
+        } else if (cp > r->hi) {
+            lo = mid + 1;
+        } else {
+            return (cp - r->lo) % r->stride ? cp : cp + r->delta;
+        }
+    }
+    return cp;
+}
+
+/* the sequence starting at p, with n bytes to hand: sets *cp and returns
+ * its length, or returns 0 if it isn't whole and valid */
+static size_t utf8_decode(const unsigned char *p, size_t n, uint32_t *cp) {
+    unsigned char c = p[0];
+    size_t len;
+    uint32_t v, min;
+    if (c >= 0xc2 && c < 0xe0) {
+        len = 2, v = c & 0x1f, min = 0x80;
+    } else if (c >= 0xe0 && c < 0xf0) {
+        len = 3, v = c & 0x0f, min = 0x800;
+    } else if (c >= 0xf0 && c < 0xf5) {
+        len = 4, v = c & 0x07, min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (len > n) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        v = v << 6 | (p[i] & 0x3f);
+    }
+    if (v < min || v >= UTF8_MAX || (v >= 0xd800 && v < 0xe000)) {
+        return 0; // overlong, too big, or a surrogate
+    }
+    *cp = v;
+    return len;
+}
+
+static size_t utf8_encode(unsigned char *p, uint32_t cp) {
+    if (cp < 0x80) {
+        p[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        p[0] = 0xc0 | cp >> 6;
+        p[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        p[0] = 0xe0 | cp >> 12;
+        p[1] = 0x80 | (cp >> 6 & 0x3f);
+        p[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    p[0] = 0xf0 | cp >> 18;
+    p[1] = 0x80 | (cp >> 12 & 0x3f);
+    p[2] = 0x80 | (cp >> 6 & 0x3f);
+    p[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* the output never overtakes the input: capitals are never longer */
+size_t utf8_upper(char *buffer, size_t len) {
+    unsigned char *p = (unsigned char*) buffer;
+    size_t in = 0, out = 0;
+    while (in < len) {
+        size_t run = capitalise_ascii_run(buffer + in, len - in);
+        if (out != in) {
+            memmove(buffer + out, buffer + in, run);
+        }
+        in += run;
+        out += run;
+        // then the multibyte sequences, up to the next ASCII
+        while (in < len && p[in] >= 0x80) {
+            uint32_t cp, up;
+            size_t n = utf8_decode(p + in, len - in, &cp);
+            if (n == 0) {
+                p[out++] = p[in++]; // not UTF-8: as it is
+            } else if ((up = utf8_upper_of(cp)) != cp) {
+                out += utf8_encode(p + out, up);
+                in += n;
+            } else {
+                for (size_t i = 0; i < n; ++i) {
+                    p[out++] = p[in++];
+                }
+            }
+        }
+    }
+    return out;
+}
+
+size_t utf8_whole(const char *buffer, size_t len) {
+    const unsigned char *p = (const unsigned char*) buffer;
+    for (size_t back = 1; back <= 3 && back <= len; ++back) {
+        unsigned char c = p[len - back];
+        if ((c & 0xc0) == 0x80) {
+            continue; // a continuation: its lead is further back
+        }
+        size_t need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+        return need > back ? len - back : len;
+    }
+    return len;
+}
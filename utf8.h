@@ -0,0 +1,36 @@
+#ifndef UTF8_H_
+#define UTF8_H_
+/* vim: set filetype=c : */
+
+/* UTF-8 upper-casing, for the utf8upper stage of the echo pipeline.
+ *
+ * Runs of ASCII go through capitalise's vector run kernel, so text that's
+ * all ASCII costs about what capitalise() does. Only multibyte sequences
+ * are decoded and looked up: two-byte ones (Latin, Greek, Cyrillic,
+ * Armenian, Hebrew, Arabic) in a direct table of deltas, 4KB, and the
+ * rest by binary search of a few hundred ranges, 2KB or so. Both are
+ * built at startup from towupper_l() in the C.UTF-8 locale, or from a
+ * builtin table of the common scripts where there's no such locale.
+ *
+ * Everything is done in place, so a letter whose capital takes more
+ * bytes (a handful, e.g. U+0250) is left alone. Sequences that aren't
+ * valid UTF-8 go through untouched. One cut off by the end of a buffer
+ * is left for the caller to carry over to the next (transform.h).
+ */
+
+#include <stddef.h>
+
+#define UTF8_RANGES_MAX 1024
+
+/* builds the tables; call once before any utf8_upper() */
+void utf8_init(void);
+/* where the tables came from, and how big they are */
+const char *utf8_source(void);
+size_t utf8_table_bytes(void);
+/* upper-cases buffer in place; returns its new length */
+size_t utf8_upper(char* buffer, size_t len);
+/* how much of buffer is whole sequences: it's len, less any sequence
+ * cut off at the end */
+size_t utf8_whole(const char* buffer, size_t len);
+
+#endif